@@ -10,6 +10,7 @@
 #include <limits.h>
 #include "tecnicofs_client_api.h"
 #include "common/common.h"
+#include "fs/config.h"
 
 int session_id = -1;
 int output;
@@ -115,6 +116,10 @@ int tfs_open(char const *name, int flags) {
         return -1;
     }
 
+    if (strlen(name) > FILENAME_SIZE) {
+        return -1;
+    }
+
     // Write
     size_t msg_size = sizeof(char) * (1 + FILENAME_SIZE) + sizeof(int) * 2;
     char* msg = (char*) malloc(msg_size);
@@ -287,6 +292,235 @@ ssize_t tfs_read(int fhandle, void *buffer, size_t len) {
     return count;
 }
 
+ssize_t tfs_pwrite(int fhandle, void const *buffer, size_t len, size_t offset) {
+
+    if (session_id == -1) {
+        return -1;
+    }
+
+    fprintf(stderr, "[Client @%d]: Pwrite requested\n", session_id);
+
+    // Write
+
+    // Truncate if write might not be atomic
+    if (TFS_PWRITE_SIZE_BEFORE_MESSAGE + len > PIPE_BUF) {
+        len = PIPE_BUF - TFS_PWRITE_SIZE_BEFORE_MESSAGE;
+    }
+    size_t msg_size = TFS_PWRITE_SIZE_BEFORE_MESSAGE + sizeof(char) * len;
+    char* msg = (char*) malloc(msg_size);
+    msg[0] = TFS_OP_CODE_PWRITE;
+    memcpy(msg + sizeof(char), &session_id, sizeof(int));
+    memcpy(msg + sizeof(char) + sizeof(int), &fhandle, sizeof(int));
+    memcpy(msg + sizeof(char) + sizeof(int) * 2, &len, sizeof(size_t));
+    memcpy(msg + sizeof(char) + sizeof(int) * 2 + sizeof(size_t), &offset, sizeof(size_t));
+    memcpy(msg + TFS_PWRITE_SIZE_BEFORE_MESSAGE, buffer, sizeof(char) * len);
+
+    if (write(output, msg, msg_size) != msg_size) {
+        free(msg);
+        return -1;
+    }
+    free(msg);
+
+    // Read
+    ssize_t ret;
+    ssize_t read_ret = read(input, (void*) &ret, sizeof(ssize_t));
+
+    if (read_ret == 0) {
+        return -2;
+    }
+
+    if (read_ret != sizeof(ssize_t)) {
+        return -1;
+    }
+
+    fprintf(stderr, "[Client @%d]: Pwrite terminated\n", session_id);
+
+    return ret;
+}
+
+ssize_t tfs_pread(int fhandle, void *buffer, size_t len, size_t offset) {
+
+    if (session_id == -1) {
+        return -1;
+    }
+
+    // Files hold at most a block, and the server rejects longer reads
+    if (len > BLOCK_SIZE) {
+        len = BLOCK_SIZE;
+    }
+
+    // Write
+    char msg[TFS_PREAD_SIZE];
+    msg[0] = TFS_OP_CODE_PREAD;
+    memcpy(msg + sizeof(char), &session_id, sizeof(int));
+    memcpy(msg + sizeof(char) + sizeof(int), &fhandle, sizeof(int));
+    memcpy(msg + sizeof(char) + sizeof(int) * 2, &len, sizeof(size_t));
+    memcpy(msg + sizeof(char) + sizeof(int) * 2 + sizeof(size_t), &offset, sizeof(size_t));
+
+    if (write(output, msg, TFS_PREAD_SIZE) != TFS_PREAD_SIZE) {
+        fprintf(stderr, "[Client @%d]: Pread failed\n", session_id);
+        return -1;
+    }
+
+    // Read
+    ssize_t count;
+    ssize_t read_ret = read(input, (void*) &count, sizeof(ssize_t));
+
+    if (read_ret == 0) {
+        return -2;
+    }
+
+    if (read_ret != sizeof(ssize_t)) {
+        return -1;
+    }
+
+    if (count <= 0) {
+        return count;
+    }
+
+    // The contents go straight into the caller's buffer
+    read_ret = read(input, buffer, sizeof(char) * (size_t) count);
+
+    if (read_ret == 0) {
+        return -2;
+    }
+
+    if (read_ret != sizeof(char) * (size_t) count) {
+        return -1;
+    }
+
+    fprintf(stderr, "[Client @%d]: Pread return: %ld\n", session_id, count);
+
+    return count;
+}
+
+ssize_t tfs_writev(int fhandle, struct iovec const *iov, int iovcnt) {
+
+    if (session_id == -1 || iovcnt < 0 || iovcnt > TFS_IOV_MAX) {
+        return -1;
+    }
+
+    fprintf(stderr, "[Client @%d]: Writev requested\n", session_id);
+
+    // Write
+
+    // The header is sent together with the caller's buffers, without copying
+    // them into a single message
+    char header[TFS_WRITEV_SIZE_BEFORE_LENGTHS + sizeof(size_t) * TFS_IOV_MAX];
+    struct iovec msg[TFS_IOV_MAX + 1];
+    size_t header_size =
+        TFS_WRITEV_SIZE_BEFORE_LENGTHS + sizeof(size_t) * (size_t) iovcnt;
+
+    header[0] = TFS_OP_CODE_WRITEV;
+    memcpy(header + sizeof(char), &session_id, sizeof(int));
+    memcpy(header + sizeof(char) + sizeof(int), &fhandle, sizeof(int));
+    memcpy(header + sizeof(char) + sizeof(int) * 2, &iovcnt, sizeof(int));
+
+    // Truncate if write might not be atomic
+    size_t room = PIPE_BUF - header_size;
+    size_t msg_size = header_size;
+    for (int i = 0; i < iovcnt; i++) {
+        size_t len = iov[i].iov_len < room ? iov[i].iov_len : room;
+        room -= len;
+        msg_size += len;
+
+        memcpy(header + TFS_WRITEV_SIZE_BEFORE_LENGTHS + sizeof(size_t) * (size_t) i,
+               &len, sizeof(size_t));
+        msg[i + 1].iov_base = iov[i].iov_base;
+        msg[i + 1].iov_len = len;
+    }
+    msg[0].iov_base = header;
+    msg[0].iov_len = header_size;
+
+    if (writev(output, msg, iovcnt + 1) != msg_size) {
+        return -1;
+    }
+
+    // Read
+    ssize_t ret;
+    ssize_t read_ret = read(input, (void*) &ret, sizeof(ssize_t));
+
+    if (read_ret == 0) {
+        return -2;
+    }
+
+    if (read_ret != sizeof(ssize_t)) {
+        return -1;
+    }
+
+    fprintf(stderr, "[Client @%d]: Writev terminated\n", session_id);
+
+    return ret;
+}
+
+ssize_t tfs_readv(int fhandle, struct iovec const *iov, int iovcnt) {
+
+    if (session_id == -1 || iovcnt < 0 || iovcnt > TFS_IOV_MAX) {
+        return -1;
+    }
+
+    // Write
+    char msg[TFS_READV_SIZE_BEFORE_LENGTHS + sizeof(size_t) * TFS_IOV_MAX];
+    size_t msg_size =
+        TFS_READV_SIZE_BEFORE_LENGTHS + sizeof(size_t) * (size_t) iovcnt;
+
+    msg[0] = TFS_OP_CODE_READV;
+    memcpy(msg + sizeof(char), &session_id, sizeof(int));
+    memcpy(msg + sizeof(char) + sizeof(int), &fhandle, sizeof(int));
+    memcpy(msg + sizeof(char) + sizeof(int) * 2, &iovcnt, sizeof(int));
+    for (int i = 0; i < iovcnt; i++) {
+        memcpy(msg + TFS_READV_SIZE_BEFORE_LENGTHS + sizeof(size_t) * (size_t) i,
+               &iov[i].iov_len, sizeof(size_t));
+    }
+
+    if (write(output, msg, msg_size) != msg_size) {
+        fprintf(stderr, "[Client @%d]: Readv failed\n", session_id);
+        return -1;
+    }
+
+    // Read
+    ssize_t count;
+    ssize_t read_ret = read(input, (void*) &count, sizeof(ssize_t));
+
+    if (read_ret == 0) {
+        return -2;
+    }
+
+    if (read_ret != sizeof(ssize_t)) {
+        return -1;
+    }
+
+    if (count <= 0) {
+        return count;
+    }
+
+    // The contents are scattered straight into the caller's buffers
+    struct iovec dest[TFS_IOV_MAX];
+    size_t remaining = (size_t) count;
+    int dest_count = 0;
+    for (int i = 0; i < iovcnt && remaining > 0; i++) {
+        dest[dest_count].iov_base = iov[i].iov_base;
+        dest[dest_count].iov_len =
+            iov[i].iov_len < remaining ? iov[i].iov_len : remaining;
+        remaining -= dest[dest_count].iov_len;
+        dest_count++;
+    }
+
+    read_ret = readv(input, dest, dest_count);
+
+    if (read_ret == 0) {
+        return -2;
+    }
+
+    if (read_ret != count) {
+        return -1;
+    }
+
+    fprintf(stderr, "[Client @%d]: Readv return: %ld\n", session_id, count);
+
+    return count;
+}
+
 int tfs_shutdown_after_all_closed() {
 
     if (session_id == -1) {
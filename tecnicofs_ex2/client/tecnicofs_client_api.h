@@ -3,6 +3,7 @@
 
 #include "common/common.h"
 #include <sys/types.h>
+#include <sys/uio.h>
 
 #define PIPE_SIZE 40
 
@@ -74,6 +75,59 @@ ssize_t tfs_write(int fhandle, void const *buffer, size_t len);
  */
 ssize_t tfs_read(int fhandle, void *buffer, size_t len);
 
+/* Writes to an open file, starting at a given offset, without using or
+ * changing the offset of the file handle
+ * Input:
+ * 	- file handle (obtained from a previous call to tfs_open)
+ * 	- buffer containing the contents to write
+ * 	- length of the contents (in bytes)
+ * 	- offset in the file where the write starts
+ *
+ * Returns the number of bytes that were written (can be lower than
+ * 'len' if the maximum file size is exceeded), or -1 in case of error.
+ */
+ssize_t tfs_pwrite(int fhandle, void const *buffer, size_t len, size_t offset);
+
+/* Reads from an open file, starting at a given offset, without using or
+ * changing the offset of the file handle
+ * Input:
+ * 	- file handle (obtained from a previous call to tfs_open)
+ * 	- destination buffer
+ * 	- length of the buffer
+ * 	- offset in the file where the read starts
+ *
+ * Returns the number of bytes that were copied from the file to the buffer
+ * (can be lower than 'len' if the file size was reached), or -1 in case of
+ * error.
+ */
+ssize_t tfs_pread(int fhandle, void *buffer, size_t len, size_t offset);
+
+/* Writes several buffers to an open file, as a single operation, starting at
+ * the current offset
+ * Input:
+ * 	- file handle (obtained from a previous call to tfs_open)
+ * 	- array of buffers (and their lengths) to write, in order
+ * 	- number of buffers in the array (at most TFS_IOV_MAX)
+ *
+ * Returns the total number of bytes that were written (can be lower than the
+ * sum of the lengths if the maximum file size is exceeded), or -1 in case of
+ * error.
+ */
+ssize_t tfs_writev(int fhandle, struct iovec const *iov, int iovcnt);
+
+/* Reads from an open file into several buffers, as a single operation,
+ * starting at the current offset
+ * Input:
+ * 	- file handle (obtained from a previous call to tfs_open)
+ * 	- array of destination buffers (and their lengths), filled in order
+ * 	- number of buffers in the array (at most TFS_IOV_MAX)
+ *
+ * Returns the total number of bytes that were copied from the file (can be
+ * lower than the sum of the lengths if the file size was reached), or -1 in
+ * case of error.
+ */
+ssize_t tfs_readv(int fhandle, struct iovec const *iov, int iovcnt);
+
 /*
  * Orders TecnicoFS server to wait until no file is open and then shutdown
  * Returns 0 if successful, -1 otherwise.
@@ -1,7 +1,7 @@
 #ifndef COMMON_H
 #define COMMON_H
 
-#define FILENAME_SIZE 40
+#define FILENAME_SIZE 256
 
 /* tfs_open flags */
 enum {
@@ -18,16 +18,28 @@ enum {
     TFS_OP_CODE_CLOSE = 4,
     TFS_OP_CODE_WRITE = 5,
     TFS_OP_CODE_READ = 6,
-    TFS_OP_CODE_SHUTDOWN_AFTER_ALL_CLOSED = 7
+    TFS_OP_CODE_SHUTDOWN_AFTER_ALL_CLOSED = 7,
+    TFS_OP_CODE_PWRITE = 8,
+    TFS_OP_CODE_PREAD = 9,
+    TFS_OP_CODE_WRITEV = 10,
+    TFS_OP_CODE_READV = 11
 };
 
+/* maximum number of buffers in a vectored request */
+#define TFS_IOV_MAX 64
+
 /* operation message sizes (for client-server requests) */
 #define TFS_MOUNT_SIZE (sizeof(char) * 41)
 #define TFS_UNMOUNT_SIZE (sizeof(char) + sizeof(int))
-#define TFS_OPEN_SIZE (sizeof(char) * 41 + sizeof(int) * 2)
+#define TFS_OPEN_SIZE (sizeof(char) * (1 + FILENAME_SIZE) + sizeof(int) * 2)
 #define TFS_CLOSE_SIZE (sizeof(char) + sizeof(int) * 2)
 #define TFS_WRITE_SIZE_BEFORE_MESSAGE (sizeof(char) + sizeof(int) * 2 + sizeof(size_t))
 #define TFS_READ_SIZE (sizeof(char) + sizeof(int) * 2 + sizeof(size_t))
 #define TFS_SHUTDOWN_AFTER_ALL_CLOSED_SIZE (sizeof(char) + sizeof(int))
+#define TFS_PWRITE_SIZE_BEFORE_MESSAGE (sizeof(char) + sizeof(int) * 2 + sizeof(size_t) * 2)
+#define TFS_PREAD_SIZE (sizeof(char) + sizeof(int) * 2 + sizeof(size_t) * 2)
+/* vectored requests carry the number of buffers, then each buffer's length */
+#define TFS_WRITEV_SIZE_BEFORE_LENGTHS (sizeof(char) + sizeof(int) * 3)
+#define TFS_READV_SIZE_BEFORE_LENGTHS (sizeof(char) + sizeof(int) * 3)
 
 #endif /* COMMON_H */
\ No newline at end of file
@@ -0,0 +1,863 @@
+#define _GNU_SOURCE /* fallocate */
+
+#include "block_device.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Latency model of the emulated storage. Each access costs a fixed time,
+ * lower when it starts where the previous one ended (sequential) than when
+ * it does not (random), plus the time to transfer its bytes, which accesses
+ * share when the bandwidth is limited. At most lm_queue_depth accesses are
+ * served at once; the others wait for a free slot.
+ * Waiting threads sleep (or yield, for short waits) instead of spinning.
+ */
+static latency_model_t const latency_profiles[] = {
+    /* name, sequential, random, queue depth, bandwidth */
+    {"none", 0, 0, 0, 0},
+    {"default", DELAY_NS, DELAY_NS, 0, 0},
+    {"ssd", 10000, 80000, 32, 2000000000},
+    {"hdd", 50000, 8000000, 1, 150000000},
+};
+
+static latency_model_t latency_model = {"default", DELAY_NS, DELAY_NS, 0, 0};
+
+/* End of the last access, to tell sequential accesses apart */
+static atomic_size_t storage_head;
+
+/* Queue slots and the transfer channel, when limited */
+static pthread_mutex_t storage_queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t storage_slot_freed = PTHREAD_COND_INITIALIZER;
+static unsigned storage_in_service;
+static uint64_t storage_channel_free; /* when the transfers so far end */
+
+/* Waits shorter than this yield instead of sleeping, as sleeps overshoot */
+#define STORAGE_SLEEP_THRESHOLD_NS (50000)
+
+static uint64_t storage_now() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+}
+
+static void storage_wait_until(uint64_t deadline) {
+    uint64_t now = storage_now();
+
+    if (deadline > now + STORAGE_SLEEP_THRESHOLD_NS) {
+        struct timespec until = {(time_t)(deadline / 1000000000u),
+                                 (long)(deadline % 1000000000u)};
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &until, NULL) ==
+               EINTR) {
+        }
+        now = storage_now();
+    }
+
+    while (now < deadline) {
+        sched_yield();
+        now = storage_now();
+    }
+}
+
+/*
+ * Sets the latency model of the emulated storage. Must not be called while
+ * the file system is in use.
+ * Input:
+ *  - spec: a profile ("none", "default", "ssd" or "hdd"), or
+ *    "SEQUENTIAL_NS:RANDOM_NS:QUEUE_DEPTH:BYTES_PER_SECOND" (0 for no limit
+ *    in the last two); NULL or "" for the default profile
+ * Returns: 0 if successful, -1 otherwise
+ */
+int latency_model_set(char const *spec) {
+    if (spec == NULL || strcmp(spec, "") == 0) {
+        spec = "default";
+    }
+
+    for (size_t i = 0;
+         i < sizeof(latency_profiles) / sizeof(latency_profiles[0]); i++) {
+        if (strcmp(spec, latency_profiles[i].lm_name) == 0) {
+            latency_model = latency_profiles[i];
+            return 0;
+        }
+    }
+
+    unsigned long long sequential, random, bandwidth;
+    unsigned queue_depth;
+    char end;
+    if (sscanf(spec, "%llu:%llu:%u:%llu%c", &sequential, &random, &queue_depth,
+               &bandwidth, &end) != 4) {
+        return -1;
+    }
+
+    latency_model.lm_name = "custom";
+    latency_model.lm_sequential_ns = sequential;
+    latency_model.lm_random_ns = random;
+    latency_model.lm_queue_depth = queue_depth;
+    latency_model.lm_bandwidth = bandwidth;
+    return 0;
+}
+
+latency_model_t const *latency_model_get() { return &latency_model; }
+
+/*
+ * Emulates an access to the storage, waiting as long as it would take
+ * Input:
+ *  - position: where the access starts (in bytes, from the start of the
+ *    storage)
+ *  - len: number of bytes accessed
+ */
+void storage_access(size_t position, size_t len) {
+    latency_model_t const *model = &latency_model;
+    bool sequential =
+        atomic_exchange(&storage_head, position + len) == position;
+    uint64_t cost =
+        sequential ? model->lm_sequential_ns : model->lm_random_ns;
+
+    if (model->lm_queue_depth == 0 && model->lm_bandwidth == 0) {
+        if (cost > 0) {
+            storage_wait_until(storage_now() + cost);
+        }
+        return;
+    }
+
+    pthread_mutex_lock(&storage_queue_lock);
+    while (model->lm_queue_depth != 0 &&
+           storage_in_service == model->lm_queue_depth) {
+        pthread_cond_wait(&storage_slot_freed, &storage_queue_lock);
+    }
+    storage_in_service++;
+
+    uint64_t now = storage_now();
+    uint64_t deadline = now + cost;
+    if (model->lm_bandwidth != 0) {
+        uint64_t start =
+            storage_channel_free > now ? storage_channel_free : now;
+        storage_channel_free =
+            start + (uint64_t)len * 1000000000u / model->lm_bandwidth;
+        if (storage_channel_free > deadline) {
+            deadline = storage_channel_free;
+        }
+    }
+    pthread_mutex_unlock(&storage_queue_lock);
+
+    storage_wait_until(deadline);
+
+    pthread_mutex_lock(&storage_queue_lock);
+    storage_in_service--;
+    pthread_cond_signal(&storage_slot_freed);
+    pthread_mutex_unlock(&storage_queue_lock);
+}
+
+/*
+ * In-memory device, which emulates the latency of secondary memory
+ */
+typedef struct {
+    block_device_t md_device;
+    char *md_data;
+} memory_device_t;
+
+static int memory_read_block(block_device_t *device, int block_number,
+                             size_t offset, void *buffer, size_t len) {
+    memory_device_t *memory = (memory_device_t *)device;
+
+    // simulate storage access delay to block
+    storage_access((size_t)block_number * BLOCK_SIZE + offset, len);
+    memcpy(buffer, memory->md_data + (size_t)block_number * BLOCK_SIZE + offset,
+           len);
+    return 0;
+}
+
+static int memory_write_block(block_device_t *device, int block_number,
+                              size_t offset, void const *buffer, size_t len) {
+    memory_device_t *memory = (memory_device_t *)device;
+
+    // simulate storage access delay to block
+    storage_access((size_t)block_number * BLOCK_SIZE + offset, len);
+    memcpy(memory->md_data + (size_t)block_number * BLOCK_SIZE + offset, buffer,
+           len);
+    return 0;
+}
+
+static int memory_flush(block_device_t *device) {
+    (void)device;
+    return 0;
+}
+
+static int memory_discard(block_device_t *device, int block_number) {
+    memory_device_t *memory = (memory_device_t *)device;
+
+    memset(memory->md_data + (size_t)block_number * BLOCK_SIZE, 0, BLOCK_SIZE);
+    return 0;
+}
+
+static void memory_close(block_device_t *device) {
+    memory_device_t *memory = (memory_device_t *)device;
+
+    free(memory->md_data);
+    free(memory);
+}
+
+static block_device_ops_t const memory_ops = {
+    memory_read_block, memory_write_block, memory_flush, memory_discard,
+    memory_close,
+};
+
+static block_device_t *memory_open(size_t blocks) {
+    memory_device_t *memory = malloc(sizeof(memory_device_t));
+    if (memory == NULL) {
+        return NULL;
+    }
+
+    memory->md_data = calloc(blocks, BLOCK_SIZE);
+    if (memory->md_data == NULL) {
+        free(memory);
+        return NULL;
+    }
+
+    return &memory->md_device;
+}
+
+/*
+ * Creates the file backing a device, with all its blocks zeroed, or opens an
+ * existing one, keeping its blocks (it must hold all of them)
+ * Returns the file descriptor, -1 if failed
+ */
+static int backing_file_open(char const *path, size_t blocks, bool keep) {
+    int fd = open(path, keep ? O_RDWR : O_RDWR | O_CREAT | O_TRUNC, 0640);
+    if (fd == -1) {
+        return -1;
+    }
+
+    if (keep) {
+        struct stat st;
+        if (fstat(fd, &st) == -1 ||
+            (size_t)st.st_size < blocks * BLOCK_SIZE) {
+            close(fd);
+            return -1;
+        }
+    } else if (ftruncate(fd, (off_t)(blocks * BLOCK_SIZE)) == -1) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+/*
+ * Zeroes a block of a backing file, by punching a hole in it when the file
+ * system supports that
+ */
+static int backing_file_discard(int fd, int block_number) {
+    off_t offset = (off_t)block_number * BLOCK_SIZE;
+
+    if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset,
+                  BLOCK_SIZE) == 0) {
+        return 0;
+    }
+
+    static char const zeros[BLOCK_SIZE];
+    return pwrite(fd, zeros, BLOCK_SIZE, offset) == BLOCK_SIZE ? 0 : -1;
+}
+
+/*
+ * Device backed by a file, accessed with pread and pwrite
+ */
+typedef struct {
+    block_device_t fd_device;
+    int fd_fd;
+} file_device_t;
+
+static int file_read_block(block_device_t *device, int block_number,
+                           size_t offset, void *buffer, size_t len) {
+    file_device_t *file = (file_device_t *)device;
+    off_t position = (off_t)((size_t)block_number * BLOCK_SIZE + offset);
+
+    for (size_t done = 0; done < len;) {
+        ssize_t ret = pread(file->fd_fd, (char *)buffer + done, len - done,
+                            position + (off_t)done);
+        if (ret <= 0) {
+            return -1;
+        }
+        done += (size_t)ret;
+    }
+
+    return 0;
+}
+
+static int file_write_block(block_device_t *device, int block_number,
+                            size_t offset, void const *buffer, size_t len) {
+    file_device_t *file = (file_device_t *)device;
+    off_t position = (off_t)((size_t)block_number * BLOCK_SIZE + offset);
+
+    for (size_t done = 0; done < len;) {
+        ssize_t ret = pwrite(file->fd_fd, (char const *)buffer + done,
+                             len - done, position + (off_t)done);
+        if (ret <= 0) {
+            return -1;
+        }
+        done += (size_t)ret;
+    }
+
+    return 0;
+}
+
+static int file_flush(block_device_t *device) {
+    return fdatasync(((file_device_t *)device)->fd_fd);
+}
+
+static int file_discard(block_device_t *device, int block_number) {
+    return backing_file_discard(((file_device_t *)device)->fd_fd,
+                                block_number);
+}
+
+static void file_close(block_device_t *device) {
+    file_device_t *file = (file_device_t *)device;
+
+    close(file->fd_fd);
+    free(file);
+}
+
+static block_device_ops_t const file_ops = {
+    file_read_block, file_write_block, file_flush, file_discard, file_close,
+};
+
+static block_device_t *file_open(char const *path, size_t blocks,
+                                 bool keep) {
+    file_device_t *file = malloc(sizeof(file_device_t));
+    if (file == NULL) {
+        return NULL;
+    }
+
+    file->fd_fd = backing_file_open(path, blocks, keep);
+    if (file->fd_fd == -1) {
+        free(file);
+        return NULL;
+    }
+
+    return &file->fd_device;
+}
+
+/*
+ * Device backed by a file mapped in memory
+ */
+typedef struct {
+    block_device_t mm_device;
+    int mm_fd;
+    char *mm_data;
+    size_t mm_size;
+} mmap_device_t;
+
+static int mmap_read_block(block_device_t *device, int block_number,
+                           size_t offset, void *buffer, size_t len) {
+    mmap_device_t *mapped = (mmap_device_t *)device;
+
+    memcpy(buffer, mapped->mm_data + (size_t)block_number * BLOCK_SIZE + offset,
+           len);
+    return 0;
+}
+
+static int mmap_write_block(block_device_t *device, int block_number,
+                            size_t offset, void const *buffer, size_t len) {
+    mmap_device_t *mapped = (mmap_device_t *)device;
+
+    memcpy(mapped->mm_data + (size_t)block_number * BLOCK_SIZE + offset, buffer,
+           len);
+    return 0;
+}
+
+static int mmap_flush(block_device_t *device) {
+    mmap_device_t *mapped = (mmap_device_t *)device;
+
+    return msync(mapped->mm_data, mapped->mm_size, MS_SYNC);
+}
+
+static int mmap_discard(block_device_t *device, int block_number) {
+    mmap_device_t *mapped = (mmap_device_t *)device;
+
+    memset(mapped->mm_data + (size_t)block_number * BLOCK_SIZE, 0, BLOCK_SIZE);
+    return 0;
+}
+
+static void mmap_close(block_device_t *device) {
+    mmap_device_t *mapped = (mmap_device_t *)device;
+
+    munmap(mapped->mm_data, mapped->mm_size);
+    close(mapped->mm_fd);
+    free(mapped);
+}
+
+static block_device_ops_t const mmap_ops = {
+    mmap_read_block, mmap_write_block, mmap_flush, mmap_discard, mmap_close,
+};
+
+static block_device_t *mmap_open(char const *path, size_t blocks,
+                                 bool keep) {
+    mmap_device_t *mapped = malloc(sizeof(mmap_device_t));
+    if (mapped == NULL) {
+        return NULL;
+    }
+
+    mapped->mm_fd = backing_file_open(path, blocks, keep);
+    if (mapped->mm_fd == -1) {
+        free(mapped);
+        return NULL;
+    }
+
+    mapped->mm_size = blocks * BLOCK_SIZE;
+    mapped->mm_data = mmap(NULL, mapped->mm_size, PROT_READ | PROT_WRITE,
+                           MAP_SHARED, mapped->mm_fd, 0);
+    if (mapped->mm_data == MAP_FAILED) {
+        close(mapped->mm_fd);
+        free(mapped);
+        return NULL;
+    }
+
+    return &mapped->mm_device;
+}
+
+/*
+ * Device backed by a file, accessed through an io_uring instance shared by
+ * all threads. Each thread submits its request and waits for it to complete;
+ * one waiting thread at a time waits in the kernel for completions, and
+ * hands over the ones of the other threads through a condition.
+ */
+#define URING_ENTRIES (64)
+
+typedef struct {
+    block_device_t ur_device;
+    int ur_fd;   /* backing file */
+    int ur_ring; /* io_uring instance */
+    pthread_mutex_t ur_lock;
+    pthread_cond_t ur_completed;
+    bool ur_polling; /* whether a thread is waiting in the kernel */
+
+    /* submission queue */
+    void *ur_sq_map;
+    size_t ur_sq_map_size;
+    _Atomic unsigned *ur_sq_tail;
+    unsigned *ur_sq_mask;
+    unsigned *ur_sq_array;
+    struct io_uring_sqe *ur_sqes;
+    size_t ur_sqes_size;
+
+    /* completion queue */
+    void *ur_cq_map;
+    size_t ur_cq_map_size;
+    _Atomic unsigned *ur_cq_head;
+    _Atomic unsigned *ur_cq_tail;
+    unsigned *ur_cq_mask;
+    struct io_uring_cqe *ur_cqes;
+} uring_device_t;
+
+typedef struct {
+    bool ureq_done;
+    int ureq_result;
+} uring_request_t;
+
+/*
+ * Marks the requests of the completions queued so far as done.
+ * Must be called with the device's lock held.
+ */
+static void uring_reap(uring_device_t *uring) {
+    unsigned head = atomic_load_explicit(uring->ur_cq_head,
+                                         memory_order_relaxed);
+    unsigned tail = atomic_load_explicit(uring->ur_cq_tail,
+                                         memory_order_acquire);
+
+    for (; head != tail; head++) {
+        struct io_uring_cqe *cqe = &uring->ur_cqes[head & *uring->ur_cq_mask];
+        uring_request_t *request = (uring_request_t *)(uintptr_t)cqe->user_data;
+        request->ureq_result = cqe->res;
+        request->ureq_done = true;
+    }
+
+    atomic_store_explicit(uring->ur_cq_head, head, memory_order_release);
+}
+
+/*
+ * Submits a request and waits for it to complete
+ * Returns the result of the request (bytes transferred, or -errno)
+ */
+static int uring_submit(uring_device_t *uring, uint8_t opcode, void *buffer,
+                        size_t len, off_t position) {
+    uring_request_t request = {false, 0};
+
+    pthread_mutex_lock(&uring->ur_lock);
+
+    unsigned tail = atomic_load_explicit(uring->ur_sq_tail,
+                                         memory_order_relaxed);
+    unsigned index = tail & *uring->ur_sq_mask;
+    struct io_uring_sqe *sqe = &uring->ur_sqes[index];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    sqe->opcode = opcode;
+    sqe->fd = uring->ur_fd;
+    sqe->addr = (uintptr_t)buffer;
+    sqe->len = (uint32_t)len;
+    sqe->off = (uint64_t)position;
+    sqe->user_data = (uintptr_t)&request;
+    if (opcode == IORING_OP_FSYNC) {
+        sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+    }
+    uring->ur_sq_array[index] = index;
+    atomic_store_explicit(uring->ur_sq_tail, tail + 1, memory_order_release);
+
+    if (syscall(__NR_io_uring_enter, uring->ur_ring, 1, 0, 0, NULL, 0) != 1) {
+        /* The kernel did not take it: withdraw it */
+        atomic_store_explicit(uring->ur_sq_tail, tail, memory_order_relaxed);
+        pthread_mutex_unlock(&uring->ur_lock);
+        return -1;
+    }
+
+    while (!request.ureq_done) {
+        if (uring->ur_polling) {
+            pthread_cond_wait(&uring->ur_completed, &uring->ur_lock);
+            continue;
+        }
+
+        uring->ur_polling = true;
+        pthread_mutex_unlock(&uring->ur_lock);
+        syscall(__NR_io_uring_enter, uring->ur_ring, 0, 1,
+                IORING_ENTER_GETEVENTS, NULL, 0);
+        pthread_mutex_lock(&uring->ur_lock);
+        uring->ur_polling = false;
+
+        uring_reap(uring);
+        pthread_cond_broadcast(&uring->ur_completed);
+    }
+
+    pthread_mutex_unlock(&uring->ur_lock);
+
+    return request.ureq_result;
+}
+
+static int uring_read_block(block_device_t *device, int block_number,
+                            size_t offset, void *buffer, size_t len) {
+    uring_device_t *uring = (uring_device_t *)device;
+    off_t position = (off_t)((size_t)block_number * BLOCK_SIZE + offset);
+
+    for (size_t done = 0; done < len;) {
+        int ret = uring_submit(uring, IORING_OP_READ, (char *)buffer + done,
+                               len - done, position + (off_t)done);
+        if (ret <= 0) {
+            return -1;
+        }
+        done += (size_t)ret;
+    }
+
+    return 0;
+}
+
+static int uring_write_block(block_device_t *device, int block_number,
+                             size_t offset, void const *buffer, size_t len) {
+    uring_device_t *uring = (uring_device_t *)device;
+    off_t position = (off_t)((size_t)block_number * BLOCK_SIZE + offset);
+
+    for (size_t done = 0; done < len;) {
+        int ret = uring_submit(uring, IORING_OP_WRITE, (char *)buffer + done,
+                               len - done, position + (off_t)done);
+        if (ret <= 0) {
+            return -1;
+        }
+        done += (size_t)ret;
+    }
+
+    return 0;
+}
+
+static int uring_flush(block_device_t *device) {
+    return uring_submit((uring_device_t *)device, IORING_OP_FSYNC, NULL, 0,
+                        0) == 0
+               ? 0
+               : -1;
+}
+
+static int uring_discard(block_device_t *device, int block_number) {
+    return backing_file_discard(((uring_device_t *)device)->ur_fd,
+                                block_number);
+}
+
+static void uring_unmap(uring_device_t *uring) {
+    if (uring->ur_sqes != NULL) {
+        munmap(uring->ur_sqes, uring->ur_sqes_size);
+    }
+    if (uring->ur_cq_map != NULL && uring->ur_cq_map != uring->ur_sq_map) {
+        munmap(uring->ur_cq_map, uring->ur_cq_map_size);
+    }
+    if (uring->ur_sq_map != NULL) {
+        munmap(uring->ur_sq_map, uring->ur_sq_map_size);
+    }
+}
+
+static void uring_close(block_device_t *device) {
+    uring_device_t *uring = (uring_device_t *)device;
+
+    uring_unmap(uring);
+    close(uring->ur_ring);
+    close(uring->ur_fd);
+    pthread_mutex_destroy(&uring->ur_lock);
+    pthread_cond_destroy(&uring->ur_completed);
+    free(uring);
+}
+
+static block_device_ops_t const uring_ops = {
+    uring_read_block, uring_write_block, uring_flush, uring_discard,
+    uring_close,
+};
+
+/*
+ * Maps the queues of an io_uring instance
+ * Returns 0 if successful, -1 otherwise
+ */
+static int uring_map(uring_device_t *uring, struct io_uring_params *params) {
+    uring->ur_sq_map_size =
+        params->sq_off.array + params->sq_entries * sizeof(unsigned);
+    uring->ur_cq_map_size = params->cq_off.cqes +
+                            params->cq_entries * sizeof(struct io_uring_cqe);
+    if (params->features & IORING_FEAT_SINGLE_MMAP) {
+        if (uring->ur_cq_map_size > uring->ur_sq_map_size) {
+            uring->ur_sq_map_size = uring->ur_cq_map_size;
+        }
+        uring->ur_cq_map_size = uring->ur_sq_map_size;
+    }
+
+    uring->ur_sq_map = mmap(NULL, uring->ur_sq_map_size,
+                            PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                            uring->ur_ring, IORING_OFF_SQ_RING);
+    if (uring->ur_sq_map == MAP_FAILED) {
+        uring->ur_sq_map = NULL;
+        return -1;
+    }
+
+    if (params->features & IORING_FEAT_SINGLE_MMAP) {
+        uring->ur_cq_map = uring->ur_sq_map;
+    } else {
+        uring->ur_cq_map = mmap(NULL, uring->ur_cq_map_size,
+                                PROT_READ | PROT_WRITE,
+                                MAP_SHARED | MAP_POPULATE, uring->ur_ring,
+                                IORING_OFF_CQ_RING);
+        if (uring->ur_cq_map == MAP_FAILED) {
+            uring->ur_cq_map = NULL;
+            return -1;
+        }
+    }
+
+    uring->ur_sqes_size = params->sq_entries * sizeof(struct io_uring_sqe);
+    uring->ur_sqes = mmap(NULL, uring->ur_sqes_size, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, uring->ur_ring,
+                          IORING_OFF_SQES);
+    if (uring->ur_sqes == MAP_FAILED) {
+        uring->ur_sqes = NULL;
+        return -1;
+    }
+
+    char *sq = uring->ur_sq_map;
+    uring->ur_sq_tail = (_Atomic unsigned *)(sq + params->sq_off.tail);
+    uring->ur_sq_mask = (unsigned *)(sq + params->sq_off.ring_mask);
+    uring->ur_sq_array = (unsigned *)(sq + params->sq_off.array);
+
+    char *cq = uring->ur_cq_map;
+    uring->ur_cq_head = (_Atomic unsigned *)(cq + params->cq_off.head);
+    uring->ur_cq_tail = (_Atomic unsigned *)(cq + params->cq_off.tail);
+    uring->ur_cq_mask = (unsigned *)(cq + params->cq_off.ring_mask);
+    uring->ur_cqes = (struct io_uring_cqe *)(cq + params->cq_off.cqes);
+
+    return 0;
+}
+
+static block_device_t *uring_open(char const *path, size_t blocks,
+                                  bool keep) {
+    uring_device_t *uring = calloc(1, sizeof(uring_device_t));
+    if (uring == NULL) {
+        return NULL;
+    }
+
+    uring->ur_fd = backing_file_open(path, blocks, keep);
+    if (uring->ur_fd == -1) {
+        free(uring);
+        return NULL;
+    }
+
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    uring->ur_ring =
+        (int)syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+    if (uring->ur_ring == -1) {
+        close(uring->ur_fd);
+        free(uring);
+        return NULL;
+    }
+
+    if (uring_map(uring, &params) == -1) {
+        uring_unmap(uring);
+        close(uring->ur_ring);
+        close(uring->ur_fd);
+        free(uring);
+        return NULL;
+    }
+
+    pthread_mutex_init(&uring->ur_lock, NULL);
+    pthread_cond_init(&uring->ur_completed, NULL);
+    uring->ur_polling = false;
+
+    return &uring->ur_device;
+}
+
+/*
+ * Opens a block device whose blocks are zeroed, or kept (see
+ * block_device_open and block_device_load)
+ */
+static block_device_t *device_open(char const *spec, size_t blocks,
+                                   bool keep) {
+    block_device_t *device;
+    block_device_ops_t const *ops;
+    char const *name;
+
+    if (spec == NULL || strcmp(spec, "") == 0 || strcmp(spec, "memory") == 0) {
+        if (keep) {
+            return NULL;
+        }
+        ops = &memory_ops;
+        name = "memory";
+        device = memory_open(blocks);
+    } else if (strncmp(spec, "file:", 5) == 0) {
+        ops = &file_ops;
+        name = "file";
+        device = file_open(spec + 5, blocks, keep);
+    } else if (strncmp(spec, "mmap:", 5) == 0) {
+        ops = &mmap_ops;
+        name = "mmap";
+        device = mmap_open(spec + 5, blocks, keep);
+    } else if (strncmp(spec, "uring:", 6) == 0) {
+        ops = &uring_ops;
+        name = "uring";
+        device = uring_open(spec + 6, blocks, keep);
+    } else {
+        return NULL;
+    }
+
+    if (device != NULL) {
+        device->bd_ops = ops;
+        device->bd_name = name;
+        device->bd_blocks = blocks;
+        atomic_init(&device->bd_reads, 0);
+        atomic_init(&device->bd_writes, 0);
+    }
+
+    return device;
+}
+
+/*
+ * Opens a block device, with all its blocks zeroed
+ * Input:
+ *  - spec: the backend and where it stores the blocks: "memory" (also for
+ *    NULL or ""), "file:PATH" (pread/pwrite), "mmap:PATH" or "uring:PATH"
+ *    (io_uring), where PATH is created or truncated
+ *  - blocks: number of blocks
+ * Returns: the device, NULL if failed
+ */
+block_device_t *block_device_open(char const *spec, size_t blocks) {
+    return device_open(spec, blocks, false);
+}
+
+/*
+ * Opens a block device stored by an earlier run, keeping its blocks
+ * Input:
+ *  - spec: as for block_device_open, but PATH must exist and hold every
+ *    block ("memory" keeps nothing, so it fails)
+ *  - blocks: number of blocks
+ * Returns: the device, NULL if failed
+ */
+block_device_t *block_device_load(char const *spec, size_t blocks) {
+    return device_open(spec, blocks, true);
+}
+
+static inline bool valid_block_range(block_device_t *device, int block_number,
+                                     size_t offset, size_t len) {
+    return block_number >= 0 && (size_t)block_number < device->bd_blocks &&
+           offset <= BLOCK_SIZE && len <= BLOCK_SIZE - offset;
+}
+
+/*
+ * Reads a byte range of a block
+ * Input:
+ *  - device: the device
+ *  - block_number: the block
+ *  - offset: where the range starts, inside the block
+ *  - buffer: where to store the bytes
+ *  - len: length of the range (it must not cross the end of the block)
+ * Returns: 0 if successful, -1 otherwise
+ */
+int block_device_read(block_device_t *device, int block_number, size_t offset,
+                      void *buffer, size_t len) {
+    if (!valid_block_range(device, block_number, offset, len)) {
+        return -1;
+    }
+
+    atomic_fetch_add_explicit(&device->bd_reads, 1, memory_order_relaxed);
+    return device->bd_ops->bo_read_block(device, block_number, offset, buffer,
+                                         len);
+}
+
+/*
+ * Writes a byte range of a block (see block_device_read)
+ * Returns: 0 if successful, -1 otherwise
+ */
+int block_device_write(block_device_t *device, int block_number,
+                       size_t offset, void const *buffer, size_t len) {
+    if (!valid_block_range(device, block_number, offset, len)) {
+        return -1;
+    }
+
+    atomic_fetch_add_explicit(&device->bd_writes, 1, memory_order_relaxed);
+    return device->bd_ops->bo_write_block(device, block_number, offset, buffer,
+                                          len);
+}
+
+/*
+ * Waits until the blocks written so far are stored
+ * Returns: 0 if successful, -1 otherwise
+ */
+int block_device_flush(block_device_t *device) {
+    return device->bd_ops->bo_flush(device);
+}
+
+/*
+ * Drops the contents of a block, which then reads as zeros
+ * Returns: 0 if successful, -1 otherwise
+ */
+int block_device_discard(block_device_t *device, int block_number) {
+    if (!valid_block_range(device, block_number, 0, BLOCK_SIZE)) {
+        return -1;
+    }
+
+    return device->bd_ops->bo_discard(device, block_number);
+}
+
+/*
+ * Collects the numbers of reads and writes the device served so far
+ * Input:
+ *  - device: the device
+ *  - stats: where to store them
+ */
+void block_device_stats(block_device_t *device, block_device_stats_t *stats) {
+    stats->ds_reads = atomic_load(&device->bd_reads);
+    stats->ds_writes = atomic_load(&device->bd_writes);
+}
+
+void block_device_close(block_device_t *device) {
+    device->bd_ops->bo_close(device);
+}
@@ -0,0 +1,73 @@
+#ifndef BLOCK_DEVICE_H
+#define BLOCK_DEVICE_H
+
+#include "config.h"
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct block_device block_device_t;
+
+/*
+ * Operations of a block device backend. Reads and writes address a byte
+ * range inside a single block, so that threads may access disjoint ranges of
+ * the same block at the same time. A discarded block reads as zeros (as do
+ * the blocks of a new device).
+ */
+typedef struct {
+    int (*bo_read_block)(block_device_t *device, int block_number,
+                         size_t offset, void *buffer, size_t len);
+    int (*bo_write_block)(block_device_t *device, int block_number,
+                          size_t offset, void const *buffer, size_t len);
+    int (*bo_flush)(block_device_t *device);
+    int (*bo_discard)(block_device_t *device, int block_number);
+    void (*bo_close)(block_device_t *device);
+} block_device_ops_t;
+
+/*
+ * Block device (backends extend it, as their first member)
+ */
+struct block_device {
+    block_device_ops_t const *bd_ops;
+    char const *bd_name; /* name of the backend */
+    size_t bd_blocks;    /* number of blocks */
+    _Atomic uint64_t bd_reads;
+    _Atomic uint64_t bd_writes;
+};
+
+/*
+ * Counters of a block device (see block_device_stats)
+ */
+typedef struct {
+    uint64_t ds_reads;  /* byte ranges read from the device */
+    uint64_t ds_writes; /* byte ranges written to the device */
+} block_device_stats_t;
+
+/*
+ * Latency model of the emulated storage (see latency_model_set)
+ */
+typedef struct {
+    char const *lm_name;
+    uint64_t lm_sequential_ns; /* cost of an access where the last one ended */
+    uint64_t lm_random_ns;     /* cost of any other access */
+    unsigned lm_queue_depth;   /* accesses served at once, 0 for no limit */
+    uint64_t lm_bandwidth;     /* bytes per second, 0 for no limit */
+} latency_model_t;
+
+int latency_model_set(char const *spec);
+latency_model_t const *latency_model_get();
+void storage_access(size_t position, size_t len);
+
+block_device_t *block_device_open(char const *spec, size_t blocks);
+block_device_t *block_device_load(char const *spec, size_t blocks);
+int block_device_read(block_device_t *device, int block_number, size_t offset,
+                      void *buffer, size_t len);
+int block_device_write(block_device_t *device, int block_number,
+                       size_t offset, void const *buffer, size_t len);
+int block_device_flush(block_device_t *device);
+int block_device_discard(block_device_t *device, int block_number);
+void block_device_stats(block_device_t *device, block_device_stats_t *stats);
+void block_device_close(block_device_t *device);
+
+#endif // BLOCK_DEVICE_H
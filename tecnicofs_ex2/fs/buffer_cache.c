@@ -0,0 +1,984 @@
+#include "buffer_cache.h"
+#include "state.h"
+
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/*
+ * Buffer cache: a fixed number of frames holding copies of device blocks,
+ * replaced by the CLOCK algorithm. A write-through cache writes to the device
+ * as well, so its frames can be dropped at any time they are not pinned. A
+ * write-back cache keeps writes in its frames, which are then dirty and not
+ * replaced until a flusher thread writes them back: in batches sorted by
+ * block number, once they are FLUSH_AGE_MS old or FLUSH_DIRTY_PERCENT of the
+ * frames are dirty.
+ *
+ * Blocks are found through a map from block numbers to frames, without
+ * locks: a thread pins the frame (incrementing its pin count) and then
+ * checks that it still holds the block. Misses take the cache's lock to pick
+ * a frame to replace, which is claimed by moving its pin count from zero to
+ * FRAME_EVICTING, so that no thread pins it meanwhile. The block is then read
+ * into it outside the lock, while threads wanting the same block wait for
+ * it to be loaded.
+ *
+ * Readahead: misses on consecutive blocks make a stream, whose following
+ * blocks are prefetched by background threads. The window of blocks read
+ * ahead of a stream doubles as the stream uses them, and the windows of
+ * every stream halve whenever a prefetched block is replaced unused.
+ */
+#define FRAME_EVICTING (INT_MIN / 2)
+
+typedef struct {
+    _Atomic int bf_block;        /* block held, -1 if none */
+    atomic_int bf_pins;          /* threads using the frame */
+    atomic_bool bf_referenced;   /* used since the clock hand last passed */
+    atomic_bool bf_loaded;       /* false while the block is being read */
+    atomic_bool bf_prefetched;   /* prefetched and not used yet */
+    atomic_bool bf_dirty;        /* changed since written to the device */
+    _Atomic uint64_t bf_dirtied_ns; /* when it became dirty */
+    pthread_mutex_t bf_lock; /* orders writes with copies to write back */
+    _Alignas(int) char bf_data[BLOCK_SIZE];
+} buffer_frame_t;
+
+/* Counters are striped by thread, so that hits do not write shared lines */
+#define CACHE_STAT_STRIPES (64)
+
+typedef struct {
+    _Alignas(64) _Atomic uint64_t cs_hits;
+    _Atomic uint64_t cs_misses;
+    _Atomic uint64_t cs_evictions;
+    _Atomic uint64_t cs_prefetches;
+    _Atomic uint64_t cs_prefetch_hits;
+    _Atomic uint64_t cs_prefetch_wasted;
+    _Atomic uint64_t cs_writebacks;
+} cache_stats_stripe_t;
+
+/* Sequential streams followed at once, and blocks queued for prefetching */
+#define READAHEAD_STREAMS (8)
+#define READAHEAD_MIN (2)
+#define PREFETCH_QUEUE (2 * READAHEAD_BLOCKS)
+
+typedef struct {
+    int rs_next;        /* block the stream is expected to read next */
+    int rs_ahead;       /* first block of the stream not prefetched yet */
+    unsigned rs_window; /* blocks prefetched ahead of rs_next */
+} readahead_stream_t;
+
+struct buffer_cache {
+    block_device_t *bc_device;
+    buffer_frame_t *bc_frames;
+    size_t bc_frame_count;
+    _Atomic int *bc_block_frames; /* frame of each block, -1 if none */
+
+    pthread_mutex_t bc_lock; /* misses, replacements, readahead and waits */
+    pthread_cond_t bc_changed; /* a block was loaded or a frame unpinned */
+    atomic_int bc_waiters;     /* threads waiting for an unpinned frame */
+    size_t bc_hand;            /* clock hand */
+
+    readahead_stream_t bc_streams[READAHEAD_STREAMS];
+    size_t bc_stream_victim; /* stream replaced by the next new one */
+    int bc_prefetch_queue[PREFETCH_QUEUE];
+    size_t bc_queue_head;
+    size_t bc_queue_len;
+    pthread_cond_t bc_prefetch_wanted; /* blocks were queued, or stopping */
+    bool bc_stopping;
+    pthread_t bc_prefetchers[READAHEAD_THREADS];
+
+    cache_policy_t bc_policy;
+    atomic_size_t bc_dirty;         /* dirty frames */
+    pthread_mutex_t bc_flush_lock;  /* one write-back at a time */
+    pthread_cond_t bc_flush_wanted; /* too many dirty frames, or stopping */
+    pthread_t bc_flusher;
+
+    cache_stats_stripe_t bc_stats[CACHE_STAT_STRIPES];
+};
+
+static atomic_uint cache_threads;
+static _Thread_local int cache_stripe = -1;
+
+static cache_stats_stripe_t *cache_stats(buffer_cache_t *cache) {
+    if (cache_stripe == -1) {
+        cache_stripe =
+            (int)(atomic_fetch_add(&cache_threads, 1) % CACHE_STAT_STRIPES);
+    }
+    return &cache->bc_stats[cache_stripe];
+}
+
+static inline void cache_count(_Atomic uint64_t *counter) {
+    atomic_fetch_add_explicit(counter, 1, memory_order_relaxed);
+}
+
+/* How a block is pinned (see cache_pin) */
+typedef enum {
+    PIN_READ,    /* read it from the device on a miss */
+    PIN_UPDATE,  /* read it on a miss, to change part of it (no readahead) */
+    PIN_WRITE,   /* the caller fills it on a miss */
+    PIN_PREFETCH /* read it on a miss, not on behalf of any thread */
+} pin_mode_t;
+
+static void *cache_prefetcher(void *arg);
+static void *cache_flusher(void *arg);
+
+static uint64_t cache_now_ns() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+}
+
+/*
+ * Stops the background threads of a cache, and frees it
+ * Input:
+ *  - cache: the cache
+ *  - prefetchers: number of prefetch threads started
+ *  - flusher: whether the flusher thread was started
+ */
+static void cache_free(buffer_cache_t *cache, size_t prefetchers,
+                       bool flusher) {
+    mutex_lock(LOCK_CACHE, &cache->bc_lock);
+    cache->bc_stopping = true;
+    pthread_cond_broadcast(&cache->bc_prefetch_wanted);
+    pthread_cond_broadcast(&cache->bc_flush_wanted);
+    mutex_unlock(LOCK_CACHE, &cache->bc_lock);
+    for (size_t i = 0; i < prefetchers; i++) {
+        pthread_join(cache->bc_prefetchers[i], NULL);
+    }
+    if (flusher) {
+        pthread_join(cache->bc_flusher, NULL);
+    }
+
+    for (size_t i = 0; i < cache->bc_frame_count; i++) {
+        pthread_mutex_destroy(&cache->bc_frames[i].bf_lock);
+    }
+    pthread_mutex_destroy(&cache->bc_lock);
+    pthread_cond_destroy(&cache->bc_changed);
+    pthread_cond_destroy(&cache->bc_prefetch_wanted);
+    pthread_mutex_destroy(&cache->bc_flush_lock);
+    pthread_cond_destroy(&cache->bc_flush_wanted);
+    free(cache->bc_block_frames);
+    free(cache->bc_frames);
+    free(cache);
+}
+
+/*
+ * Creates a buffer cache in front of a block device
+ * Input:
+ *  - device: the device
+ *  - frames: number of blocks the cache holds (at least one)
+ *  - policy: whether writes reach the device at once, or are written back
+ * Returns: the cache, NULL if failed
+ */
+buffer_cache_t *buffer_cache_create(block_device_t *device, size_t frames,
+                                    cache_policy_t policy) {
+    if (frames == 0) {
+        return NULL;
+    }
+
+    buffer_cache_t *cache = calloc(1, sizeof(buffer_cache_t));
+    if (cache == NULL) {
+        return NULL;
+    }
+
+    cache->bc_frames = calloc(frames, sizeof(buffer_frame_t));
+    cache->bc_block_frames = malloc(device->bd_blocks * sizeof(_Atomic int));
+    if (cache->bc_frames == NULL || cache->bc_block_frames == NULL) {
+        free(cache->bc_frames);
+        free(cache->bc_block_frames);
+        free(cache);
+        return NULL;
+    }
+
+    cache->bc_device = device;
+    cache->bc_frame_count = frames;
+    for (size_t i = 0; i < frames; i++) {
+        atomic_init(&cache->bc_frames[i].bf_block, -1);
+        atomic_init(&cache->bc_frames[i].bf_pins, 0);
+        atomic_init(&cache->bc_frames[i].bf_referenced, false);
+        atomic_init(&cache->bc_frames[i].bf_loaded, false);
+        atomic_init(&cache->bc_frames[i].bf_prefetched, false);
+        atomic_init(&cache->bc_frames[i].bf_dirty, false);
+        atomic_init(&cache->bc_frames[i].bf_dirtied_ns, 0);
+        pthread_mutex_init(&cache->bc_frames[i].bf_lock, NULL);
+    }
+    for (size_t i = 0; i < device->bd_blocks; i++) {
+        atomic_init(&cache->bc_block_frames[i], -1);
+    }
+
+    pthread_mutex_init(&cache->bc_lock, NULL);
+    pthread_cond_init(&cache->bc_changed, NULL);
+    atomic_init(&cache->bc_waiters, 0);
+    cache->bc_hand = 0;
+
+    for (size_t i = 0; i < READAHEAD_STREAMS; i++) {
+        cache->bc_streams[i].rs_next = -1;
+    }
+    pthread_cond_init(&cache->bc_prefetch_wanted, NULL);
+    cache->bc_stopping = false;
+
+    cache->bc_policy = policy;
+    atomic_init(&cache->bc_dirty, 0);
+    pthread_mutex_init(&cache->bc_flush_lock, NULL);
+    /* The flusher wakes up by the monotonic clock, as the ages are taken */
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&cache->bc_flush_wanted, &attr);
+    pthread_condattr_destroy(&attr);
+
+    for (size_t i = 0; i < READAHEAD_THREADS; i++) {
+        if (pthread_create(&cache->bc_prefetchers[i], NULL, cache_prefetcher,
+                           cache) != 0) {
+            cache_free(cache, i, false);
+            return NULL;
+        }
+    }
+    if (policy == CACHE_WRITE_BACK &&
+        pthread_create(&cache->bc_flusher, NULL, cache_flusher, cache) != 0) {
+        cache_free(cache, READAHEAD_THREADS, false);
+        return NULL;
+    }
+
+    return cache;
+}
+
+/*
+ * Destroys a buffer cache (not the device), writing its dirty blocks back
+ * first. No frame may be pinned.
+ * Returns: 0 if successful, -1 if some block could not be written back
+ */
+int buffer_cache_destroy(buffer_cache_t *cache) {
+    int ret = buffer_cache_flush(cache);
+    cache_free(cache, READAHEAD_THREADS, cache->bc_policy == CACHE_WRITE_BACK);
+    return ret;
+}
+
+/*
+ * Follows the stream a block read belongs to, queueing the blocks the
+ * stream should have prefetched by now. A block that follows no stream
+ * starts a new one, which prefetches once its next block is read too.
+ * Must be called with the cache's lock held.
+ */
+static void cache_readahead(buffer_cache_t *cache, int block_number) {
+    readahead_stream_t *stream = NULL;
+    for (size_t i = 0; i < READAHEAD_STREAMS; i++) {
+        if (cache->bc_streams[i].rs_next == block_number) {
+            stream = &cache->bc_streams[i];
+            break;
+        }
+    }
+
+    if (stream == NULL) {
+        stream = &cache->bc_streams[cache->bc_stream_victim];
+        cache->bc_stream_victim =
+            (cache->bc_stream_victim + 1) % READAHEAD_STREAMS;
+        stream->rs_next = block_number + 1;
+        stream->rs_ahead = block_number + 1;
+        stream->rs_window = 0;
+        return;
+    }
+
+    stream->rs_next = block_number + 1;
+    if (stream->rs_window < READAHEAD_MIN) {
+        stream->rs_window = READAHEAD_MIN;
+    } else if (stream->rs_window < READAHEAD_BLOCKS) {
+        stream->rs_window *= 2;
+        if (stream->rs_window > READAHEAD_BLOCKS) {
+            stream->rs_window = READAHEAD_BLOCKS;
+        }
+    }
+
+    if (stream->rs_ahead < stream->rs_next) {
+        stream->rs_ahead = stream->rs_next;
+    }
+    size_t end = (size_t)stream->rs_next + stream->rs_window;
+    if (end > cache->bc_device->bd_blocks) {
+        end = cache->bc_device->bd_blocks;
+    }
+
+    bool queued = false;
+    while ((size_t)stream->rs_ahead < end &&
+           cache->bc_queue_len < PREFETCH_QUEUE) {
+        cache->bc_prefetch_queue[(cache->bc_queue_head + cache->bc_queue_len) %
+                                 PREFETCH_QUEUE] = stream->rs_ahead++;
+        cache->bc_queue_len++;
+        queued = true;
+    }
+    if (queued) {
+        pthread_cond_broadcast(&cache->bc_prefetch_wanted);
+    }
+}
+
+/*
+ * Counts the first use of a prefetched block, which moves its stream on
+ */
+static void cache_use_prefetched(buffer_cache_t *cache, buffer_frame_t *frame,
+                                 int block_number) {
+    if (atomic_load_explicit(&frame->bf_prefetched, memory_order_relaxed) &&
+        atomic_exchange(&frame->bf_prefetched, false)) {
+        cache_count(&cache_stats(cache)->cs_prefetch_hits);
+        mutex_lock(LOCK_CACHE, &cache->bc_lock);
+        cache_readahead(cache, block_number);
+        mutex_unlock(LOCK_CACHE, &cache->bc_lock);
+    }
+}
+
+/*
+ * Pins the frame holding a block, if the block is loaded in one (without
+ * counting an access)
+ * Returns: the frame, NULL if the block is not in the cache (or is being
+ * loaded or replaced)
+ */
+static buffer_frame_t *cache_pin_loaded(buffer_cache_t *cache,
+                                        int block_number) {
+    int f = atomic_load(&cache->bc_block_frames[block_number]);
+    if (f == -1) {
+        return NULL;
+    }
+
+    buffer_frame_t *frame = &cache->bc_frames[f];
+    if (atomic_fetch_add(&frame->bf_pins, 1) >= 0 &&
+        atomic_load(&frame->bf_block) == block_number &&
+        atomic_load_explicit(&frame->bf_loaded, memory_order_acquire)) {
+        return frame;
+    }
+
+    atomic_fetch_sub(&frame->bf_pins, 1);
+    return NULL;
+}
+
+static void cache_unpin_frame(buffer_cache_t *cache, buffer_frame_t *frame) {
+    if (atomic_fetch_sub(&frame->bf_pins, 1) == 1 &&
+        atomic_load(&cache->bc_waiters) > 0) {
+        mutex_lock(LOCK_CACHE, &cache->bc_lock);
+        pthread_cond_broadcast(&cache->bc_changed);
+        mutex_unlock(LOCK_CACHE, &cache->bc_lock);
+    }
+}
+
+/*
+ * Claims a frame to hold another block, by the CLOCK algorithm: frames used
+ * since the hand last passed get another round. Waits while every frame is
+ * pinned.
+ * Must be called with the cache's lock held.
+ */
+static buffer_frame_t *cache_claim_frame(buffer_cache_t *cache) {
+    while (true) {
+        /* Two rounds clear every reference bit, so a third finds a frame
+         * unless they are all pinned */
+        for (size_t i = 0; i < 3 * cache->bc_frame_count; i++) {
+            buffer_frame_t *frame = &cache->bc_frames[cache->bc_hand];
+            cache->bc_hand = (cache->bc_hand + 1) % cache->bc_frame_count;
+
+            if (atomic_exchange(&frame->bf_referenced, false) ||
+                atomic_load(&frame->bf_dirty)) {
+                continue;
+            }
+
+            int unpinned = 0;
+            if (atomic_compare_exchange_strong(&frame->bf_pins, &unpinned,
+                                               FRAME_EVICTING)) {
+                /* It may have been written before it was unpinned */
+                if (!atomic_load(&frame->bf_dirty)) {
+                    return frame;
+                }
+                atomic_fetch_sub(&frame->bf_pins, FRAME_EVICTING);
+            }
+        }
+
+        /* Dirty frames are replaced once written back */
+        if (atomic_load(&cache->bc_dirty) > 0) {
+            pthread_cond_signal(&cache->bc_flush_wanted);
+        }
+        atomic_fetch_add(&cache->bc_waiters, 1);
+        cond_wait(LOCK_CACHE, &cache->bc_changed, &cache->bc_lock);
+        atomic_fetch_sub(&cache->bc_waiters, 1);
+    }
+}
+
+/*
+ * Drops the block a frame was being loaded with
+ */
+static void cache_load_failed(buffer_cache_t *cache, buffer_frame_t *frame,
+                              int block_number) {
+    mutex_lock(LOCK_CACHE, &cache->bc_lock);
+    atomic_store(&cache->bc_block_frames[block_number], -1);
+    atomic_store(&frame->bf_block, -1);
+    pthread_cond_broadcast(&cache->bc_changed);
+    mutex_unlock(LOCK_CACHE, &cache->bc_lock);
+}
+
+/*
+ * Pins the frame of a block, loading the block into a frame if it is not in
+ * the cache. A block that is going to be overwritten whole need not be read:
+ * the caller then fills the frame and marks it loaded (see cache_loaded).
+ * Input:
+ *  - cache: the cache
+ *  - block_number: the block
+ *  - mode: whether to read the block from the device on a miss, and for
+ *    whom (prefetches only pin blocks they load)
+ *  - loading: set to whether the caller must mark the frame loaded
+ * Returns: the frame, NULL if failed (or, for prefetches, if the block is
+ * already in the cache)
+ */
+static buffer_frame_t *cache_pin(buffer_cache_t *cache, int block_number,
+                                 pin_mode_t mode, bool *loading) {
+    *loading = false;
+
+    buffer_frame_t *frame = cache_pin_loaded(cache, block_number);
+    if (frame != NULL) {
+        if (mode == PIN_PREFETCH) {
+            cache_unpin_frame(cache, frame);
+            return NULL;
+        }
+        if (!atomic_load_explicit(&frame->bf_referenced,
+                                  memory_order_relaxed)) {
+            atomic_store_explicit(&frame->bf_referenced, true,
+                                  memory_order_relaxed);
+        }
+        cache_count(&cache_stats(cache)->cs_hits);
+        cache_use_prefetched(cache, frame, block_number);
+        return frame;
+    }
+
+    mutex_lock(LOCK_CACHE, &cache->bc_lock);
+
+    while (true) {
+        /* Replacements wait for this lock, so a frame holding the block
+         * keeps it while pinned here */
+        int f = atomic_load(&cache->bc_block_frames[block_number]);
+        if (f == -1) {
+            break;
+        }
+        if (mode == PIN_PREFETCH) {
+            mutex_unlock(LOCK_CACHE, &cache->bc_lock);
+            return NULL;
+        }
+
+        frame = &cache->bc_frames[f];
+        atomic_fetch_add(&frame->bf_pins, 1);
+        while (!atomic_load(&frame->bf_loaded) &&
+               atomic_load(&frame->bf_block) == block_number) {
+            cond_wait(LOCK_CACHE, &cache->bc_changed, &cache->bc_lock);
+        }
+        if (atomic_load(&frame->bf_block) == block_number) {
+            mutex_unlock(LOCK_CACHE, &cache->bc_lock);
+            atomic_store(&frame->bf_referenced, true);
+            cache_count(&cache_stats(cache)->cs_hits);
+            cache_use_prefetched(cache, frame, block_number);
+            return frame;
+        }
+
+        /* Its load failed: try again */
+        if (atomic_fetch_sub(&frame->bf_pins, 1) == 1) {
+            pthread_cond_broadcast(&cache->bc_changed);
+        }
+    }
+
+    frame = cache_claim_frame(cache);
+    int old_block = atomic_load(&frame->bf_block);
+    if (old_block != -1) {
+        atomic_store(&cache->bc_block_frames[old_block], -1);
+        cache_count(&cache_stats(cache)->cs_evictions);
+    }
+    if (atomic_exchange(&frame->bf_prefetched, false)) {
+        /* Prefetched in vain: every stream reads less ahead */
+        cache_count(&cache_stats(cache)->cs_prefetch_wasted);
+        for (size_t i = 0; i < READAHEAD_STREAMS; i++) {
+            cache->bc_streams[i].rs_window /= 2;
+        }
+    }
+    atomic_store(&frame->bf_loaded, false);
+    atomic_store(&frame->bf_block, block_number);
+    atomic_store(&cache->bc_block_frames[block_number],
+                 (int)(frame - cache->bc_frames));
+    /* Keeps the pins taken (and soon dropped) by threads that found the
+     * frame while it was claimed, plus this thread's */
+    atomic_fetch_add(&frame->bf_pins, 1 - FRAME_EVICTING);
+
+    if (mode == PIN_READ) {
+        cache_readahead(cache, block_number);
+    }
+    mutex_unlock(LOCK_CACHE, &cache->bc_lock);
+
+    if (mode == PIN_PREFETCH) {
+        cache_count(&cache_stats(cache)->cs_prefetches);
+    } else {
+        cache_count(&cache_stats(cache)->cs_misses);
+    }
+
+    *loading = true;
+    if (mode == PIN_WRITE) {
+        return frame;
+    }
+
+    if (block_device_read(cache->bc_device, block_number, 0, frame->bf_data,
+                          BLOCK_SIZE) == -1) {
+        cache_load_failed(cache, frame, block_number);
+        cache_unpin_frame(cache, frame);
+        return NULL;
+    }
+
+    return frame;
+}
+
+/*
+ * Marks the block of a frame pinned by cache_pin as loaded, waking the
+ * threads waiting for it
+ */
+static void cache_loaded(buffer_cache_t *cache, buffer_frame_t *frame) {
+    mutex_lock(LOCK_CACHE, &cache->bc_lock);
+    atomic_store_explicit(&frame->bf_loaded, true, memory_order_release);
+    pthread_cond_broadcast(&cache->bc_changed);
+    mutex_unlock(LOCK_CACHE, &cache->bc_lock);
+}
+
+/*
+ * Pins the frame holding a block, once loaded if it is being loaded (without
+ * counting an access)
+ * Returns: the frame, NULL if the block is not in the cache
+ */
+static buffer_frame_t *cache_pin_cached(buffer_cache_t *cache,
+                                        int block_number) {
+    mutex_lock(LOCK_CACHE, &cache->bc_lock);
+
+    int f = atomic_load(&cache->bc_block_frames[block_number]);
+    if (f == -1) {
+        mutex_unlock(LOCK_CACHE, &cache->bc_lock);
+        return NULL;
+    }
+
+    buffer_frame_t *frame = &cache->bc_frames[f];
+    atomic_fetch_add(&frame->bf_pins, 1);
+    while (!atomic_load(&frame->bf_loaded) &&
+           atomic_load(&frame->bf_block) == block_number) {
+        cond_wait(LOCK_CACHE, &cache->bc_changed, &cache->bc_lock);
+    }
+    mutex_unlock(LOCK_CACHE, &cache->bc_lock);
+
+    if (atomic_load(&frame->bf_block) != block_number) {
+        cache_unpin_frame(cache, frame);
+        return NULL;
+    }
+
+    return frame;
+}
+
+/*
+ * Marks a pinned frame dirty, waking the flusher up if too many frames are
+ */
+static void cache_mark_dirty(buffer_cache_t *cache, buffer_frame_t *frame) {
+    if (atomic_load(&frame->bf_dirty)) {
+        return;
+    }
+
+    atomic_store(&frame->bf_dirtied_ns, cache_now_ns());
+    if (atomic_exchange(&frame->bf_dirty, true)) {
+        return;
+    }
+
+    size_t dirty = atomic_fetch_add(&cache->bc_dirty, 1);
+    if (dirty * 100 <= cache->bc_frame_count * FLUSH_DIRTY_PERCENT &&
+        (dirty + 1) * 100 > cache->bc_frame_count * FLUSH_DIRTY_PERCENT) {
+        mutex_lock(LOCK_CACHE, &cache->bc_lock);
+        pthread_cond_signal(&cache->bc_flush_wanted);
+        mutex_unlock(LOCK_CACHE, &cache->bc_lock);
+    }
+}
+
+/* A dirty block to write back */
+typedef struct {
+    int wb_block;
+    buffer_frame_t *wb_frame;
+} write_back_t;
+
+static int write_back_cmp(void const *a, void const *b) {
+    int block_a = ((write_back_t const *)a)->wb_block;
+    int block_b = ((write_back_t const *)b)->wb_block;
+    return (block_a > block_b) - (block_a < block_b);
+}
+
+/*
+ * Writes dirty frames back to the device, sorted by block number, so that
+ * consecutive blocks reach the device as one sequential stream. Writes to a
+ * frame during its write-back leave it dirty again.
+ * Input:
+ *  - cache: the cache
+ *  - block_number: the block to write back, -1 for any
+ *  - dirtied_before: writes back only the frames that became dirty before
+ *    this time (UINT64_MAX for every frame)
+ * Returns: 0 if successful, -1 if some block could not be written back
+ */
+static int cache_write_back(buffer_cache_t *cache, int block_number,
+                            uint64_t dirtied_before) {
+    write_back_t *batch = malloc(cache->bc_frame_count * sizeof(write_back_t));
+    if (batch == NULL) {
+        return -1;
+    }
+
+    mutex_lock(LOCK_CACHE, &cache->bc_flush_lock);
+
+    /* The frames are pinned, so that they are not replaced until written */
+    size_t count = 0;
+    for (size_t i = 0; i < cache->bc_frame_count; i++) {
+        buffer_frame_t *frame = &cache->bc_frames[i];
+        int b = atomic_load(&frame->bf_block);
+        if (!atomic_load(&frame->bf_dirty) || b == -1 ||
+            (block_number != -1 && b != block_number) ||
+            atomic_load(&frame->bf_dirtied_ns) >= dirtied_before) {
+            continue;
+        }
+
+        buffer_frame_t *pinned = cache_pin_loaded(cache, b);
+        if (pinned == frame) {
+            batch[count].wb_block = b;
+            batch[count].wb_frame = frame;
+            count++;
+        } else if (pinned != NULL) {
+            cache_unpin_frame(cache, pinned);
+        }
+    }
+    qsort(batch, count, sizeof(write_back_t), write_back_cmp);
+
+    int ret = 0;
+    char data[BLOCK_SIZE];
+    for (size_t i = 0; i < count; i++) {
+        buffer_frame_t *frame = batch[i].wb_frame;
+        if (atomic_exchange(&frame->bf_dirty, false)) {
+            atomic_fetch_sub(&cache->bc_dirty, 1);
+
+            mutex_lock(LOCK_CACHE, &frame->bf_lock);
+            memcpy(data, frame->bf_data, BLOCK_SIZE);
+            mutex_unlock(LOCK_CACHE, &frame->bf_lock);
+
+            if (block_device_write(cache->bc_device, batch[i].wb_block, 0,
+                                   data, BLOCK_SIZE) == -1) {
+                cache_mark_dirty(cache, frame);
+                ret = -1;
+            } else {
+                cache_count(&cache_stats(cache)->cs_writebacks);
+            }
+        }
+        cache_unpin_frame(cache, frame);
+    }
+
+    mutex_unlock(LOCK_CACHE, &cache->bc_flush_lock);
+    free(batch);
+
+    return ret;
+}
+
+/*
+ * Writes back the frames that have been dirty for FLUSH_AGE_MS, or every
+ * dirty frame when more than FLUSH_DIRTY_PERCENT of the frames are dirty (or
+ * a miss found no clean frame to replace), until the cache is destroyed
+ */
+static void *cache_flusher(void *arg) {
+    buffer_cache_t *cache = arg;
+    uint64_t const age_ns = (uint64_t)FLUSH_AGE_MS * 1000000u;
+
+    mutex_lock(LOCK_CACHE, &cache->bc_lock);
+    while (!cache->bc_stopping) {
+        if (atomic_load(&cache->bc_dirty) * 100 <=
+            cache->bc_frame_count * FLUSH_DIRTY_PERCENT) {
+            /* Checks the ages twice per FLUSH_AGE_MS */
+            uint64_t until_ns = cache_now_ns() + age_ns / 2;
+            struct timespec until = {(time_t)(until_ns / 1000000000u),
+                                     (long)(until_ns % 1000000000u)};
+            cond_timedwait(LOCK_CACHE, &cache->bc_flush_wanted,
+                           &cache->bc_lock, &until);
+            if (cache->bc_stopping) {
+                break;
+            }
+        }
+
+        bool all = atomic_load(&cache->bc_dirty) * 100 >
+                       cache->bc_frame_count * FLUSH_DIRTY_PERCENT ||
+                   atomic_load(&cache->bc_waiters) > 0;
+        mutex_unlock(LOCK_CACHE, &cache->bc_lock);
+
+        int ret = 0;
+        if (atomic_load(&cache->bc_dirty) > 0) {
+            ret = cache_write_back(cache, -1,
+                                   all ? UINT64_MAX : cache_now_ns() - age_ns);
+        }
+
+        mutex_lock(LOCK_CACHE, &cache->bc_lock);
+        if (ret == -1 && !cache->bc_stopping) {
+            /* Retries failed blocks at the next check, not at once */
+            uint64_t until_ns = cache_now_ns() + age_ns / 2;
+            struct timespec until = {(time_t)(until_ns / 1000000000u),
+                                     (long)(until_ns % 1000000000u)};
+            cond_timedwait(LOCK_CACHE, &cache->bc_flush_wanted,
+                           &cache->bc_lock, &until);
+        }
+    }
+    mutex_unlock(LOCK_CACHE, &cache->bc_lock);
+
+    return NULL;
+}
+
+/*
+ * Loads the blocks queued by cache_readahead, until the cache is destroyed
+ */
+static void *cache_prefetcher(void *arg) {
+    buffer_cache_t *cache = arg;
+
+    mutex_lock(LOCK_CACHE, &cache->bc_lock);
+    while (true) {
+        while (cache->bc_queue_len == 0 && !cache->bc_stopping) {
+            cond_wait(LOCK_CACHE, &cache->bc_prefetch_wanted, &cache->bc_lock);
+        }
+        if (cache->bc_stopping) {
+            break;
+        }
+
+        int block_number = cache->bc_prefetch_queue[cache->bc_queue_head];
+        cache->bc_queue_head = (cache->bc_queue_head + 1) % PREFETCH_QUEUE;
+        cache->bc_queue_len--;
+        mutex_unlock(LOCK_CACHE, &cache->bc_lock);
+
+        bool loading;
+        buffer_frame_t *frame =
+            cache_pin(cache, block_number, PIN_PREFETCH, &loading);
+        if (frame != NULL) {
+            atomic_store(&frame->bf_prefetched, true);
+            cache_loaded(cache, frame);
+            cache_unpin_frame(cache, frame);
+        }
+
+        mutex_lock(LOCK_CACHE, &cache->bc_lock);
+    }
+    mutex_unlock(LOCK_CACHE, &cache->bc_lock);
+
+    return NULL;
+}
+
+/*
+ * Pins a block in the cache, loading it if needed: the block stays in the
+ * cache, at the address returned, until it is unpinned.
+ * Returns: the contents of the block, NULL if failed
+ */
+void *buffer_cache_pin(buffer_cache_t *cache, int block_number) {
+    if (block_number < 0 ||
+        (size_t)block_number >= cache->bc_device->bd_blocks) {
+        return NULL;
+    }
+
+    bool loading;
+    buffer_frame_t *frame = cache_pin(cache, block_number, PIN_READ, &loading);
+    if (frame == NULL) {
+        return NULL;
+    }
+    if (loading) {
+        cache_loaded(cache, frame);
+    }
+
+    return frame->bf_data;
+}
+
+/*
+ * Unpins a block pinned by buffer_cache_pin
+ * Input:
+ *  - data: the address returned by buffer_cache_pin
+ */
+void buffer_cache_unpin(buffer_cache_t *cache, void *data) {
+    buffer_frame_t *frame =
+        (buffer_frame_t *)((char *)data - offsetof(buffer_frame_t, bf_data));
+    cache_unpin_frame(cache, frame);
+}
+
+/*
+ * Reads a byte range of a block (see block_device_read), from the cache
+ * Returns: 0 if successful, -1 otherwise
+ */
+int buffer_cache_read(buffer_cache_t *cache, int block_number, size_t offset,
+                      void *buffer, size_t len) {
+    if (offset > BLOCK_SIZE || len > BLOCK_SIZE - offset) {
+        return -1;
+    }
+
+    void *data = buffer_cache_pin(cache, block_number);
+    if (data == NULL) {
+        return -1;
+    }
+
+    memcpy(buffer, (char *)data + offset, len);
+    buffer_cache_unpin(cache, data);
+
+    return 0;
+}
+
+/*
+ * Writes a byte range of a block to the cache (see block_device_write), and
+ * to the device if the cache writes through. Blocks written whole are not
+ * read first.
+ * Returns: 0 if successful, -1 otherwise
+ */
+int buffer_cache_write(buffer_cache_t *cache, int block_number, size_t offset,
+                       void const *buffer, size_t len) {
+    if (block_number < 0 ||
+        (size_t)block_number >= cache->bc_device->bd_blocks ||
+        offset > BLOCK_SIZE || len > BLOCK_SIZE - offset) {
+        return -1;
+    }
+
+    bool loading;
+    buffer_frame_t *frame = cache_pin(
+        cache, block_number, len < BLOCK_SIZE ? PIN_UPDATE : PIN_WRITE,
+        &loading);
+    if (frame == NULL) {
+        return -1;
+    }
+
+    if (cache->bc_policy == CACHE_WRITE_BACK) {
+        mutex_lock(LOCK_CACHE, &frame->bf_lock);
+        memcpy(frame->bf_data + offset, buffer, len);
+        mutex_unlock(LOCK_CACHE, &frame->bf_lock);
+        cache_mark_dirty(cache, frame);
+
+        if (loading) {
+            cache_loaded(cache, frame);
+        }
+        cache_unpin_frame(cache, frame);
+        return 0;
+    }
+
+    memcpy(frame->bf_data + offset, buffer, len);
+    int ret = block_device_write(cache->bc_device, block_number, offset,
+                                 buffer, len);
+
+    if (loading) {
+        if (ret == -1 && len == BLOCK_SIZE) {
+            /* The frame holds what the device failed to store */
+            cache_load_failed(cache, frame, block_number);
+        } else {
+            cache_loaded(cache, frame);
+        }
+    }
+    cache_unpin_frame(cache, frame);
+
+    return ret;
+}
+
+/*
+ * Drops the contents of a block (see block_device_discard). A copy in the
+ * cache is zeroed rather than dropped, once loaded: the device is discarded
+ * first, so that a prefetch reading the old contents meanwhile is caught.
+ * Returns: 0 if successful, -1 otherwise
+ */
+int buffer_cache_discard(buffer_cache_t *cache, int block_number) {
+    if (block_number < 0 ||
+        (size_t)block_number >= cache->bc_device->bd_blocks) {
+        return -1;
+    }
+
+    if (block_device_discard(cache->bc_device, block_number) == -1) {
+        return -1;
+    }
+
+    buffer_frame_t *frame = cache_pin_cached(cache, block_number);
+    if (frame != NULL) {
+        mutex_lock(LOCK_CACHE, &frame->bf_lock);
+        memset(frame->bf_data, 0, BLOCK_SIZE);
+        mutex_unlock(LOCK_CACHE, &frame->bf_lock);
+        /* A write-back under way may still store the old contents */
+        if (cache->bc_policy == CACHE_WRITE_BACK) {
+            cache_mark_dirty(cache, frame);
+        }
+        cache_unpin_frame(cache, frame);
+    }
+
+    return 0;
+}
+
+/*
+ * Brings a block the device holds as zeros (e.g., a discarded one) into the
+ * cache without reading it, so that the first write to part of it need not
+ * wait for the device
+ * Returns: 0 if successful, -1 otherwise
+ */
+int buffer_cache_zero(buffer_cache_t *cache, int block_number) {
+    if (block_number < 0 ||
+        (size_t)block_number >= cache->bc_device->bd_blocks) {
+        return -1;
+    }
+
+    bool loading;
+    buffer_frame_t *frame = cache_pin(cache, block_number, PIN_WRITE, &loading);
+    if (frame == NULL) {
+        return -1;
+    }
+
+    /* A copy already in the cache is as good */
+    if (loading) {
+        memset(frame->bf_data, 0, BLOCK_SIZE);
+        cache_loaded(cache, frame);
+    }
+    cache_unpin_frame(cache, frame);
+
+    return 0;
+}
+
+/*
+ * Writes a block back to the device, if it is dirty, and waits until the
+ * device stores it (see block_device_flush)
+ * Returns: 0 if successful, -1 otherwise
+ */
+int buffer_cache_sync(buffer_cache_t *cache, int block_number) {
+    if (block_number < 0 ||
+        (size_t)block_number >= cache->bc_device->bd_blocks) {
+        return -1;
+    }
+
+    int ret = 0;
+    if (cache->bc_policy == CACHE_WRITE_BACK) {
+        ret = cache_write_back(cache, block_number, UINT64_MAX);
+    }
+    if (block_device_flush(cache->bc_device) == -1) {
+        ret = -1;
+    }
+
+    return ret;
+}
+
+/*
+ * Writes every dirty block back to the device, and waits until the device
+ * stores the blocks written so far (see block_device_flush)
+ * Returns: 0 if successful, -1 otherwise
+ */
+int buffer_cache_flush(buffer_cache_t *cache) {
+    int ret = 0;
+    if (cache->bc_policy == CACHE_WRITE_BACK &&
+        atomic_load(&cache->bc_dirty) > 0) {
+        ret = cache_write_back(cache, -1, UINT64_MAX);
+    }
+    if (block_device_flush(cache->bc_device) == -1) {
+        ret = -1;
+    }
+
+    return ret;
+}
+
+/*
+ * Collects the counters of a cache
+ * Input:
+ *  - cache: the cache
+ *  - stats: where to store them
+ */
+void buffer_cache_stats(buffer_cache_t *cache, buffer_cache_stats_t *stats) {
+    memset(stats, 0, sizeof(buffer_cache_stats_t));
+
+    for (size_t i = 0; i < CACHE_STAT_STRIPES; i++) {
+        cache_stats_stripe_t *s = &cache->bc_stats[i];
+        stats->bs_hits += atomic_load(&s->cs_hits);
+        stats->bs_misses += atomic_load(&s->cs_misses);
+        stats->bs_evictions += atomic_load(&s->cs_evictions);
+        stats->bs_prefetches += atomic_load(&s->cs_prefetches);
+        stats->bs_prefetch_hits += atomic_load(&s->cs_prefetch_hits);
+        stats->bs_prefetch_wasted += atomic_load(&s->cs_prefetch_wasted);
+        stats->bs_writebacks += atomic_load(&s->cs_writebacks);
+    }
+}
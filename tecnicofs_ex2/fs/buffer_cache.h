@@ -0,0 +1,48 @@
+#ifndef BUFFER_CACHE_H
+#define BUFFER_CACHE_H
+
+#include "block_device.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct buffer_cache buffer_cache_t;
+
+/*
+ * How writes reach the device: at once, or later, from the cache
+ */
+typedef enum { CACHE_WRITE_THROUGH, CACHE_WRITE_BACK } cache_policy_t;
+
+/*
+ * Counters of a buffer cache (see buffer_cache_stats)
+ */
+typedef struct {
+    uint64_t bs_hits;            /* accesses to blocks in the cache */
+    uint64_t bs_misses;          /* accesses that read (or took) a frame */
+    uint64_t bs_evictions;       /* blocks dropped to make room for others */
+    uint64_t bs_prefetches;      /* blocks read ahead of their use */
+    uint64_t bs_prefetch_hits;   /* prefetched blocks used afterwards */
+    uint64_t bs_prefetch_wasted; /* prefetched blocks dropped unused */
+    uint64_t bs_writebacks;      /* dirty blocks written to the device */
+} buffer_cache_stats_t;
+
+buffer_cache_t *buffer_cache_create(block_device_t *device, size_t frames,
+                                    cache_policy_t policy);
+int buffer_cache_destroy(buffer_cache_t *cache);
+
+void *buffer_cache_pin(buffer_cache_t *cache, int block_number);
+void buffer_cache_unpin(buffer_cache_t *cache, void *data);
+
+int buffer_cache_read(buffer_cache_t *cache, int block_number, size_t offset,
+                      void *buffer, size_t len);
+int buffer_cache_write(buffer_cache_t *cache, int block_number, size_t offset,
+                       void const *buffer, size_t len);
+int buffer_cache_discard(buffer_cache_t *cache, int block_number);
+int buffer_cache_zero(buffer_cache_t *cache, int block_number);
+int buffer_cache_sync(buffer_cache_t *cache, int block_number);
+int buffer_cache_flush(buffer_cache_t *cache);
+
+void buffer_cache_stats(buffer_cache_t *cache, buffer_cache_stats_t *stats);
+
+#endif // BUFFER_CACHE_H
@@ -7,9 +7,29 @@
 #define BLOCK_SIZE (1024)
 #define DATA_BLOCKS (1024)
 #define INODE_TABLE_SIZE (50)
-#define MAX_OPEN_FILES (20)
-#define MAX_FILE_NAME (40)
+/* file handles carry the open file table index in their lower bits and the
+ * generation of that entry in the remaining (non-sign) bits */
+#define FHANDLE_INDEX_BITS (20)
+#define MAX_OPEN_FILES (1 << FHANDLE_INDEX_BITS)
+#define OPEN_FILES_CHUNK (1024)
+#define MAX_FILE_NAME (256)
 
-#define DELAY (5000)
+/* data blocks kept in memory by the buffer cache (see buffer_cache.h) */
+#define CACHE_BLOCKS (256)
+/* most blocks read ahead of a sequential stream, and threads reading them */
+#define READAHEAD_BLOCKS (32)
+#define READAHEAD_THREADS (4)
+/* dirty blocks of a write-back cache are written back once they are this
+ * old, or at once when this share of the cache is dirty */
+#define FLUSH_AGE_MS (50)
+#define FLUSH_DIRTY_PERCENT (25)
+/* blocks of the metadata journal (see journal.h), how often it commits, and
+ * how long logged blocks may wait to be written in place */
+#define JOURNAL_BLOCKS (64)
+#define JOURNAL_COMMIT_MS (10)
+#define JOURNAL_CHECKPOINT_MS (100)
+
+/* default latency of an access to the emulated storage (see storage_access) */
+#define DELAY_NS (2000)
 
 #endif // CONFIG_H
@@ -0,0 +1,74 @@
+#ifndef IMAGE_H
+#define IMAGE_H
+
+#include "config.h"
+
+#include <stdint.h>
+
+/*
+ * On-disk image of the file system, as stored in its block device. Every
+ * region starts at a block boundary, so that the image can be mapped in
+ * memory as it is:
+ *  - block 0: the superblock
+ *  - the i-node bitmap (bit i of byte i / 8 is set when i-node i is taken)
+ *  - the i-node table
+ *  - the block bitmap (the same, for the data blocks)
+ *  - the journal (see journal.h), where changes to the blocks above and to
+ *    the blocks of directories are logged before they are written in place
+ *  - the data blocks
+ * Fields are stored in the byte order of the host.
+ */
+#define IMAGE_MAGIC (0x31534654u) /* "TFS1" */
+#define IMAGE_VERSION (2)
+
+/*
+ * Superblock: what an image was made with, checked when it is loaded
+ */
+typedef struct {
+    uint32_t sb_magic;
+    uint32_t sb_version;
+    uint32_t sb_block_size;
+    uint32_t sb_inodes;
+    uint32_t sb_data_blocks;
+    /* first block of each region */
+    uint32_t sb_inode_bitmap_start;
+    uint32_t sb_inode_table_start;
+    uint32_t sb_block_bitmap_start;
+    uint32_t sb_journal_start;
+    uint32_t sb_journal_blocks;
+    uint32_t sb_data_start;
+} superblock_t;
+
+/*
+ * I-node, as stored in the i-node table (records never cross blocks)
+ */
+typedef struct {
+    uint32_t di_type;      /* inode_type */
+    int32_t di_data_block; /* -1 while the file is empty */
+    uint64_t di_size;
+} disk_inode_t;
+
+#define IMAGE_BLOCKS_FOR(bytes) (((bytes) + BLOCK_SIZE - 1) / BLOCK_SIZE)
+#define IMAGE_BITMAP_BYTES(entries) (((entries) + 7) / 8)
+#define IMAGE_INODES_PER_BLOCK (BLOCK_SIZE / sizeof(disk_inode_t))
+
+#define IMAGE_INODE_BITMAP_START (1)
+#define IMAGE_INODE_TABLE_START                                                \
+    (IMAGE_INODE_BITMAP_START +                                                \
+     IMAGE_BLOCKS_FOR(IMAGE_BITMAP_BYTES(INODE_TABLE_SIZE)))
+#define IMAGE_BLOCK_BITMAP_START                                               \
+    (IMAGE_INODE_TABLE_START +                                                 \
+     (INODE_TABLE_SIZE + IMAGE_INODES_PER_BLOCK - 1) / IMAGE_INODES_PER_BLOCK)
+#define IMAGE_JOURNAL_START                                                    \
+    (IMAGE_BLOCK_BITMAP_START +                                                \
+     IMAGE_BLOCKS_FOR(IMAGE_BITMAP_BYTES(DATA_BLOCKS)))
+#define IMAGE_DATA_START (IMAGE_JOURNAL_START + JOURNAL_BLOCKS)
+#define IMAGE_BLOCKS (IMAGE_DATA_START + DATA_BLOCKS)
+
+/* Where i-node i is stored: its block, and its offset in the block */
+#define IMAGE_INODE_BLOCK(inumber)                                             \
+    ((int)(IMAGE_INODE_TABLE_START + (size_t)(inumber) / IMAGE_INODES_PER_BLOCK))
+#define IMAGE_INODE_OFFSET(inumber)                                            \
+    ((size_t)(inumber) % IMAGE_INODES_PER_BLOCK * sizeof(disk_inode_t))
+
+#endif // IMAGE_H
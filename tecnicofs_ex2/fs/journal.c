@@ -0,0 +1,617 @@
+#include "journal.h"
+#include "state.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/*
+ * Write-ahead journal of whole blocks (the metadata of the file system).
+ * Updates run between journal_update_begin and journal_update_end. A commit
+ * holds new updates back, waits for those under way to end and collects the
+ * blocks they changed, so that a transaction never holds part of an update,
+ * and then lets updates go on while it writes the transaction to the log: a
+ * sequential run of blocks and a single flush. Commits run one at a time,
+ * and a thread whose updates were collected by another thread's commit
+ * while it waited for its turn returns without writing anything, so that
+ * threads committing at the same time share one flush (group commit). A
+ * background thread commits every JOURNAL_COMMIT_MS.
+ *
+ * Checkpoints write the logged blocks in place and empty the log: when a
+ * transaction does not fit in it, and in the background once it is half
+ * full or JOURNAL_CHECKPOINT_MS after the last checkpoint. Until then, the
+ * latest image of each block logged is kept in memory.
+ */
+
+/* Latest image of a block logged since the last checkpoint */
+typedef struct {
+    int jp_home;
+    _Alignas(uint64_t) char jp_data[BLOCK_SIZE];
+} journal_pending_t;
+
+struct journal {
+    block_device_t *j_device;
+    size_t j_start;  /* block of the header */
+    size_t j_blocks; /* blocks of the region */
+    journal_ops_t j_ops;
+
+    /* Updates only touch the counter and the barrier, unless a commit is
+     * under way: the lock is for waiting on them */
+    atomic_uint j_updates;    /* updates under way */
+    atomic_bool j_barrier;    /* a commit waits for the updates to end */
+    pthread_mutex_t j_lock;   /* protects the rest, up to j_commit_lock */
+    pthread_cond_t j_changed; /* an update ended, or the barrier was lifted */
+    uint64_t j_generation;    /* of the next commit to collect updates */
+    bool j_stopping;
+
+    /* The rest is protected by j_commit_lock (one commit or checkpoint at a
+     * time), except for the counters */
+    pthread_mutex_t j_commit_lock;
+    uint64_t j_durable;  /* generations up to it are in the log */
+    uint64_t j_sequence; /* of the next transaction written to the log */
+    size_t j_head;       /* next block of the log in the region */
+    uint64_t j_checkpoint_ns; /* when the last checkpoint ended */
+    /* transaction being committed (kept if writing it fails, so that it is
+     * written with the next one) */
+    journal_descriptor_t *j_descriptor;
+    char (*j_images)[BLOCK_SIZE];
+    size_t j_txn_max; /* most blocks a transaction may log */
+    journal_pending_t *j_pending;
+    size_t j_pending_count;
+
+    pthread_cond_t j_wake; /* stopping (by the monotonic clock) */
+    pthread_t j_committer;
+
+    _Atomic uint64_t j_commit_requests;
+    _Atomic uint64_t j_commits;
+    _Atomic uint64_t j_blocks_logged;
+    _Atomic uint64_t j_checkpoints;
+    _Atomic uint64_t j_replayed;
+};
+
+static void *journal_committer(void *arg);
+
+static uint64_t journal_now_ns() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+}
+
+/*
+ * CRC-32 (IEEE 802.3) of a buffer, continuing from an earlier one
+ */
+static uint32_t journal_crc32(uint32_t crc, void const *buffer, size_t len) {
+    unsigned char const *bytes = buffer;
+
+    crc = ~crc;
+    for (size_t i = 0; i < len; i++) {
+        crc ^= bytes[i];
+        for (int bit = 0; bit < 8; bit++) {
+            crc = (crc >> 1) ^ (0xedb88320u & (0u - (crc & 1)));
+        }
+    }
+    return ~crc;
+}
+
+/*
+ * Checksum of a transaction, as stored in its descriptor
+ */
+static uint32_t journal_checksum(journal_descriptor_t *descriptor,
+                                 char const (*images)[BLOCK_SIZE]) {
+    uint32_t stored = descriptor->jd_checksum;
+    descriptor->jd_checksum = 0;
+    uint32_t crc = journal_crc32(0, descriptor, BLOCK_SIZE);
+    descriptor->jd_checksum = stored;
+
+    for (size_t i = 0; i < descriptor->jd_count; i++) {
+        crc = journal_crc32(crc, images[i], BLOCK_SIZE);
+    }
+    return crc;
+}
+
+static int journal_write_header(journal_t *journal) {
+    journal_header_t header = {JOURNAL_MAGIC, (uint32_t)journal->j_blocks,
+                               journal->j_sequence};
+    return block_device_write(journal->j_device, (int)journal->j_start, 0,
+                              &header, sizeof(header));
+}
+
+/*
+ * Initializes the journal of a new device, with an empty log
+ * Input:
+ *  - device: the device
+ *  - start: first block of the journal's region
+ *  - blocks: number of blocks of the region (at least 4)
+ * Returns: 0 if successful, -1 otherwise
+ */
+int journal_format(block_device_t *device, size_t start, size_t blocks) {
+    if (blocks < 4) {
+        return -1;
+    }
+
+    journal_header_t header = {JOURNAL_MAGIC, (uint32_t)blocks, 1};
+    return block_device_write(device, (int)start, 0, &header, sizeof(header));
+}
+
+/*
+ * Writes the transactions found in the log in place, in order, stopping at
+ * the first one that is not valid (not written, or only in part, when the
+ * journal was last used), and then empties the log
+ * Returns: 0 if successful, -1 otherwise
+ */
+static int journal_replay(journal_t *journal) {
+    journal_header_t header;
+    if (block_device_read(journal->j_device, (int)journal->j_start, 0,
+                          &header, sizeof(header)) == -1 ||
+        header.jh_magic != JOURNAL_MAGIC ||
+        header.jh_blocks != journal->j_blocks) {
+        return -1;
+    }
+
+    journal_descriptor_t *descriptor = journal->j_descriptor;
+    journal->j_sequence = header.jh_sequence;
+    uint64_t replayed = 0;
+
+    for (size_t head = 1; head < journal->j_blocks;) {
+        if (block_device_read(journal->j_device,
+                              (int)(journal->j_start + head), 0, descriptor,
+                              BLOCK_SIZE) == -1) {
+            return -1;
+        }
+        if (descriptor->jd_magic != JOURNAL_DESCRIPTOR_MAGIC ||
+            descriptor->jd_sequence != journal->j_sequence ||
+            descriptor->jd_count > journal->j_txn_max ||
+            head + 1 + descriptor->jd_count > journal->j_blocks) {
+            break;
+        }
+
+        for (size_t i = 0; i < descriptor->jd_count; i++) {
+            if (block_device_read(journal->j_device,
+                                  (int)(journal->j_start + head + 1 + i), 0,
+                                  journal->j_images[i], BLOCK_SIZE) == -1) {
+                return -1;
+            }
+        }
+        if (journal_checksum(descriptor,
+                             (char const(*)[BLOCK_SIZE])journal->j_images) !=
+            descriptor->jd_checksum) {
+            break;
+        }
+
+        for (size_t i = 0; i < descriptor->jd_count; i++) {
+            if (block_device_write(journal->j_device,
+                                   (int)descriptor->jd_homes[i], 0,
+                                   journal->j_images[i], BLOCK_SIZE) == -1) {
+                return -1;
+            }
+        }
+
+        head += 1 + descriptor->jd_count;
+        journal->j_sequence++;
+        replayed++;
+    }
+
+    if (replayed > 0 && (block_device_flush(journal->j_device) == -1 ||
+                         journal_write_header(journal) == -1 ||
+                         block_device_flush(journal->j_device) == -1)) {
+        return -1;
+    }
+
+    atomic_store(&journal->j_replayed, replayed);
+    return 0;
+}
+
+static void journal_free(journal_t *journal) {
+    pthread_mutex_destroy(&journal->j_lock);
+    pthread_cond_destroy(&journal->j_changed);
+    pthread_mutex_destroy(&journal->j_commit_lock);
+    pthread_cond_destroy(&journal->j_wake);
+    free(journal->j_descriptor);
+    free(journal->j_images);
+    free(journal->j_pending);
+    free(journal);
+}
+
+/*
+ * Opens the journal of a device, replaying the transactions in its log, and
+ * starts committing in the background
+ * Input:
+ *  - device: the device
+ *  - start: first block of the journal's region (see journal_format)
+ *  - blocks: number of blocks of the region
+ *  - ops: how transactions are collected, and who is told about checkpoints
+ * Returns: the journal, NULL if failed
+ */
+journal_t *journal_open(block_device_t *device, size_t start, size_t blocks,
+                        journal_ops_t const *ops) {
+    if (blocks < 4) {
+        return NULL;
+    }
+    journal_t *journal = calloc(1, sizeof(journal_t));
+    if (journal == NULL) {
+        return NULL;
+    }
+
+    journal->j_device = device;
+    journal->j_start = start;
+    journal->j_blocks = blocks;
+    journal->j_ops = *ops;
+    /* Half the log, so that a transaction always fits after a checkpoint
+     * forced by the one before (see journal_commit_locked) */
+    journal->j_txn_max = blocks / 2 - 1 < JOURNAL_TXN_BLOCKS
+                             ? blocks / 2 - 1
+                             : JOURNAL_TXN_BLOCKS;
+    journal->j_descriptor = calloc(1, BLOCK_SIZE);
+    journal->j_images = malloc(journal->j_txn_max * BLOCK_SIZE);
+    journal->j_pending = malloc(blocks * sizeof(journal_pending_t));
+
+    atomic_init(&journal->j_updates, 0);
+    atomic_init(&journal->j_barrier, false);
+    pthread_mutex_init(&journal->j_lock, NULL);
+    pthread_cond_init(&journal->j_changed, NULL);
+    pthread_mutex_init(&journal->j_commit_lock, NULL);
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&journal->j_wake, &attr);
+    pthread_condattr_destroy(&attr);
+
+    if (journal->j_descriptor == NULL || journal->j_images == NULL ||
+        journal->j_pending == NULL ||
+        journal_replay(journal) == -1) {
+        journal_free(journal);
+        return NULL;
+    }
+
+    /* Replaying used the transaction buffers */
+    memset(journal->j_descriptor, 0, BLOCK_SIZE);
+    journal->j_generation = 1;
+    journal->j_head = 1;
+    journal->j_checkpoint_ns = journal_now_ns();
+
+    if (pthread_create(&journal->j_committer, NULL, journal_committer,
+                       journal) != 0) {
+        journal_free(journal);
+        return NULL;
+    }
+
+    return journal;
+}
+
+/*
+ * Stops a journal's background commits and frees it (commit and checkpoint
+ * first to keep what was not logged yet, see journal_commit)
+ */
+void journal_close(journal_t *journal) {
+    mutex_lock(LOCK_JOURNAL, &journal->j_lock);
+    journal->j_stopping = true;
+    pthread_cond_signal(&journal->j_wake);
+    mutex_unlock(LOCK_JOURNAL, &journal->j_lock);
+    pthread_join(journal->j_committer, NULL);
+
+    journal_free(journal);
+}
+
+/*
+ * Ends an update started by journal_update_begin
+ */
+void journal_update_end(journal_t *journal) {
+    /* The commit sets the barrier before it counts the updates, so either it
+     * sees this one ended or this one sees the barrier and wakes it */
+    if (atomic_fetch_sub(&journal->j_updates, 1) == 1 &&
+        atomic_load(&journal->j_barrier)) {
+        mutex_lock(LOCK_JOURNAL, &journal->j_lock);
+        pthread_cond_broadcast(&journal->j_changed);
+        mutex_unlock(LOCK_JOURNAL, &journal->j_lock);
+    }
+}
+
+/*
+ * Starts an update (which may change several blocks): it waits while a
+ * commit collects the blocks changed by the updates before it. Must be
+ * called with no locks held that updates under way may wait for, and
+ * updates must not nest.
+ */
+void journal_update_begin(journal_t *journal) {
+    while (true) {
+        atomic_fetch_add(&journal->j_updates, 1);
+        if (!atomic_load(&journal->j_barrier)) {
+            return;
+        }
+
+        /* A commit is collecting: steps back until it is over */
+        journal_update_end(journal);
+        mutex_lock(LOCK_JOURNAL, &journal->j_lock);
+        while (atomic_load(&journal->j_barrier)) {
+            cond_wait(LOCK_JOURNAL, &journal->j_changed, &journal->j_lock);
+        }
+        mutex_unlock(LOCK_JOURNAL, &journal->j_lock);
+    }
+}
+
+/*
+ * Adds a block to the transaction being committed (only from the collect
+ * operation of the journal), replacing an earlier image of it
+ * Input:
+ *  - journal: the journal
+ *  - home: where the block is written in place
+ *  - data: its contents (BLOCK_SIZE bytes)
+ * Returns: 0 if successful, -1 if the transaction is full
+ */
+int journal_log(journal_t *journal, int home, void const *data) {
+    journal_descriptor_t *descriptor = journal->j_descriptor;
+
+    size_t i = 0;
+    while (i < descriptor->jd_count &&
+           descriptor->jd_homes[i] != (uint32_t)home) {
+        i++;
+    }
+    if (i == journal->j_txn_max) {
+        return -1;
+    }
+
+    descriptor->jd_homes[i] = (uint32_t)home;
+    memcpy(journal->j_images[i], data, BLOCK_SIZE);
+    if (i == descriptor->jd_count) {
+        descriptor->jd_count++;
+    }
+    return 0;
+}
+
+/*
+ * Keeps the latest image of a block logged, to be written in place by the
+ * next checkpoint
+ */
+static void journal_keep_pending(journal_t *journal, int home,
+                                 char const *data) {
+    size_t i = 0;
+    while (i < journal->j_pending_count &&
+           journal->j_pending[i].jp_home != home) {
+        i++;
+    }
+
+    journal->j_pending[i].jp_home = home;
+    memcpy(journal->j_pending[i].jp_data, data, BLOCK_SIZE);
+    if (i == journal->j_pending_count) {
+        journal->j_pending_count++;
+    }
+}
+
+static int journal_pending_cmp(void const *a, void const *b) {
+    int home_a = ((journal_pending_t const *)a)->jp_home;
+    int home_b = ((journal_pending_t const *)b)->jp_home;
+    return (home_a > home_b) - (home_a < home_b);
+}
+
+/*
+ * Writes the logged blocks in place, in order, and empties the log.
+ * Must be called with j_commit_lock held.
+ * Returns: 0 if successful, -1 otherwise (the log is then kept)
+ */
+static int journal_checkpoint_locked(journal_t *journal) {
+    qsort(journal->j_pending, journal->j_pending_count,
+          sizeof(journal_pending_t), journal_pending_cmp);
+    for (size_t i = 0; i < journal->j_pending_count; i++) {
+        if (block_device_write(journal->j_device, journal->j_pending[i].jp_home,
+                               0, journal->j_pending[i].jp_data,
+                               BLOCK_SIZE) == -1) {
+            return -1;
+        }
+    }
+
+    /* The blocks are stored before the log that holds them is emptied */
+    if (journal->j_head > 1 &&
+        (block_device_flush(journal->j_device) == -1 ||
+         journal_write_header(journal) == -1 ||
+         block_device_flush(journal->j_device) == -1)) {
+        return -1;
+    }
+
+    journal->j_head = 1;
+    journal->j_pending_count = 0;
+    journal->j_checkpoint_ns = journal_now_ns();
+    atomic_fetch_add(&journal->j_checkpoints, 1);
+
+    journal->j_ops.jo_checkpointed(journal->j_ops.jo_arg);
+
+    return 0;
+}
+
+/*
+ * Collects the blocks changed by the updates that ended, and writes them to
+ * the log. Must be called with j_commit_lock held.
+ * Input:
+ *  - journal: the journal
+ *  - exclusive: if not NULL, run (with arg) once the updates ended and
+ *    before the blocks are collected, so that its changes are committed too
+ *  - arg: argument of exclusive
+ * Returns: 0 if successful, -1 otherwise
+ */
+static int journal_commit_locked(journal_t *journal, int (*exclusive)(void *),
+                                 void *arg) {
+    /* A transaction that might not fit in the log waits for a checkpoint
+     * first (before it is collected: blocks freed by the updates it collects
+     * are only reused once the transaction is in the log) */
+    if (journal->j_head + 1 + journal->j_txn_max > journal->j_blocks &&
+        journal_checkpoint_locked(journal) == -1) {
+        return -1;
+    }
+
+    mutex_lock(LOCK_JOURNAL, &journal->j_lock);
+    uint64_t generation = journal->j_generation++;
+    atomic_store(&journal->j_barrier, true);
+    while (atomic_load(&journal->j_updates) > 0) {
+        cond_wait(LOCK_JOURNAL, &journal->j_changed, &journal->j_lock);
+    }
+    mutex_unlock(LOCK_JOURNAL, &journal->j_lock);
+
+    int ret = exclusive != NULL ? exclusive(arg) : 0;
+    if (ret == 0) {
+        ret = journal->j_ops.jo_collect(journal, journal->j_ops.jo_arg);
+    }
+
+    mutex_lock(LOCK_JOURNAL, &journal->j_lock);
+    atomic_store(&journal->j_barrier, false);
+    pthread_cond_broadcast(&journal->j_changed);
+    mutex_unlock(LOCK_JOURNAL, &journal->j_lock);
+
+    journal_descriptor_t *descriptor = journal->j_descriptor;
+    if (ret == -1) {
+        return -1;
+    }
+    if (descriptor->jd_count == 0) {
+        journal->j_durable = generation;
+        journal->j_ops.jo_committed(journal->j_ops.jo_arg);
+        return 0;
+    }
+
+    descriptor->jd_magic = JOURNAL_DESCRIPTOR_MAGIC;
+    descriptor->jd_sequence = journal->j_sequence;
+    descriptor->jd_checksum = journal_checksum(
+        descriptor, (char const(*)[BLOCK_SIZE])journal->j_images);
+
+    int block = (int)(journal->j_start + journal->j_head);
+    if (block_device_write(journal->j_device, block, 0, descriptor,
+                           BLOCK_SIZE) == -1) {
+        return -1;
+    }
+    for (size_t i = 0; i < descriptor->jd_count; i++) {
+        if (block_device_write(journal->j_device, block + 1 + (int)i, 0,
+                               journal->j_images[i], BLOCK_SIZE) == -1) {
+            return -1;
+        }
+    }
+    if (block_device_flush(journal->j_device) == -1) {
+        return -1;
+    }
+
+    for (size_t i = 0; i < descriptor->jd_count; i++) {
+        journal_keep_pending(journal, (int)descriptor->jd_homes[i],
+                             journal->j_images[i]);
+    }
+    journal->j_head += 1 + descriptor->jd_count;
+    journal->j_sequence++;
+    journal->j_durable = generation;
+    atomic_fetch_add(&journal->j_commits, 1);
+    atomic_fetch_add(&journal->j_blocks_logged, descriptor->jd_count);
+    memset(descriptor, 0, BLOCK_SIZE);
+    journal->j_ops.jo_committed(journal->j_ops.jo_arg);
+
+    return 0;
+}
+
+/*
+ * Waits until the changes of every update that ended before the call are in
+ * the log (and survive a crash), committing them unless another thread's
+ * commit does it meanwhile
+ * Returns: 0 if successful, -1 otherwise
+ */
+int journal_commit(journal_t *journal) {
+    atomic_fetch_add(&journal->j_commit_requests, 1);
+
+    /* The updates that ended are collected by the next commit, or by the
+     * one collecting now, if any */
+    mutex_lock(LOCK_JOURNAL, &journal->j_lock);
+    uint64_t generation = journal->j_generation;
+    if (atomic_load(&journal->j_barrier)) {
+        generation--;
+    }
+    mutex_unlock(LOCK_JOURNAL, &journal->j_lock);
+
+    mutex_lock(LOCK_JOURNAL, &journal->j_commit_lock);
+    int ret = 0;
+    if (journal->j_durable < generation) {
+        ret = journal_commit_locked(journal, NULL, NULL);
+    }
+    mutex_unlock(LOCK_JOURNAL, &journal->j_commit_lock);
+
+    return ret;
+}
+
+/*
+ * Runs an operation while no update is under way (as an update that excludes
+ * every other), and commits its changes along with those of the updates
+ * that ended before it
+ * Input:
+ *  - journal: the journal
+ *  - exclusive: the operation, which returns 0 if successful (and -1
+ *    otherwise, in which case nothing is committed yet)
+ *  - arg: argument of the operation
+ * Returns: 0 if successful, -1 otherwise
+ */
+int journal_commit_exclusive(journal_t *journal, int (*exclusive)(void *),
+                             void *arg) {
+    mutex_lock(LOCK_JOURNAL, &journal->j_commit_lock);
+    int ret = journal_commit_locked(journal, exclusive, arg);
+    mutex_unlock(LOCK_JOURNAL, &journal->j_commit_lock);
+
+    return ret;
+}
+
+/*
+ * Writes every block logged so far in place, emptying the log
+ * Returns: 0 if successful, -1 otherwise
+ */
+int journal_checkpoint(journal_t *journal) {
+    mutex_lock(LOCK_JOURNAL, &journal->j_commit_lock);
+    int ret = journal_checkpoint_locked(journal);
+    mutex_unlock(LOCK_JOURNAL, &journal->j_commit_lock);
+
+    return ret;
+}
+
+/*
+ * Commits every JOURNAL_COMMIT_MS, and checkpoints once the log is half full
+ * or JOURNAL_CHECKPOINT_MS after the last checkpoint, until the journal is
+ * closed
+ */
+static void *journal_committer(void *arg) {
+    journal_t *journal = arg;
+    uint64_t const checkpoint_ns = (uint64_t)JOURNAL_CHECKPOINT_MS * 1000000u;
+
+    mutex_lock(LOCK_JOURNAL, &journal->j_lock);
+    while (!journal->j_stopping) {
+        uint64_t until_ns =
+            journal_now_ns() + (uint64_t)JOURNAL_COMMIT_MS * 1000000u;
+        struct timespec until = {(time_t)(until_ns / 1000000000u),
+                                 (long)(until_ns % 1000000000u)};
+        cond_timedwait(LOCK_JOURNAL, &journal->j_wake, &journal->j_lock,
+                       &until);
+        if (journal->j_stopping) {
+            break;
+        }
+        mutex_unlock(LOCK_JOURNAL, &journal->j_lock);
+
+        /* Failures are retried at the next round */
+        mutex_lock(LOCK_JOURNAL, &journal->j_commit_lock);
+        journal_commit_locked(journal, NULL, NULL);
+        if (journal->j_head > journal->j_blocks / 2 ||
+            (journal->j_pending_count > 0 &&
+             journal_now_ns() - journal->j_checkpoint_ns >= checkpoint_ns)) {
+            journal_checkpoint_locked(journal);
+        }
+        mutex_unlock(LOCK_JOURNAL, &journal->j_commit_lock);
+
+        mutex_lock(LOCK_JOURNAL, &journal->j_lock);
+    }
+    mutex_unlock(LOCK_JOURNAL, &journal->j_lock);
+
+    return NULL;
+}
+
+/*
+ * Collects the counters of a journal
+ * Input:
+ *  - journal: the journal
+ *  - stats: where to store them
+ */
+void journal_stats(journal_t *journal, journal_stats_t *stats) {
+    stats->js_commit_requests = atomic_load(&journal->j_commit_requests);
+    stats->js_commits = atomic_load(&journal->j_commits);
+    stats->js_blocks_logged = atomic_load(&journal->j_blocks_logged);
+    stats->js_checkpoints = atomic_load(&journal->j_checkpoints);
+    stats->js_replayed = atomic_load(&journal->j_replayed);
+}
@@ -0,0 +1,81 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include "block_device.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct journal journal_t;
+
+/*
+ * Region of a block device where a journal logs whole blocks before they are
+ * written in place. Its first block is a header; transactions follow, each
+ * as a descriptor block and the images of the blocks it logs, and are only
+ * valid if their checksum matches. The log starts over (at the block after
+ * the header) after every checkpoint.
+ */
+#define JOURNAL_MAGIC (0x4c4e524au)            /* "JRNL" */
+#define JOURNAL_DESCRIPTOR_MAGIC (0x43534544u) /* "DESC" */
+
+typedef struct {
+    uint32_t jh_magic;
+    uint32_t jh_blocks;   /* blocks of the region, header included */
+    uint64_t jh_sequence; /* of the first transaction in the log */
+} journal_header_t;
+
+typedef struct {
+    uint32_t jd_magic;
+    uint32_t jd_count; /* blocks logged, whose images follow */
+    uint64_t jd_sequence;
+    uint32_t jd_checksum; /* CRC-32 of the descriptor (with this field at
+                             zero) and of the images */
+    uint32_t jd_homes[];  /* where each block is written in place */
+} journal_descriptor_t;
+
+/* Most blocks a transaction may log */
+#define JOURNAL_TXN_BLOCKS                                                     \
+    ((BLOCK_SIZE - sizeof(journal_descriptor_t)) / sizeof(uint32_t))
+
+/*
+ * What the user of a journal provides: collect adds the blocks changed since
+ * the last commit to the transaction being committed (see journal_log),
+ * while no update is under way; committed is told when the blocks collected
+ * are in the log, and checkpointed when every block logged so far is stored
+ * in place (and the log is empty)
+ */
+typedef struct {
+    int (*jo_collect)(journal_t *journal, void *arg);
+    void (*jo_committed)(void *arg);
+    void (*jo_checkpointed)(void *arg);
+    void *jo_arg;
+} journal_ops_t;
+
+/*
+ * Counters of a journal (see journal_stats)
+ */
+typedef struct {
+    uint64_t js_commit_requests; /* calls to journal_commit */
+    uint64_t js_commits;         /* transactions written to the log */
+    uint64_t js_blocks_logged;
+    uint64_t js_checkpoints;
+    uint64_t js_replayed; /* transactions replayed when opened */
+} journal_stats_t;
+
+int journal_format(block_device_t *device, size_t start, size_t blocks);
+journal_t *journal_open(block_device_t *device, size_t start, size_t blocks,
+                        journal_ops_t const *ops);
+void journal_close(journal_t *journal);
+
+void journal_update_begin(journal_t *journal);
+void journal_update_end(journal_t *journal);
+
+int journal_log(journal_t *journal, int home, void const *data);
+int journal_commit(journal_t *journal);
+int journal_commit_exclusive(journal_t *journal, int (*exclusive)(void *),
+                             void *arg);
+int journal_checkpoint(journal_t *journal);
+
+void journal_stats(journal_t *journal, journal_stats_t *stats);
+
+#endif // JOURNAL_H
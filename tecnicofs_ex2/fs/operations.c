@@ -1,65 +1,138 @@
 #include "operations.h"
+#include "block_device.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <pthread.h>
+#include <sched.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-
-#define lock() pthread_mutex_lock(&single_global_lock)
-#define unlock() pthread_mutex_unlock(&single_global_lock)
-
-static pthread_mutex_t single_global_lock = PTHREAD_MUTEX_INITIALIZER;
-static pthread_cond_t open_files_condition;
-int open_files = 0;
-int tfs_status = TFS_DISABLE;
+#include <unistd.h>
+
+/*
+ * There is no global lock: lookups take no locks at all, file creations are
+ * serialized by name (through striped locks), data accesses by byte-range locks
+ * of the file (taken with its i-node locked for reading, as truncations lock it
+ * for writing), and the uses of a handle's offset by the lock of its open file
+ * entry. This lock only orders the changes of tfs_status made by tfs_init and
+ * the destroy functions, which wait on the conditions for open_files (or
+ * operations) to drop to zero.
+ */
+static pthread_mutex_t open_files_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t open_files_condition = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t operations_condition = PTHREAD_COND_INITIALIZER;
+/* Open files, plus the operations without a file handle under way */
+atomic_int open_files = 0;
+/* Operations under way, with or without a file handle */
+static atomic_int operations = 0;
+atomic_int tfs_status = TFS_DISABLE;
 
 int tfs_init() {
-    state_init();
+    char const *latency = getenv("TFS_LATENCY");
+    if (latency != NULL && latency_model_set(latency) != 0) {
+        return -1;
+    }
+    char const *policy = getenv("TFS_CACHE_POLICY");
+    if (policy != NULL && data_block_cache_policy_set(policy) != 0) {
+        return -1;
+    }
 
-    lock();
+    return tfs_init_device(getenv("TFS_BLOCK_DEVICE"));
+}
 
-    if (pthread_cond_init(&open_files_condition, NULL) != 0) {
+int tfs_init_device(char const *device_spec) {
+    if (state_init(device_spec) != 0) {
         return -1;
     }
 
-    tfs_status = TFS_ENABLE;
+    if (mutex_lock(LOCK_GLOBAL, &open_files_lock) != 0) {
+        state_destroy();
+        return -1;
+    }
 
     /* create root inode */
+    metadata_update_begin();
     int root = inode_create(T_DIRECTORY);
+    metadata_update_end();
     if (root != ROOT_DIR_INUM) {
+        state_destroy();
+        mutex_unlock(LOCK_GLOBAL, &open_files_lock);
         return -1;
     }
 
-    unlock();
+    tfs_status = TFS_ENABLE;
+
+    mutex_unlock(LOCK_GLOBAL, &open_files_lock);
 
     return 0;
 }
 
-int _tfs_destroy_unsynchronized() {
-    state_destroy();
+int tfs_init_from_image(char const *path) {
+    char spec[PATH_MAX + 5];
+    if (snprintf(spec, sizeof(spec), "mmap:%s", path) >= (int)sizeof(spec) ||
+        state_load(spec) != 0) {
+        return -1;
+    }
 
-    tfs_status = TFS_DISABLE;
+    if (mutex_lock(LOCK_GLOBAL, &open_files_lock) != 0) {
+        state_destroy();
+        return -1;
+    }
 
-    if (pthread_cond_destroy(&open_files_condition) != 0) {
+    /* The root directory was stored like any other i-node */
+    tfs_stat_t root;
+    if (inode_stat(ROOT_DIR_INUM, &root) != 0 ||
+        root.st_type != T_DIRECTORY ||
+        inode_get(ROOT_DIR_INUM)->i_data_block == -1) {
+        state_destroy();
+        mutex_unlock(LOCK_GLOBAL, &open_files_lock);
         return -1;
     }
 
+    tfs_status = TFS_ENABLE;
+
+    mutex_unlock(LOCK_GLOBAL, &open_files_lock);
+
     return 0;
 }
 
+/*
+ * Must be called with open_files_lock held, which is released while the
+ * operations under way end (no new ones start, once the status is set)
+ */
+static int _tfs_destroy_unsynchronized() {
+    tfs_status = TFS_DISABLE;
+    while (operations > 0) {
+        cond_wait(LOCK_GLOBAL, &operations_condition, &open_files_lock);
+    }
+
+    /* The journal is emptied, so that the image holds everything in place */
+    int ret = state_sync();
+    if (metadata_checkpoint() == -1) {
+        ret = -1;
+    }
+    state_destroy();
+
+    return ret;
+}
+
 int tfs_destroy() {
-    lock();
+    if (mutex_lock(LOCK_GLOBAL, &open_files_lock) != 0) {
+        return -1;
+    }
 
     if (tfs_status == TFS_DISABLE) {
-        unlock();
+        mutex_unlock(LOCK_GLOBAL, &open_files_lock);
         return -1;
     }
 
     if (_tfs_destroy_unsynchronized() != 0) {
-        unlock();
+        mutex_unlock(LOCK_GLOBAL, &open_files_lock);
         return -1;
     }
-    unlock();
+    mutex_unlock(LOCK_GLOBAL, &open_files_lock);
 
     return 0;
 }
@@ -68,42 +141,105 @@ static bool valid_pathname(char const *name) {
     return name != NULL && strlen(name) > 1 && name[0] == '/';
 }
 
+static void op_leave() {
+    /* Only a destroy, which disables the file system first, waits for the
+     * count to drop to zero */
+    if (atomic_fetch_sub(&operations, 1) == 1 && tfs_status == TFS_DISABLE) {
+        mutex_lock(LOCK_GLOBAL, &open_files_lock);
+        pthread_cond_broadcast(&operations_condition);
+        mutex_unlock(LOCK_GLOBAL, &open_files_lock);
+    }
+}
+
+/*
+ * Every operation counts as under way while it runs, so that tfs_destroy
+ * waits for it before the state is torn down.
+ * Returns true if the operation may go on, false if the file system is not
+ * enabled.
+ */
+static bool op_enter() {
+    atomic_fetch_add(&operations, 1);
+
+    if (tfs_status == TFS_DISABLE) {
+        op_leave();
+        return false;
+    }
+
+    return true;
+}
+
+static void open_file_release() {
+    if (atomic_fetch_sub(&open_files, 1) == 1) {
+        mutex_lock(LOCK_GLOBAL, &open_files_lock);
+        pthread_cond_broadcast(&open_files_condition);
+        mutex_unlock(LOCK_GLOBAL, &open_files_lock);
+    }
+}
+
+static void fs_leave() {
+    open_file_release();
+    op_leave();
+}
+
+/*
+ * Operations that do not use a file handle also count as an open file while
+ * they run, so that tfs_destroy_after_all_closed waits for them too (tfs_open
+ * keeps that count when it succeeds, until the file is closed).
+ * Returns true if the operation may go on, false if the file system is not
+ * enabled (or being shut down, for opens).
+ */
+static bool fs_enter(bool opening) {
+    if (!op_enter()) {
+        return false;
+    }
+    atomic_fetch_add(&open_files, 1);
+
+    int status = tfs_status;
+    if (status == TFS_DISABLE || (opening && status == TFS_OPEN_BLOCKED)) {
+        fs_leave();
+        return false;
+    }
+
+    return true;
+}
+
 int tfs_destroy_after_all_closed() {
 
-    lock();
+    if (mutex_lock(LOCK_GLOBAL, &open_files_lock) != 0) {
+        return -1;
+    }
 
     if (tfs_status == TFS_DISABLE) {
-        unlock();
+        mutex_unlock(LOCK_GLOBAL, &open_files_lock);
         return -1;
     }
 
     tfs_status = TFS_OPEN_BLOCKED;
 
     while (open_files > 0) {
-        pthread_cond_wait(&open_files_condition, &single_global_lock);
+        cond_wait(LOCK_GLOBAL, &open_files_condition, &open_files_lock);
     }
 
     // If another thread managed to destroy the file system first. The
     // current thread does nothing
     if (tfs_status == TFS_DISABLE) {
-        unlock();
+        mutex_unlock(LOCK_GLOBAL, &open_files_lock);
         return 0;
     }
 
-    if (_tfs_destroy_unsynchronized() == 0) {
-        tfs_status = TFS_DISABLE;
-    }
-
-    else {
-        unlock();
+    if (_tfs_destroy_unsynchronized() != 0) {
+        mutex_unlock(LOCK_GLOBAL, &open_files_lock);
         return -1;
     }
 
-    unlock();
+    mutex_unlock(LOCK_GLOBAL, &open_files_lock);
     return 0;
 }
 
-int _tfs_lookup_unsynchronized(char const *name) {
+/*
+ * Looks for a file (directory lookups need no locks)
+ */
+static int _tfs_lookup_unsynchronized(char const *name) {
     if (!valid_pathname(name)) {
         return -1;
     }
@@ -115,73 +251,322 @@ int _tfs_lookup_unsynchronized(char const *name) {
 }
 
 int tfs_lookup(char const *name) {
+    if (!fs_enter(false)) {
+        return -1;
+    }
 
-    if (pthread_mutex_lock(&single_global_lock) != 0)
+    int ret = _tfs_lookup_unsynchronized(name);
+
+    fs_leave();
+
+    return ret;
+}
+
+int tfs_list_prefix(char const *dir, char const *prefix, char *cursor,
+                    dir_entry_t *entries, size_t max_entries) {
+    // As a simplification, only the root directory exists
+    if (dir == NULL || strcmp(dir, "/") != 0 || prefix == NULL ||
+        cursor == NULL || entries == NULL) {
         return -1;
+    }
 
-    if (tfs_status == TFS_DISABLE) {
-        // No need to check input since -1 is returned anyway.
-        pthread_mutex_unlock(&single_global_lock);
+    if (!fs_enter(false)) {
         return -1;
     }
 
-    int ret = _tfs_lookup_unsynchronized(name);
-    if (pthread_mutex_unlock(&single_global_lock) != 0) {
+    int ret =
+        list_dir_entries(ROOT_DIR_INUM, prefix, cursor, entries, max_entries);
+
+    if (ret > 0) {
+        /* The next call resumes after the last name returned */
+        memcpy(cursor, entries[ret - 1].d_name, MAX_FILE_NAME);
+    }
+
+    fs_leave();
+
+    return ret;
+}
+
+int tfs_stat(char const *name, tfs_stat_t *stat) {
+    if (stat == NULL || !fs_enter(false)) {
         return -1;
     }
 
+    int inum = _tfs_lookup_unsynchronized(name);
+    int ret = inum == -1 ? -1 : inode_stat(inum, stat);
+
+    fs_leave();
+
     return ret;
 }
 
-static int _tfs_open_unsynchronized(char const *name, int flags) {
+/*
+ * Reads the i-node and the flags of an open file, without its lock. The entry
+ * may be closed and reused by another open while they are read, so the handle
+ * is checked again afterwards.
+ * Returns 0 if successful, -1 if the handle is not valid
+ */
+static int open_file_snapshot(int fhandle, int *inumber, int *flags) {
+    open_file_entry_t *file = get_open_file_entry(fhandle);
+    if (file == NULL) {
+        return -1;
+    }
+
+    int inum = file->of_inumber;
+    int file_flags = file->of_flags;
+    atomic_thread_fence(memory_order_acquire);
+    if (atomic_load_explicit(&file->of_handle, memory_order_relaxed) !=
+        fhandle) {
+        return -1;
+    }
+
+    *inumber = inum;
+    if (flags != NULL) {
+        *flags = file_flags;
+    }
+
+    return 0;
+}
+
+int tfs_fstat(int fhandle, tfs_stat_t *stat) {
+    if (stat == NULL || !op_enter()) {
+        return -1;
+    }
+
     int inum;
-    size_t offset;
+    int ret = open_file_snapshot(fhandle, &inum, NULL) == -1
+                  ? -1
+                  : inode_stat(inum, stat);
+    op_leave();
 
-    inum = _tfs_lookup_unsynchronized(name);
-    if (inum >= 0) {
-        /* The file already exists */
-        inode_t *inode = inode_get(inum);
-        if (inode == NULL) {
+    return ret;
+}
+
+/*
+ * Raises an atomic value to a new value, if it is lower
+ * Returns the previous value
+ */
+static size_t atomic_raise(_Atomic size_t *value, size_t new_value) {
+    size_t old = atomic_load(value);
+    while (old < new_value &&
+           !atomic_compare_exchange_weak(value, &old, new_value)) {
+    }
+    return old;
+}
+
+/*
+ * Raises the size of a file, if it is lower
+ */
+static void raise_file_size(inode_t *inode, size_t size) {
+    inode_meta_begin(inode);
+    if (inode->i_size < size) {
+        inode->i_size = size;
+    }
+    inode_meta_end(inode);
+}
+
+/*
+ * Returns the data block of a file, allocating it if the file is empty. New
+ * blocks read as zeros (freed blocks are discarded), so bytes past the end of
+ * the file read as zeros once it grows, without having to fill the gap.
+ * Must be called with the i-node locked (for reading, at least).
+ */
+static int file_data_block(inode_t *inode) {
+    int b = inode->i_data_block;
+
+    if (b == -1) {
+        int new_block = data_block_alloc();
+        if (new_block == -1) {
             return -1;
         }
 
-        /* Trucate (if requested) */
-        if (flags & TFS_O_TRUNC) {
-            if (inode->i_size > 0) {
-                if (data_block_free(inode->i_data_block) == -1) {
-                    return -1;
-                }
-                inode->i_size = 0;
+        inode_meta_begin(inode);
+        b = inode->i_data_block;
+        if (b == -1) {
+            inode->i_data_block = new_block;
+        }
+        inode_meta_end(inode);
+
+        if (b == -1) {
+            return new_block;
+        }
+        /* Another thread allocated it first */
+        data_block_free(new_block);
+    }
+
+    return b;
+}
+
+/*
+ * Locks a byte range of a file (clamped to the maximum file size), with its
+ * i-node locked for reading so that it is not truncated in the meantime
+ * Returns 0 if successful, -1 otherwise
+ */
+static int lock_file_range(int inumber, inode_range_t *range, size_t offset,
+                           size_t len, bool exclusive) {
+    size_t start = offset < BLOCK_SIZE ? offset : BLOCK_SIZE;
+    size_t end = len > BLOCK_SIZE - start ? BLOCK_SIZE : start + len;
+
+    if (inode_read_lock(inumber) != 0) {
+        return -1;
+    }
+    if (inode_range_lock(inumber, range, start, end, exclusive) != 0) {
+        inode_unlock(inumber);
+        return -1;
+    }
+
+    return 0;
+}
+
+static void unlock_file_range(int inumber, inode_range_t *range) {
+    inode_range_unlock(inumber, range);
+    inode_unlock(inumber);
+}
+
+/*
+ * Writes through TFS_O_APPEND handles run in parallel with each other: each
+ * one reserves its bytes with a fetch-add on i_append_end, copies them with
+ * the i-node locked for reading and then publishes them by moving i_size, in
+ * reservation order, so every record stays contiguous and readers only see
+ * complete ones.
+ * Writes past the end of the file also raise i_append_end, so that later
+ * appends go after them, and only move i_size once the reservations before
+ * them are published, so that they do not expose records still being copied.
+ * Truncations lock the i-node for writing, which waits for the appends under
+ * way.
+ */
+
+/*
+ * Appends the buffers of an array to a file, as a single record.
+ * Returns the number of bytes written, or -1 on error.
+ */
+static ssize_t _tfs_append(int inumber, struct iovec const *iov, int iovcnt) {
+    inode_t *inode = inode_get(inumber);
+    if (inode == NULL) {
+        return -1;
+    }
+
+    size_t to_write = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        to_write += iov[i].iov_len;
+    }
+    if (to_write == 0) {
+        return 0;
+    }
+
+    if (inode_read_lock(inumber) != 0) {
+        return -1;
+    }
+
+    size_t start = atomic_fetch_add(&inode->i_append_end, to_write);
+    ssize_t ret = 0;
+
+    if (start < BLOCK_SIZE) {
+        if (to_write > BLOCK_SIZE - start) {
+            to_write = BLOCK_SIZE - start;
+        }
+
+        int block = file_data_block(inode);
+        size_t written = 0;
+        for (int i = 0; block != -1 && i < iovcnt && written < to_write;
+             i++) {
+            size_t len = iov[i].iov_len;
+            if (len > to_write - written) {
+                len = to_write - written;
+            }
+            if (data_block_write(block, start + written, iov[i].iov_base,
+                                 len) == -1) {
+                block = -1;
             }
+            written += len;
         }
-        /* Determine initial offset */
-        if (flags & TFS_O_APPEND) {
-            offset = inode->i_size;
-        } else {
-            offset = 0;
+        ret = block == -1 ? -1 : (ssize_t)written;
+
+        /* Publish after the earlier reservations (even on error, so that
+         * the later ones are not held back forever) */
+        while (inode->i_size < start) {
+            sched_yield();
         }
-    } else if (flags & TFS_O_CREAT) {
-        /* The file doesn't exist; the flags specify that it should be created*/
+        raise_file_size(inode, start + to_write);
+    }
+
+    inode_unlock(inumber);
+
+    return ret;
+}
+
+/*
+ * Looks a file up, creating it if it does not exist and the flags ask for it.
+ * Only creations take a lock, which is shared with the creations of other
+ * names that hash to the same stripe, not with the whole directory.
+ * Returns the inumber of the file, -1 if unsuccessful
+ */
+static int open_inumber(char const *name, int flags) {
+    int inum = _tfs_lookup_unsynchronized(name);
+
+    if (inum >= 0 || !(flags & TFS_O_CREAT) || !valid_pathname(name)) {
+        return inum;
+    }
+
+    /* The file doesn't exist; the flags specify that it should be created*/
+    lock_file_creation(ROOT_DIR_INUM, name + 1);
+
+    /* Another thread may have created it in the meantime */
+    inum = _tfs_lookup_unsynchronized(name);
+    if (inum == -1) {
         /* Create inode */
         inum = inode_create(T_FILE);
-        if (inum == -1) {
-            return -1;
-        }
         /* Add entry in the root directory */
-        if (add_dir_entry(ROOT_DIR_INUM, inum, name + 1) == -1) {
+        if (inum != -1 && add_dir_entry(ROOT_DIR_INUM, inum, name + 1) == -1) {
             inode_delete(inum);
-            return -1;
+            inum = -1;
         }
-        offset = 0;
-    } else {
+    }
+
+    unlock_file_creation(ROOT_DIR_INUM, name + 1);
+
+    return inum;
+}
+
+static int _tfs_open(char const *name, int flags) {
+    int inum = open_inumber(name, flags);
+    if (inum == -1) {
+        return -1;
+    }
+
+    inode_t *inode = inode_get(inum);
+    if (inode == NULL) {
         return -1;
     }
 
-    open_files++;
+    /* Trucate (if requested) */
+    if (flags & TFS_O_TRUNC) {
+        if (inode_write_lock(inum) != 0) {
+            return -1;
+        }
+        if (inode->i_data_block != -1) {
+            if (data_block_free(inode->i_data_block) == -1) {
+                inode_unlock(inum);
+                return -1;
+            }
+        }
+        inode_meta_begin(inode);
+        inode->i_data_block = -1;
+        inode->i_size = 0;
+        inode_meta_end(inode);
+        inode->i_append_end = 0;
+        inode_unlock(inum);
+    }
+
+    /* Determine initial offset */
+    size_t offset = 0;
+    if (flags & TFS_O_APPEND) {
+        offset = inode->i_size;
+    }
 
     /* Finally, add entry to the open file table and
      * return the corresponding handle */
-    return add_to_open_file_table(inum, offset);
+    return add_to_open_file_table(inum, offset, flags);
 
     /* Note: for simplification, if file was created with TFS_O_CREAT and there
      * is an error adding an entry to the open file table, the file is not
@@ -189,151 +574,536 @@ static int _tfs_open_unsynchronized(char const *name, int flags) {
 }
 
 int tfs_open(char const *name, int flags) {
-
-    if (pthread_mutex_lock(&single_global_lock) != 0)
+    if (!fs_enter(true)) {
         return -1;
+    }
 
-    if (tfs_status == TFS_DISABLE || tfs_status == TFS_OPEN_BLOCKED) {
-        unlock();
-        return -1;
+    /* Creations and truncations are updates of the metadata */
+    bool update = flags & (TFS_O_CREAT | TFS_O_TRUNC);
+    if (update) {
+        metadata_update_begin();
+    }
+    int fhandle = _tfs_open(name, flags);
+    if (update) {
+        metadata_update_end();
     }
+    if (fhandle == -1) {
+        fs_leave();
+    } else {
+        op_leave();
+    }
+
+    return fhandle;
+}
 
-    int ret = _tfs_open_unsynchronized(name, flags);
-    if (pthread_mutex_unlock(&single_global_lock) != 0) {
+/*
+ * Returns the entry of an open file with its lock held, so that closing the
+ * file waits for the operations using its offset, or NULL if the handle is
+ * not valid
+ */
+static open_file_entry_t *lock_open_file(int fhandle) {
+    open_file_entry_t *file = get_open_file_entry(fhandle);
+    if (file == NULL || mutex_lock(LOCK_OPEN_FILE, &file->of_lock) != 0) {
+        return NULL;
+    }
+
+    /* The file may have been closed while waiting for the lock */
+    if (get_open_file_entry(fhandle) != file) {
+        mutex_unlock(LOCK_OPEN_FILE, &file->of_lock);
+        return NULL;
+    }
+
+    return file;
+}
+
+static int _tfs_close(int fhandle) {
+    open_file_entry_t *file = lock_open_file(fhandle);
+    if (file == NULL) {
         return -1;
     }
 
-    return ret;
+    int r = remove_from_open_file_table(fhandle);
+    mutex_unlock(LOCK_OPEN_FILE, &file->of_lock);
+
+    if (r == 0) {
+        open_file_release();
+    }
+
+    return r;
 }
 
 int tfs_close(int fhandle) {
-    if (pthread_mutex_lock(&single_global_lock) != 0)
+    if (!op_enter()) {
         return -1;
+    }
 
-    if (tfs_status == TFS_DISABLE) {
-        unlock();
+    int ret = _tfs_close(fhandle);
+    op_leave();
+
+    return ret;
+}
+
+int tfs_close_all(int const *fhandles, size_t count) {
+    if (!op_enter()) {
         return -1;
     }
 
-    int r = remove_from_open_file_table(fhandle);
+    int closed = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (_tfs_close(fhandles[i]) == 0) {
+            closed++;
+        }
+    }
+    op_leave();
+
+    return closed;
+}
 
-    if (r == 0 && --open_files == 0) {
-        if(pthread_cond_broadcast(&open_files_condition) != 0) {
+/*
+ * Writes to a file at a given offset, with the range written locked for
+ * writing. Bytes between the end of the file and the offset read as zeros.
+ */
+static ssize_t _tfs_pwrite_unsynchronized(inode_t *inode, void const *buffer,
+                                          size_t to_write, size_t offset) {
+    /* Determine how many bytes to write */
+    if (offset >= BLOCK_SIZE) {
+        return 0;
+    }
+    if (to_write + offset > BLOCK_SIZE) {
+        to_write = BLOCK_SIZE - offset;
+    }
+
+    if (to_write > 0) {
+        int block = file_data_block(inode);
+
+        /* Perform the actual write */
+        if (data_block_write(block, offset, buffer, to_write) == -1) {
             return -1;
         }
+
+        /* Wait for the appends that reserved bytes before the end of the
+         * write to publish them */
+        size_t end = offset + to_write;
+        size_t reserved = atomic_raise(&inode->i_append_end, end);
+        while (inode->i_size < (reserved < end ? reserved : end)) {
+            sched_yield();
+        }
+        raise_file_size(inode, end);
     }
 
-    if (pthread_mutex_unlock(&single_global_lock) != 0)
-        return -1;
+    return (ssize_t)to_write;
+}
 
-    return r;
+ssize_t tfs_write(int fhandle, void const *buffer, size_t to_write) {
+    struct iovec iov = {(void *)buffer, to_write};
+    return tfs_writev(fhandle, &iov, 1);
 }
 
-static ssize_t _tfs_write_unsynchronized(int fhandle, void const *buffer,
-                                         size_t to_write) {
-    open_file_entry_t *file = get_open_file_entry(fhandle);
-    if (file == NULL) {
+static ssize_t _tfs_pwrite(int fhandle, void const *buffer, size_t to_write,
+                           size_t offset) {
+    int inum;
+    if (open_file_snapshot(fhandle, &inum, NULL) == -1) {
         return -1;
     }
 
-    /* From the open file table entry, we get the inode */
-    inode_t *inode = inode_get(file->of_inumber);
+    inode_t *inode = inode_get(inum);
+    inode_range_t range;
     if (inode == NULL) {
         return -1;
     }
 
-    /* Determine how many bytes to write */
-    if (to_write + file->of_offset > BLOCK_SIZE) {
-        to_write = BLOCK_SIZE - file->of_offset;
+    /* Writes may give the file a block and change its size */
+    metadata_update_begin();
+    ssize_t ret = -1;
+    if (lock_file_range(inum, &range, offset, to_write, true) == 0) {
+        ret = _tfs_pwrite_unsynchronized(inode, buffer, to_write, offset);
+        unlock_file_range(inum, &range);
     }
+    metadata_update_end();
 
-    if (to_write > 0) {
-        if (inode->i_size == 0) {
-            /* If empty file, allocate new block */
-            inode->i_data_block = data_block_alloc();
-        }
+    return ret;
+}
 
-        void *block = data_block_get(inode->i_data_block);
-        if (block == NULL) {
+ssize_t tfs_pwrite(int fhandle, void const *buffer, size_t to_write,
+                   size_t offset) {
+    if (!op_enter()) {
+        return -1;
+    }
+
+    ssize_t ret = _tfs_pwrite(fhandle, buffer, to_write, offset);
+    op_leave();
+
+    return ret;
+}
+
+/*
+ * Reads from a file at a given offset, with the range read locked.
+ */
+static ssize_t _tfs_pread_unsynchronized(inode_t *inode, void *buffer,
+                                         size_t len, size_t offset) {
+    /* Determine how many bytes to read */
+    size_t size = inode->i_size;
+    if (offset >= size) {
+        return 0;
+    }
+    size_t to_read = size - offset;
+    if (to_read > len) {
+        to_read = len;
+    }
+
+    if (to_read > 0) {
+        /* Perform the actual read */
+        if (data_block_read(inode->i_data_block, offset, buffer, to_read) ==
+            -1) {
             return -1;
         }
+    }
 
-        /* Perform the actual write */
-        memcpy(block + file->of_offset, buffer, to_write);
+    return (ssize_t)to_read;
+}
+
+/*
+ * Writes the buffers of an array one after the other, starting at the offset
+ * of the file handle, which is then moved past the bytes written.
+ * The lock of the open file entry must be held.
+ */
+static ssize_t _tfs_writev_unsynchronized(open_file_entry_t *file,
+                                          struct iovec const *iov,
+                                          int iovcnt) {
+    size_t to_write = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        to_write += iov[i].iov_len;
+    }
 
-        /* The offset associated with the file handle is
-         * incremented accordingly */
-        file->of_offset += to_write;
-        if (file->of_offset > inode->i_size) {
-            inode->i_size = file->of_offset;
+    int inum = file->of_inumber;
+    inode_t *inode = inode_get(inum);
+    inode_range_t range;
+    if (inode == NULL ||
+        lock_file_range(inum, &range, file->of_offset, to_write, true) != 0) {
+        return -1;
+    }
+
+    size_t written = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        ssize_t ret = _tfs_pwrite_unsynchronized(
+            inode, iov[i].iov_base, iov[i].iov_len, file->of_offset + written);
+        if (ret == -1) {
+            unlock_file_range(inum, &range);
+            return -1;
+        }
+
+        written += (size_t)ret;
+        /* Stop at the first short write (the file is full) */
+        if ((size_t)ret < iov[i].iov_len) {
+            break;
         }
     }
 
-    return (ssize_t)to_write;
+    unlock_file_range(inum, &range);
+
+    file->of_offset += written;
+
+    return (ssize_t)written;
 }
 
-ssize_t tfs_write(int fhandle, void const *buffer, size_t to_write) {
-    if (pthread_mutex_lock(&single_global_lock) != 0)
+static ssize_t _tfs_writev(int fhandle, struct iovec const *iov, int iovcnt) {
+    int inum, flags;
+    if (open_file_snapshot(fhandle, &inum, &flags) == -1) {
         return -1;
+    }
 
-    if (tfs_status == TFS_DISABLE) {
-        unlock();
-        return -1;
+    /* Writes may give the file a block and change its size (see
+     * tfs_pwrite) */
+    metadata_update_begin();
+    ssize_t ret = -1;
+    open_file_entry_t *file;
+    if (flags & TFS_O_APPEND) {
+        /* Appends do not use the offset of the handle */
+        ret = _tfs_append(inum, iov, iovcnt);
+    } else if ((file = lock_open_file(fhandle)) != NULL) {
+        ret = _tfs_writev_unsynchronized(file, iov, iovcnt);
+        mutex_unlock(LOCK_OPEN_FILE, &file->of_lock);
     }
+    metadata_update_end();
 
-    ssize_t ret = _tfs_write_unsynchronized(fhandle, buffer, to_write);
-    if (pthread_mutex_unlock(&single_global_lock) != 0)
+    return ret;
+}
+
+ssize_t tfs_writev(int fhandle, struct iovec const *iov, int iovcnt) {
+    if (iov == NULL || iovcnt < 0 || !op_enter()) {
         return -1;
+    }
+
+    ssize_t ret = _tfs_writev(fhandle, iov, iovcnt);
+    op_leave();
 
     return ret;
 }
 
-static ssize_t _tfs_read_unsynchronized(int fhandle, void *buffer, size_t len) {
-    open_file_entry_t *file = get_open_file_entry(fhandle);
-    if (file == NULL) {
+static int _tfs_fsync(int fhandle) {
+    int inum;
+    if (open_file_snapshot(fhandle, &inum, NULL) == -1) {
         return -1;
     }
 
-    /* From the open file table entry, we get the inode */
-    inode_t *inode = inode_get(file->of_inumber);
+    inode_t *inode = inode_get(inum);
     if (inode == NULL) {
         return -1;
     }
 
-    /* Determine how many bytes to read */
-    size_t to_read = inode->i_size - file->of_offset;
-    if (to_read > len) {
-        to_read = len;
+    /* The data first, so that the i-node never covers unwritten bytes; the
+     * metadata is committed with that of every other file changed (fsyncs at
+     * the same time share the commit) */
+    int b = inode->i_data_block;
+    if (b != -1 && data_block_sync(b) == -1) {
+        return -1;
     }
 
-    if (to_read > 0) {
-        void *block = data_block_get(inode->i_data_block);
-        if (block == NULL) {
+    return metadata_commit();
+}
+
+int tfs_fsync(int fhandle) {
+    if (!op_enter()) {
+        return -1;
+    }
+
+    int ret = _tfs_fsync(fhandle);
+    op_leave();
+
+    return ret;
+}
+
+int tfs_sync() {
+    if (!fs_enter(false)) {
+        return -1;
+    }
+
+    int ret = state_sync();
+    fs_leave();
+
+    return ret;
+}
+
+int tfs_fsck(size_t threads, bool repair, fsck_report_t *report) {
+    if (!fs_enter(false)) {
+        return -1;
+    }
+
+    int ret = metadata_check(threads, repair, report);
+    fs_leave();
+
+    return ret;
+}
+
+ssize_t tfs_read(int fhandle, void *buffer, size_t len) {
+    struct iovec iov = {buffer, len};
+    return tfs_readv(fhandle, &iov, 1);
+}
+
+static ssize_t _tfs_pread(int fhandle, void *buffer, size_t len,
+                          size_t offset) {
+    int inum;
+    if (open_file_snapshot(fhandle, &inum, NULL) == -1) {
+        return -1;
+    }
+
+    inode_t *inode = inode_get(inum);
+    inode_range_t range;
+    if (inode == NULL ||
+        lock_file_range(inum, &range, offset, len, false) != 0) {
+        return -1;
+    }
+
+    ssize_t ret = _tfs_pread_unsynchronized(inode, buffer, len, offset);
+    unlock_file_range(inum, &range);
+
+    return ret;
+}
+
+ssize_t tfs_pread(int fhandle, void *buffer, size_t len, size_t offset) {
+    if (!op_enter()) {
+        return -1;
+    }
+
+    ssize_t ret = _tfs_pread(fhandle, buffer, len, offset);
+    op_leave();
+
+    return ret;
+}
+
+/*
+ * Fills the buffers of an array one after the other, starting at the offset
+ * of the file handle, which is then moved past the bytes read.
+ * The lock of the open file entry must be held.
+ */
+static ssize_t _tfs_readv_unsynchronized(open_file_entry_t *file,
+                                         struct iovec const *iov, int iovcnt) {
+    size_t len = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        len += iov[i].iov_len;
+    }
+
+    int inum = file->of_inumber;
+    inode_t *inode = inode_get(inum);
+    inode_range_t range;
+    if (inode == NULL ||
+        lock_file_range(inum, &range, file->of_offset, len, false) != 0) {
+        return -1;
+    }
+
+    size_t bytes_read = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        ssize_t ret = _tfs_pread_unsynchronized(inode, iov[i].iov_base,
+                                                iov[i].iov_len,
+                                                file->of_offset + bytes_read);
+        if (ret == -1) {
+            unlock_file_range(inum, &range);
             return -1;
         }
 
-        /* Perform the actual read */
-        memcpy(buffer, block + file->of_offset, to_read);
-        /* The offset associated with the file handle is
-         * incremented accordingly */
-        file->of_offset += to_read;
+        bytes_read += (size_t)ret;
+        /* Stop at the first short read (the end of the file) */
+        if ((size_t)ret < iov[i].iov_len) {
+            break;
+        }
     }
 
-    return (ssize_t)to_read;
+    unlock_file_range(inum, &range);
+
+    file->of_offset += bytes_read;
+
+    return (ssize_t)bytes_read;
 }
 
-ssize_t tfs_read(int fhandle, void *buffer, size_t len) {
-    if (pthread_mutex_lock(&single_global_lock) != 0)
+ssize_t tfs_readv(int fhandle, struct iovec const *iov, int iovcnt) {
+    if (iov == NULL || iovcnt < 0 || !op_enter()) {
         return -1;
+    }
 
-    if (tfs_status == TFS_DISABLE) {
-        unlock();
+    ssize_t ret = -1;
+    open_file_entry_t *file = lock_open_file(fhandle);
+    if (file != NULL) {
+        ret = _tfs_readv_unsynchronized(file, iov, iovcnt);
+        mutex_unlock(LOCK_OPEN_FILE, &file->of_lock);
+    }
+    op_leave();
+
+    return ret;
+}
+
+/*
+ * Writes a whole buffer to a file of the main file system (write may store
+ * fewer bytes than asked)
+ * Returns 0 if successful, -1 otherwise
+ */
+static int write_external(int fd, void const *buffer, size_t len) {
+    while (len > 0) {
+        ssize_t ret = write(fd, buffer, len);
+        if (ret == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        buffer = (char const *)buffer + ret;
+        len -= (size_t)ret;
+    }
+
+    return 0;
+}
+
+static int _tfs_copy_to_external_fs(char const *source_path,
+                                    char const *dest_path) {
+    int fhandle = tfs_open(source_path, 0);
+    if (fhandle == -1) {
         return -1;
     }
 
-    ssize_t ret = _tfs_read_unsynchronized(fhandle, buffer, len);
-    if (pthread_mutex_unlock(&single_global_lock) != 0)
+    int ret = -1;
+    int fd = open(dest_path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd != -1) {
+        /* The contents are written straight from the buffer cache, in a
+         * single write, with the whole file locked for reading */
+        int inum;
+        inode_t *inode = NULL;
+        inode_range_t range;
+        if (open_file_snapshot(fhandle, &inum, NULL) == 0) {
+            inode = inode_get(inum);
+        }
+        if (inode != NULL &&
+            lock_file_range(inum, &range, 0, BLOCK_SIZE, false) == 0) {
+            size_t size = inode->i_size;
+            void *data = NULL;
+            if (size == 0 ||
+                (data = data_block_pin(inode->i_data_block)) != NULL) {
+                ret = write_external(fd, data, size);
+            }
+            if (data != NULL) {
+                data_block_unpin(data);
+            }
+            unlock_file_range(inum, &range);
+        }
+        if (close(fd) == -1) {
+            ret = -1;
+        }
+    }
+
+    if (tfs_close(fhandle) == -1) {
+        ret = -1;
+    }
+
+    return ret;
+}
+
+int tfs_copy_to_external_fs(char const *source_path, char const *dest_path) {
+    /* The file's block is used between the open and the close */
+    if (!op_enter()) {
         return -1;
+    }
+
+    int ret = _tfs_copy_to_external_fs(source_path, dest_path);
+    op_leave();
 
     return ret;
 }
+
+int tfs_copy_from_external_fs(char const *source_path, char const *dest_path) {
+    /* One byte more than a file holds, to tell whether the source fits */
+    char buffer[BLOCK_SIZE + 1];
+    size_t len = 0;
+
+    int fd = open(source_path, O_RDONLY);
+    if (fd == -1) {
+        return -1;
+    }
+    while (len < sizeof(buffer)) {
+        ssize_t ret = read(fd, buffer + len, sizeof(buffer) - len);
+        if (ret == -1 && errno == EINTR) {
+            continue;
+        }
+        if (ret == -1) {
+            close(fd);
+            return -1;
+        }
+        if (ret == 0) {
+            break;
+        }
+        len += (size_t)ret;
+    }
+    close(fd);
+    if (len > BLOCK_SIZE) {
+        return -1;
+    }
+
+    /* The whole contents are stored by a single write */
+    int fhandle = tfs_open(dest_path, TFS_O_CREAT | TFS_O_TRUNC);
+    if (fhandle == -1) {
+        return -1;
+    }
+    ssize_t written = tfs_write(fhandle, buffer, len);
+    if (tfs_close(fhandle) == -1 || written != (ssize_t)len) {
+        return -1;
+    }
+
+    return 0;
+}
@@ -5,15 +5,66 @@
 #include "config.h"
 #include "state.h"
 #include <sys/types.h>
+#include <sys/uio.h>
 
 /*
- * Initializes tecnicofs
+ * Initializes tecnicofs, on the block device named by the TFS_BLOCK_DEVICE
+ * environment variable (in memory if it is not set), with the storage
+ * latency model named by TFS_LATENCY, if it is set (see latency_model_set),
+ * and with the cache policy named by TFS_CACHE_POLICY, if it is set (see
+ * data_block_cache_policy_set)
  * Returns 0 if successful, -1 otherwise.
  */
 int tfs_init();
 
+/*
+ * Initializes tecnicofs, with no files, on a given block device, where its
+ * image is stored (see fs/image.h, tfs_sync and tfs_init_from_image)
+ * Input:
+ *  - device_spec: "memory", "file:PATH" (pread/pwrite), "mmap:PATH" or
+ *    "uring:PATH" (io_uring); PATH is created, or truncated if it exists
+ * Returns 0 if successful, -1 otherwise.
+ */
+int tfs_init_device(char const *device_spec);
+
+/*
+ * Initializes tecnicofs with the files of an image stored by an earlier run,
+ * which keeps storing its changes (the image is mapped in memory)
+ * Input:
+ *  - path: path name of the image (in the main file system)
+ * Returns 0 if successful, -1 otherwise (e.g., if the image does not exist,
+ * or was made by a build with another geometry).
+ */
+int tfs_init_from_image(char const *path);
+
+/*
+ * Waits until every change made so far, to the contents and the metadata of
+ * every file, is stored in the block device (tfs_destroy does it too)
+ * Returns 0 if successful, -1 otherwise.
+ */
+int tfs_sync();
+
+/*
+ * Checks that the metadata of the file system is consistent (the allocation
+ * tables, the i-nodes and the directory entries agree), with several
+ * threads, and repairs what is not, if asked: bad i-nodes become empty
+ * files, i-nodes that share a block get copies, entries naming no file and
+ * files no entry names are removed, and the allocation table is fixed. It
+ * may run while the file system is in use (updates wait for it), and its
+ * repairs are stored as a single change.
+ * Input:
+ *  - threads: number of threads that check the tables (at least 1)
+ *  - repair: whether to repair the problems found
+ *  - report: where what was found (and repaired) is stored
+ * Returns 0 if successful, -1 otherwise (e.g., if the root directory cannot
+ * be read).
+ */
+int tfs_fsck(size_t threads, bool repair, fsck_report_t *report);
+
 /*
  * Destroy tecnicofs
+ * Note: it must not run concurrently with other operations (unlike
+ * tfs_destroy_after_all_closed, it does not wait for them)
  * Returns 0 if successful, -1 otherwise.
  */
 int tfs_destroy();
@@ -33,6 +84,44 @@ int tfs_destroy_after_all_closed();
  */
 int tfs_lookup(char const *name);
 
+/*
+ * Lists, in name order, the files of a directory whose name starts with a
+ * given prefix
+ * Note: as a simplification, only the root directory ("/") is supported
+ * Input:
+ *  - dir: absolute path name of the directory
+ *  - prefix: prefix of the names to list, without the initial '/' ("" lists
+ *    every file)
+ *  - cursor: buffer of MAX_FILE_NAME chars, which must contain "" on the first
+ *    call; it is updated with the last name returned, so that calling again
+ *    with the same cursor continues the listing
+ *  - entries: destination array of directory entries
+ *  - max_entries: number of entries that fit in 'entries'
+ * Returns the number of entries copied (0 when the listing is over), or -1 in
+ * case of error
+ */
+int tfs_list_prefix(char const *dir, char const *prefix, char *cursor,
+                    dir_entry_t *entries, size_t max_entries);
+
+/*
+ * Gets the metadata of a file (type, size and a version number that changes
+ * whenever they do), without taking any locks
+ * Input:
+ *  - name: absolute path name
+ *  - stat: where the metadata is stored
+ * Returns 0 if successful, -1 otherwise
+ */
+int tfs_stat(char const *name, tfs_stat_t *stat);
+
+/*
+ * Same as tfs_stat, for an open file
+ * Input:
+ *  - fhandle: file handle (obtained from a previous call to tfs_open)
+ *  - stat: where the metadata is stored
+ * Returns 0 if successful, -1 otherwise
+ */
+int tfs_fstat(int fhandle, tfs_stat_t *stat);
+
 /*
  * Opens a file
  * Input:
@@ -51,7 +140,18 @@ int tfs_open(char const *name, int flags);
  */
 int tfs_close(int fhandle);
 
-/* Writes to an open file, starting at the current offset
+/* Closes several files at once
+ * Input:
+ * 	- array of file handles (obtained from previous calls to tfs_open)
+ * 	- number of file handles in the array
+ * Returns the number of files closed (handles that are not open are
+ * skipped), or -1 in case of error
+ */
+int tfs_close_all(int const *fhandles, size_t count);
+
+/* Writes to an open file, starting at the current offset (or, if the file
+ * was opened with TFS_O_APPEND, at the end of the file, without changing
+ * the offset; concurrent appends never interleave their contents)
  * Input:
  * 	- file handle (obtained from a previous call to tfs_open)
  * 	- buffer containing the contents to write
@@ -61,6 +161,15 @@ int tfs_close(int fhandle);
  */
 ssize_t tfs_write(int fhandle, void const *buffer, size_t len);
 
+/* Waits until the contents and the metadata of an open file are stored in
+ * the block device (writes may otherwise stay in the cache for a while, see
+ * data_block_cache_policy_set)
+ * Input:
+ * 	- file handle (obtained from a previous call to tfs_open)
+ * Returns 0 if successful, -1 otherwise.
+ */
+int tfs_fsync(int fhandle);
+
 /* Reads from an open file, starting at the current offset
  * Input:
  * 	- file handle (obtained from a previous call to tfs_open)
@@ -72,6 +181,56 @@ ssize_t tfs_write(int fhandle, void const *buffer, size_t len);
  */
 ssize_t tfs_read(int fhandle, void *buffer, size_t len);
 
+/* Writes to an open file, starting at a given offset, without using or
+ * changing the offset of the file handle
+ * Input:
+ * 	- file handle (obtained from a previous call to tfs_open)
+ * 	- buffer containing the contents to write
+ * 	- length of the contents (in bytes)
+ * 	- offset in the file where the write starts (if it is past the end of
+ * 	  the file, the gap reads as zeros)
+ * Returns the number of bytes that were written (can be lower than
+ * 'len' if the maximum file size is exceeded), or -1 in case of error
+ */
+ssize_t tfs_pwrite(int fhandle, void const *buffer, size_t len, size_t offset);
+
+/* Reads from an open file, starting at a given offset, without using or
+ * changing the offset of the file handle
+ * Input:
+ * 	- file handle (obtained from a previous call to tfs_open)
+ * 	- destination buffer
+ * 	- length of the buffer
+ * 	- offset in the file where the read starts
+ * Returns the number of bytes that were copied from the file to the buffer
+ * (can be lower than 'len' if the file size was reached), or -1 in case of
+ * error
+ */
+ssize_t tfs_pread(int fhandle, void *buffer, size_t len, size_t offset);
+
+/* Writes several buffers to an open file, as a single operation, starting at
+ * the current offset (or at the end of the file, as for tfs_write)
+ * Input:
+ * 	- file handle (obtained from a previous call to tfs_open)
+ * 	- array of buffers (and their lengths) to write, in order
+ * 	- number of buffers in the array
+ * Returns the total number of bytes that were written (can be lower than
+ * the sum of the lengths if the maximum file size is exceeded), or -1 in case
+ * of error
+ */
+ssize_t tfs_writev(int fhandle, struct iovec const *iov, int iovcnt);
+
+/* Reads from an open file into several buffers, as a single operation,
+ * starting at the current offset
+ * Input:
+ * 	- file handle (obtained from a previous call to tfs_open)
+ * 	- array of destination buffers (and their lengths), filled in order
+ * 	- number of buffers in the array
+ * Returns the total number of bytes that were copied from the file (can be
+ * lower than the sum of the lengths if the file size was reached), or -1 in
+ * case of error
+ */
+ssize_t tfs_readv(int fhandle, struct iovec const *iov, int iovcnt);
+
 /* Copies the contents of a file that exists in TecnicoFS to the contents
  * of another file in the OS' file system tree (outside TecnicoFS).
  * Input:
@@ -82,4 +241,16 @@ ssize_t tfs_read(int fhandle, void *buffer, size_t len);
  */
 int tfs_copy_to_external_fs(char const *source_path, char const *dest_path);
 
+/* Copies the contents of a file in the OS' file system tree (outside
+ * TecnicoFS) to the contents of a file in TecnicoFS.
+ * Input:
+ *      - path name of the source file (in the main file system), which
+ *        must fit in a file of TecnicoFS (BLOCK_SIZE bytes)
+ *      - path name of the destination file (in TecnicoFS), which is created
+ *        if needed, and overwritten if it already exists
+ * Returns 0 if successful, -1 otherwise (the destination is not changed if
+ * the source does not fit).
+ */
+int tfs_copy_from_external_fs(char const *source_path, char const *dest_path);
+
 #endif // OPERATIONS_H
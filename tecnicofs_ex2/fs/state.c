@@ -1,26 +1,151 @@
 #include "state.h"
+#include "block_device.h"
+#include "buffer_cache.h"
+#include "image.h"
+#include "journal.h"
 
+#include <sched.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
-/* Persistent FS state  (in reality, it should be maintained in secondary
- * memory; for simplicity, this project maintains it in primary memory) */
+/* Persistent FS state, kept in primary memory and stored in the block device,
+ * laid out as an image (see image.h), through the metadata journal below */
 
 /* I-node table */
 static inode_t inode_table[INODE_TABLE_SIZE];
 static char freeinode_ts[INODE_TABLE_SIZE];
 
-/* Data blocks */
-static char fs_data[BLOCK_SIZE * DATA_BLOCKS];
+/* Data blocks, read and written through a cache of CACHE_BLOCKS blocks */
+static block_device_t *device;
+static buffer_cache_t *cache;
+static cache_policy_t cache_policy = CACHE_WRITE_BACK;
+
+/* Data blocks come after the tables in the device */
+#define DEVICE_BLOCK(block_number) ((int)IMAGE_DATA_START + (block_number))
 static char free_blocks[DATA_BLOCKS];
 
+/* I-node cache: the i-nodes are only read from the device on their first
+ * use (so that loading an image reads none), and only stored when changed,
+ * by the next commit of the journal (see metadata_collect) */
+static atomic_bool inode_cached[INODE_TABLE_SIZE];
+static atomic_bool inode_dirty[INODE_TABLE_SIZE];
+/* Serialize the reads of each i-node (see inode_fetch); reads of different
+ * i-nodes run in parallel */
+static pthread_mutex_t inode_fetch_locks[INODE_TABLE_SIZE];
+
+/* The allocation tables are kept in memory too, and stored as bitmaps: a
+ * block of a bitmap is only read the first time one of its entries is used
+ * (so that loading an image reads none), and changes only mark it dirty, to
+ * be stored with every other dirty block by the next commit of the journal */
+#define MAP_ENTRIES_PER_BLOCK ((size_t)BLOCK_SIZE * 8)
+#define MAP_BLOCKS(entries)                                                    \
+    (((entries) + MAP_ENTRIES_PER_BLOCK - 1) / MAP_ENTRIES_PER_BLOCK)
+
+typedef struct {
+    size_t am_start; /* first block of the bitmap in the device */
+    size_t am_entries;
+    char *am_table;
+    pthread_mutex_t *am_lock; /* lock of the table */
+    lock_class_t am_lock_class;
+    pthread_mutex_t *am_fetch_lock; /* serializes reads of the bitmap */
+    atomic_bool *am_cached;         /* per block of the bitmap */
+    atomic_bool *am_dirty;
+} alloc_map_t;
+
+static atomic_bool freeinode_ts_cached[MAP_BLOCKS(INODE_TABLE_SIZE)];
+static atomic_bool freeinode_ts_dirty[MAP_BLOCKS(INODE_TABLE_SIZE)];
+static atomic_bool free_blocks_cached[MAP_BLOCKS(DATA_BLOCKS)];
+static atomic_bool free_blocks_dirty[MAP_BLOCKS(DATA_BLOCKS)];
+
+/* The allocation tables are protected by one lock each */
+static pthread_mutex_t freeinode_ts_lock;
+static pthread_mutex_t free_blocks_lock;
+static pthread_mutex_t freeinode_ts_fetch_lock;
+static pthread_mutex_t free_blocks_fetch_lock;
+
+static alloc_map_t freeinode_ts_map = {
+    IMAGE_INODE_BITMAP_START, INODE_TABLE_SIZE,        freeinode_ts,
+    &freeinode_ts_lock,       LOCK_FREE_INODES,        &freeinode_ts_fetch_lock,
+    freeinode_ts_cached,      freeinode_ts_dirty};
+static alloc_map_t free_blocks_map = {
+    IMAGE_BLOCK_BITMAP_START, DATA_BLOCKS,      free_blocks,
+    &free_blocks_lock,        LOCK_FREE_BLOCKS, &free_blocks_fetch_lock,
+    free_blocks_cached,       free_blocks_dirty};
+
+/* Metadata journal: the i-node table, the bitmaps and the blocks of
+ * directories changed by each update (see metadata_update_begin) are logged
+ * together, so that a crash never stores part of an update */
+static journal_t *journal;
+/* Freed data blocks (FREEING), in the order they were freed: the first
+ * freed_committed ones were freed by transactions in the log, and the first
+ * freed_collected by the transaction being committed. They are taken again
+ * after the next checkpoint, as until then the log may still write their
+ * old contents in place. Protected by free_blocks_lock. */
+static int freed_blocks[DATA_BLOCKS];
+static atomic_size_t freed_count;
+static size_t freed_collected;
+static size_t freed_committed;
+
+/* Each i-node has its own lock, which also protects the entries of
+ * directories (the allocation tables have one lock each, above) */
+static pthread_rwlock_t inode_locks[INODE_TABLE_SIZE];
+
+/* Byte ranges currently locked in each i-node, sorted by start */
+typedef struct {
+    pthread_mutex_t rl_mutex;
+    pthread_cond_t rl_released;
+    inode_range_t *rl_held;
+} range_locks_t;
+
+static range_locks_t inode_range_locks[INODE_TABLE_SIZE];
+
+/* Lookups in directories take no locks: add_dir_entry changes a copy of the
+ * directory's block, publishes the copy as the i-node's block and frees the
+ * old one only after a grace period, when every lookup that might still be
+ * reading it is over. Lookups count themselves in one of two counters,
+ * selected by the current epoch, in stripes that keep threads from sharing
+ * cache lines */
+#define DIR_READER_STRIPES (64)
+
+typedef struct {
+    _Alignas(64) atomic_int dr_readers[2];
+} dir_readers_t;
+
+static dir_readers_t dir_readers[DIR_READER_STRIPES];
+static atomic_uint dir_epoch;
+static atomic_uint dir_reader_threads;
+static _Thread_local int dir_reader_stripe = -1;
+static pthread_mutex_t dir_grace_period_lock;
+/* Replaced blocks waiting for a grace period to be freed */
+static int dir_retired_blocks[DATA_BLOCKS];
+static size_t dir_retired_count;
+static pthread_mutex_t dir_retired_lock;
+
+/* Creations of files are serialized by name (and directory), so that the
+ * lookup and the creation are atomic, through a table of striped locks */
+#define FILE_CREATION_STRIPES (64)
+
+static pthread_mutex_t file_creation_locks[FILE_CREATION_STRIPES];
+
 /* Volatile FS state */
 
-static open_file_entry_t open_file_table[MAX_OPEN_FILES];
-static char free_open_file_entries[MAX_OPEN_FILES];
+/* The open file table grows by chunks of OPEN_FILES_CHUNK entries, which are
+ * never moved once allocated, so entries can be reached without locks */
+#define OPEN_FILES_CHUNKS (MAX_OPEN_FILES / OPEN_FILES_CHUNK)
+#define FHANDLE_INDEX_MASK ((1 << FHANDLE_INDEX_BITS) - 1)
+#define FHANDLE_GENERATION_MASK ((1u << (31 - FHANDLE_INDEX_BITS)) - 1)
+
+static _Atomic(open_file_entry_t *) open_file_table[OPEN_FILES_CHUNKS];
+/* Number of entries ever handed out (the next never used entry) */
+static atomic_int open_file_entries_used;
+/* Free list of entries: top entry (index + 1) in the lower 32 bits and a tag,
+ * incremented on every change to avoid ABA, in the upper 32 bits */
+static atomic_uint_fast64_t free_open_file_entries;
+static atomic_int open_file_entries_taken;
 
 static inline bool valid_inumber(int inumber) {
     return inumber >= 0 && inumber < INODE_TABLE_SIZE;
@@ -30,324 +155,2476 @@ static inline bool valid_block_number(int block_number) {
     return block_number >= 0 && block_number < DATA_BLOCKS;
 }
 
-static inline bool valid_file_handle(int file_handle) {
-    return file_handle >= 0 && file_handle < MAX_OPEN_FILES;
+static inline open_file_entry_t *open_file_entry(int index) {
+    open_file_entry_t *chunk = atomic_load_explicit(
+        &open_file_table[index / OPEN_FILES_CHUNK], memory_order_acquire);
+    return chunk == NULL ? NULL : &chunk[index % OPEN_FILES_CHUNK];
 }
 
-/**
- * We need to defeat the optimizer for the insert_delay() function.
- * Under optimization, the empty loop would be completely optimized away.
- * This function tells the compiler that the assembly code being run (which is
- * none) might potentially change *all memory in the process*.
- *
- * This prevents the optimizer from optimizing this code away, because it does
- * not know what it does and it may have side effects.
- *
- * Reference with more information: https://youtu.be/nXaxk27zwlk?t=2775
- *
- * Exercise: try removing this function and look at the assembly generated to
- * compare.
+/*
+ * Number of bytes of a block of an allocation table
+ * Input:
+ *  - map: the table
+ *  - block: index of the block in the table
  */
-static void touch_all_memory() { __asm volatile("" : : : "memory"); }
+static size_t alloc_map_block_len(alloc_map_t const *map, size_t block) {
+    size_t first = block * MAP_ENTRIES_PER_BLOCK;
+    size_t entries = map->am_entries - first < MAP_ENTRIES_PER_BLOCK
+                         ? map->am_entries - first
+                         : MAP_ENTRIES_PER_BLOCK;
+    return IMAGE_BITMAP_BYTES(entries);
+}
 
 /*
- * Auxiliary function to insert a delay.
- * Used in accesses to persistent FS state as a way of emulating access
- * latencies as if such data structures were really stored in secondary memory.
+ * Reads a block of the bitmap of an allocation table into it. Its entries
+ * are not used before it is marked cached, so they are filled without the
+ * table's lock.
+ * Must be called with the table's fetch lock held.
+ * Returns: 0 if successful, -1 if failed
  */
-static void insert_delay() {
-    for (int i = 0; i < DELAY; i++) {
-        touch_all_memory();
+static int alloc_map_read(alloc_map_t *map, size_t block) {
+    uint8_t bitmap[BLOCK_SIZE];
+    size_t first = block * MAP_ENTRIES_PER_BLOCK;
+    size_t len = alloc_map_block_len(map, block);
+
+    if (block_device_read(device, (int)(map->am_start + block), 0, bitmap,
+                          len) == -1) {
+        return -1;
+    }
+
+    for (size_t i = first; i < first + len * 8 && i < map->am_entries; i++) {
+        map->am_table[i] =
+            (bitmap[(i - first) / 8] & (1u << (i % 8))) ? TAKEN : FREE;
     }
+    atomic_store_explicit(&map->am_cached[block], true, memory_order_release);
+
+    return 0;
 }
 
 /*
- * Initializes FS state
+ * Brings the blocks of an allocation table that hold a range of its entries
+ * into memory, if they are not there yet
+ * Input:
+ *  - map: the table
+ *  - first: first entry of the range
+ *  - end: entry after the last one of the range
+ * Returns: 0 if successful, -1 if a block could not be read
  */
-void state_init() {
-    for (size_t i = 0; i < INODE_TABLE_SIZE; i++) {
-        freeinode_ts[i] = FREE;
-    }
+static int alloc_map_fetch(alloc_map_t *map, size_t first, size_t end) {
+    for (size_t b = first / MAP_ENTRIES_PER_BLOCK;
+         b < MAP_BLOCKS(end < map->am_entries ? end : map->am_entries); b++) {
+        if (atomic_load_explicit(&map->am_cached[b], memory_order_acquire)) {
+            continue;
+        }
 
-    for (size_t i = 0; i < DATA_BLOCKS; i++) {
-        free_blocks[i] = FREE;
-    }
+        int ret = 0;
+        mutex_lock(map->am_lock_class, map->am_fetch_lock);
+        if (!atomic_load_explicit(&map->am_cached[b], memory_order_relaxed)) {
+            ret = alloc_map_read(map, b);
+        }
+        mutex_unlock(map->am_lock_class, map->am_fetch_lock);
 
-    for (size_t i = 0; i < MAX_OPEN_FILES; i++) {
-        free_open_file_entries[i] = FREE;
+        if (ret == -1) {
+            return -1;
+        }
     }
-}
 
-void state_destroy() { /* nothing to do */
+    return 0;
 }
 
 /*
- * Creates a new i-node in the i-node table.
+ * Marks the block of an allocation table that holds a changed entry as dirty
  * Input:
- *  - n_type: the type of the node (file or directory)
- * Returns:
- *  new i-node's number if successfully created, -1 otherwise
+ *  - map: the table
+ *  - entry: the changed entry
  */
-int inode_create(inode_type n_type) {
-    for (int inumber = 0; inumber < INODE_TABLE_SIZE; inumber++) {
-        if ((inumber * (int)sizeof(allocation_state_t) % BLOCK_SIZE) == 0) {
-            insert_delay(); // simulate storage access delay (to freeinode_ts)
-        }
-
-        /* Finds first free entry in i-node table */
-        if (freeinode_ts[inumber] == FREE) {
-            /* Found a free entry, so takes it for the new i-node*/
-            freeinode_ts[inumber] = TAKEN;
-            insert_delay(); // simulate storage access delay (to i-node)
-            inode_table[inumber].i_node_type = n_type;
-
-            if (n_type == T_DIRECTORY) {
-                /* Initializes directory (filling its block with empty
-                 * entries, labeled with inumber==-1) */
-                int b = data_block_alloc();
-                if (b == -1) {
-                    freeinode_ts[inumber] = FREE;
-                    return -1;
-                }
-
-                inode_table[inumber].i_size = BLOCK_SIZE;
-                inode_table[inumber].i_data_block = b;
-
-                dir_entry_t *dir_entry = (dir_entry_t *)data_block_get(b);
-                if (dir_entry == NULL) {
-                    freeinode_ts[inumber] = FREE;
-                    return -1;
-                }
-
-                for (size_t i = 0; i < MAX_DIR_ENTRIES; i++) {
-                    dir_entry[i].d_inumber = -1;
-                }
-            } else {
-                /* In case of a new file, simply sets its size to 0 */
-                inode_table[inumber].i_size = 0;
-                inode_table[inumber].i_data_block = -1;
+static void alloc_map_dirty(alloc_map_t *map, size_t entry) {
+    atomic_store(&map->am_dirty[entry / MAP_ENTRIES_PER_BLOCK], true);
+}
+
+/*
+ * Takes the first free entry of an allocation table. Its blocks are read
+ * (if not in memory yet) one at a time, as the search reaches them, with the
+ * table unlocked, so that allocations do not wait for each other's storage
+ * accesses.
+ * Returns: the entry, -1 if there is none free (or a block could not be
+ * read)
+ */
+static int alloc_map_take(alloc_map_t *map) {
+    for (size_t b = 0; b < MAP_BLOCKS(map->am_entries); b++) {
+        size_t first = b * MAP_ENTRIES_PER_BLOCK;
+        size_t end = map->am_entries - first < MAP_ENTRIES_PER_BLOCK
+                         ? map->am_entries
+                         : first + MAP_ENTRIES_PER_BLOCK;
+        if (alloc_map_fetch(map, first, end) == -1) {
+            return -1;
+        }
+
+        mutex_lock(map->am_lock_class, map->am_lock);
+        for (size_t i = first; i < end; i++) {
+            if (map->am_table[i] == FREE) {
+                map->am_table[i] = TAKEN;
+                mutex_unlock(map->am_lock_class, map->am_lock);
+                alloc_map_dirty(map, i);
+                return (int)i;
             }
-            return inumber;
         }
+        mutex_unlock(map->am_lock_class, map->am_lock);
     }
+
     return -1;
 }
 
 /*
- * Deletes the i-node.
- * Input:
- *  - inumber: i-node's number
- * Returns: 0 if successful, -1 if failed
+ * Logs the dirty blocks of the bitmap of an allocation table in the
+ * transaction being committed (see metadata_collect)
+ * Returns: 0 if successful, -1 if failed (the blocks that were not logged
+ * stay dirty)
  */
-int inode_delete(int inumber) {
-    // simulate storage access delay (to i-node and freeinode_ts)
-    insert_delay();
-    insert_delay();
+static int alloc_map_collect(journal_t *log, alloc_map_t *map) {
+    _Alignas(uint64_t) uint8_t bitmap[BLOCK_SIZE];
 
-    if (!valid_inumber(inumber) || freeinode_ts[inumber] == FREE) {
-        return -1;
-    }
+    for (size_t b = 0; b < MAP_BLOCKS(map->am_entries); b++) {
+        if (!atomic_load(&map->am_dirty[b])) {
+            continue;
+        }
 
-    freeinode_ts[inumber] = FREE;
+        /* No update is under way, so the table is read without its lock */
+        size_t first = b * MAP_ENTRIES_PER_BLOCK;
+        size_t len = alloc_map_block_len(map, b);
+        memset(bitmap, 0, BLOCK_SIZE);
+        for (size_t i = first; i < first + len * 8 && i < map->am_entries;
+             i++) {
+            if (map->am_table[i] == TAKEN) {
+                bitmap[(i - first) / 8] |= (uint8_t)(1u << (i % 8));
+            }
+        }
 
-    if (inode_table[inumber].i_size > 0) {
-        if (data_block_free(inode_table[inumber].i_data_block) == -1) {
+        if (journal_log(log, (int)(map->am_start + b), bitmap) == -1) {
             return -1;
         }
+        atomic_store(&map->am_dirty[b], false);
     }
 
     return 0;
 }
 
+void state_destroy() {
+    for (size_t i = 0; i < OPEN_FILES_CHUNKS; i++) {
+        open_file_entry_t *chunk = atomic_exchange(&open_file_table[i], NULL);
+        if (chunk != NULL) {
+            for (size_t j = 0; j < OPEN_FILES_CHUNK; j++) {
+                pthread_mutex_destroy(&chunk[j].of_lock);
+            }
+            free(chunk);
+        }
+    }
+
+    if (journal != NULL) {
+        journal_close(journal);
+        journal = NULL;
+    }
+
+    for (size_t i = 0; i < INODE_TABLE_SIZE; i++) {
+        pthread_rwlock_destroy(&inode_locks[i]);
+        pthread_mutex_destroy(&inode_range_locks[i].rl_mutex);
+        pthread_cond_destroy(&inode_range_locks[i].rl_released);
+        pthread_mutex_destroy(&inode_fetch_locks[i]);
+    }
+    pthread_mutex_destroy(&freeinode_ts_lock);
+    pthread_mutex_destroy(&free_blocks_lock);
+    pthread_mutex_destroy(&freeinode_ts_fetch_lock);
+    pthread_mutex_destroy(&free_blocks_fetch_lock);
+    pthread_mutex_destroy(&dir_grace_period_lock);
+    pthread_mutex_destroy(&dir_retired_lock);
+
+    for (size_t i = 0; i < FILE_CREATION_STRIPES; i++) {
+        pthread_mutex_destroy(&file_creation_locks[i]);
+    }
+
+    buffer_cache_destroy(cache);
+    cache = NULL;
+    block_device_close(device);
+    device = NULL;
+}
+
 /*
- * Returns a pointer to an existing i-node.
+ * Brings an i-node into the i-node cache, if it is not there yet, reading
+ * its record (and the block of the i-node bitmap that says whether it is
+ * taken) from the device
  * Input:
- *  - inumber: identifier of the i-node
- * Returns: pointer if successful, NULL if failed
+ *  - inumber: i-node's number
+ * Returns: 0 if successful, -1 if it cannot be read or is not valid
  */
-inode_t *inode_get(int inumber) {
-    if (!valid_inumber(inumber)) {
-        return NULL;
+static int inode_fetch(int inumber) {
+    if (atomic_load_explicit(&inode_cached[inumber], memory_order_acquire)) {
+        return 0;
+    }
+    if (alloc_map_fetch(&freeinode_ts_map, (size_t)inumber,
+                        (size_t)inumber + 1) == -1) {
+        return -1;
     }
 
-    insert_delay(); // simulate storage access delay to i-node
-    return &inode_table[inumber];
+    int ret = 0;
+    mutex_lock(LOCK_INODE, &inode_fetch_locks[inumber]);
+    if (!atomic_load_explicit(&inode_cached[inumber], memory_order_relaxed)) {
+        disk_inode_t record = {T_FILE, -1, 0};
+        inode_t *inode = &inode_table[inumber];
+        if (freeinode_ts[inumber] == TAKEN &&
+            (block_device_read(device, IMAGE_INODE_BLOCK(inumber),
+                               IMAGE_INODE_OFFSET(inumber), &record,
+                               sizeof(record)) == -1 ||
+             (record.di_type != T_FILE && record.di_type != T_DIRECTORY) ||
+             record.di_size > BLOCK_SIZE ||
+             (record.di_data_block != -1 &&
+              !valid_block_number(record.di_data_block)))) {
+            ret = -1;
+        } else {
+            /* Nothing uses it before it is marked cached */
+            inode->i_node_type = (inode_type)record.di_type;
+            inode->i_size = (size_t)record.di_size;
+            inode->i_data_block = record.di_data_block;
+            inode->i_append_end = (size_t)record.di_size;
+            atomic_store_explicit(&inode_cached[inumber], true,
+                                  memory_order_release);
+        }
+    }
+    mutex_unlock(LOCK_INODE, &inode_fetch_locks[inumber]);
+
+    return ret;
 }
 
 /*
- * Adds an entry to the i-node directory data.
+ * Takes a consistent snapshot of an i-node, as stored in the device
  * Input:
- *  - inumber: identifier of the i-node
- *  - sub_inumber: identifier of the sub i-node entry
- *  - sub_name: name of the sub i-node entry
- * Returns: SUCCESS or FAIL
+ *  - inumber: i-node's number
+ *  - record: where the snapshot is stored
  */
-int add_dir_entry(int inumber, int sub_inumber, char const *sub_name) {
-    if (!valid_inumber(inumber) || !valid_inumber(sub_inumber)) {
-        return -1;
-    }
+static void inode_record(int inumber, disk_inode_t *record) {
+    inode_t *inode = &inode_table[inumber];
+    unsigned seq;
 
-    insert_delay(); // simulate storage access delay to i-node with inumber
-    if (inode_table[inumber].i_node_type != T_DIRECTORY) {
-        return -1;
+    do {
+        seq = atomic_load(&inode->i_seq);
+        record->di_type = (uint32_t)inode->i_node_type;
+        record->di_data_block = inode->i_data_block;
+        record->di_size = inode->i_size;
+    } while ((seq & 1) || atomic_load(&inode->i_seq) != seq);
+}
+
+/*
+ * Logs the metadata changed since the last commit in the transaction being
+ * committed (the collect operation of the journal): the blocks of the i-node
+ * table holding changed i-nodes, those of the bitmaps that changed, and the
+ * blocks that directories published since. It runs while no update is under
+ * way, so the tables are read without their locks (lookups may read them at
+ * the same time, but do not change them).
+ * Returns: 0 if successful, -1 if failed (what was not logged stays dirty)
+ */
+static int metadata_collect(journal_t *log, void *arg) {
+    (void)arg;
+    _Alignas(uint64_t) char image[BLOCK_SIZE];
+
+    /* The blocks of directories are only written once published (see
+     * add_dir_entry), so the i-node that publishes one says it is new */
+    for (int i = 0; i < INODE_TABLE_SIZE; i++) {
+        inode_t *inode = &inode_table[i];
+        if (!atomic_load(&inode_dirty[i]) || freeinode_ts[i] != TAKEN ||
+            inode->i_node_type != T_DIRECTORY || inode->i_data_block == -1) {
+            continue;
+        }
+
+        int home = DEVICE_BLOCK(inode->i_data_block);
+        void *data = buffer_cache_pin(cache, home);
+        if (data == NULL) {
+            return -1;
+        }
+        int ret = journal_log(log, home, data);
+        buffer_cache_unpin(cache, data);
+        if (ret == -1) {
+            return -1;
+        }
     }
 
-    if (strlen(sub_name) == 0) {
-        return -1;
+    /* Blocks of the i-node table are logged whole (free i-nodes as zeros), so
+     * the i-nodes in them that were not read yet are read first */
+    for (int first = 0; first < INODE_TABLE_SIZE;
+         first += (int)IMAGE_INODES_PER_BLOCK) {
+        int end = first + (int)IMAGE_INODES_PER_BLOCK < INODE_TABLE_SIZE
+                      ? first + (int)IMAGE_INODES_PER_BLOCK
+                      : INODE_TABLE_SIZE;
+        bool dirty = false;
+        for (int i = first; i < end; i++) {
+            dirty = dirty || atomic_load(&inode_dirty[i]);
+        }
+        if (!dirty) {
+            continue;
+        }
+
+        memset(image, 0, BLOCK_SIZE);
+        disk_inode_t *records = (disk_inode_t *)image;
+        for (int i = first; i < end; i++) {
+            if (inode_fetch(i) == -1) {
+                return -1;
+            }
+            if (freeinode_ts[i] == TAKEN) {
+                inode_record(i, &records[i - first]);
+            }
+        }
+        if (journal_log(log, IMAGE_INODE_BLOCK(first), image) == -1) {
+            return -1;
+        }
+        for (int i = first; i < end; i++) {
+            atomic_store(&inode_dirty[i], false);
+        }
     }
 
-    /* Locates the block containing the directory's entries */
-    dir_entry_t *dir_entry =
-        (dir_entry_t *)data_block_get(inode_table[inumber].i_data_block);
-    if (dir_entry == NULL) {
+    if (alloc_map_collect(log, &freeinode_ts_map) == -1 ||
+        alloc_map_collect(log, &free_blocks_map) == -1) {
         return -1;
     }
 
-    /* Finds and fills the first empty entry */
-    for (size_t i = 0; i < MAX_DIR_ENTRIES; i++) {
-        if (dir_entry[i].d_inumber == -1) {
-            dir_entry[i].d_inumber = sub_inumber;
-            strncpy(dir_entry[i].d_name, sub_name, MAX_FILE_NAME - 1);
-            dir_entry[i].d_name[MAX_FILE_NAME - 1] = 0;
-            return 0;
+    mutex_lock(LOCK_FREE_BLOCKS, &free_blocks_lock);
+    freed_collected = atomic_load(&freed_count);
+    mutex_unlock(LOCK_FREE_BLOCKS, &free_blocks_lock);
+
+    return 0;
+}
+
+/*
+ * Notes that the blocks freed by the transaction committed are in the log
+ * (the committed operation of the journal)
+ */
+static void metadata_committed(void *arg) {
+    (void)arg;
+    mutex_lock(LOCK_FREE_BLOCKS, &free_blocks_lock);
+    freed_committed = freed_collected;
+    mutex_unlock(LOCK_FREE_BLOCKS, &free_blocks_lock);
+}
+
+/*
+ * Lets the blocks freed by the transactions in the log be taken again, once
+ * discarded (the checkpointed operation of the journal)
+ */
+static void metadata_checkpointed(void *arg) {
+    (void)arg;
+    int blocks[DATA_BLOCKS];
+
+    mutex_lock(LOCK_FREE_BLOCKS, &free_blocks_lock);
+    size_t count = freed_committed;
+    size_t left = atomic_load(&freed_count) - count;
+    memcpy(blocks, freed_blocks, count * sizeof(int));
+    memmove(freed_blocks, freed_blocks + count, left * sizeof(int));
+    atomic_store(&freed_count, left);
+    freed_collected -= count;
+    freed_committed = 0;
+    mutex_unlock(LOCK_FREE_BLOCKS, &free_blocks_lock);
+
+    /* Their contents are dropped before anyone can take them again, so that
+     * new blocks read as zeros (a block that cannot be discarded is never
+     * taken again) */
+    for (size_t i = 0; i < count; i++) {
+        if (buffer_cache_discard(cache, DEVICE_BLOCK(blocks[i])) == 0) {
+            mutex_lock(LOCK_FREE_BLOCKS, &free_blocks_lock);
+            free_blocks[blocks[i]] = FREE;
+            mutex_unlock(LOCK_FREE_BLOCKS, &free_blocks_lock);
         }
     }
+}
 
-    return -1;
+/*
+ * Fills the superblock of the images of this build (see image.h)
+ */
+static void superblock_init(superblock_t *superblock) {
+    memset(superblock, 0, sizeof(*superblock));
+    superblock->sb_magic = IMAGE_MAGIC;
+    superblock->sb_version = IMAGE_VERSION;
+    superblock->sb_block_size = BLOCK_SIZE;
+    superblock->sb_inodes = INODE_TABLE_SIZE;
+    superblock->sb_data_blocks = DATA_BLOCKS;
+    superblock->sb_inode_bitmap_start = IMAGE_INODE_BITMAP_START;
+    superblock->sb_inode_table_start = IMAGE_INODE_TABLE_START;
+    superblock->sb_block_bitmap_start = IMAGE_BLOCK_BITMAP_START;
+    superblock->sb_journal_start = IMAGE_JOURNAL_START;
+    superblock->sb_journal_blocks = JOURNAL_BLOCKS;
+    superblock->sb_data_start = IMAGE_DATA_START;
 }
 
-/* Looks for a given name inside a directory
- * Input:
- * 	- parent directory's i-node number
- * 	- name to search
- * 	Returns i-number linked to the target name, -1 if not found
+/*
+ * Formats a new device: writes its superblock and an empty journal (its
+ * other blocks read as zeros, as for an empty file system)
+ * Returns: 0 if successful, -1 otherwise
  */
-int find_in_dir(int inumber, char const *sub_name) {
-    insert_delay(); // simulate storage access delay to i-node with inumber
-    if (!valid_inumber(inumber) ||
-        inode_table[inumber].i_node_type != T_DIRECTORY) {
+static int image_format() {
+    superblock_t superblock;
+    superblock_init(&superblock);
+    if (block_device_write(device, 0, 0, &superblock, sizeof(superblock)) ==
+        -1) {
         return -1;
     }
 
-    /* Locates the block containing the directory's entries */
-    dir_entry_t *dir_entry =
-        (dir_entry_t *)data_block_get(inode_table[inumber].i_data_block);
-    if (dir_entry == NULL) {
+    return journal_format(device, IMAGE_JOURNAL_START, JOURNAL_BLOCKS);
+}
+
+/*
+ * Checks that the superblock of the device matches this build
+ * Returns: 0 if it does, -1 if the image is not valid or cannot be read
+ */
+static int image_check() {
+    superblock_t expected, superblock;
+    superblock_init(&expected);
+    if (block_device_read(device, 0, 0, &superblock, sizeof(superblock)) ==
+            -1 ||
+        memcmp(&superblock, &expected, sizeof(superblock)) != 0) {
         return -1;
     }
 
-    /* Iterates over the directory entries looking for one that has the target
-     * name */
-    for (int i = 0; i < MAX_DIR_ENTRIES; i++)
-        if ((dir_entry[i].d_inumber != -1) &&
-            (strncmp(dir_entry[i].d_name, sub_name, MAX_FILE_NAME) == 0)) {
-            return dir_entry[i].d_inumber;
-        }
-
-    return -1;
+    return 0;
 }
 
 /*
- * Allocated a new data block
- * Returns: block index if successful, -1 otherwise
+ * Makes a device whose journal replayed transactions (after a crash) safe to
+ * allocate from: the blocks freed by those transactions may not have been
+ * discarded yet (see metadata_checkpointed), so every free block is
+ * discarded (which reads the whole bitmap of the data blocks)
+ * Returns: 0 if successful, -1 otherwise
  */
-int data_block_alloc() {
-    for (int i = 0; i < DATA_BLOCKS; i++) {
-        if (i * (int)sizeof(allocation_state_t) % BLOCK_SIZE == 0) {
-            insert_delay(); // simulate storage access delay to free_blocks
-        }
+static int image_recover() {
+    if (alloc_map_fetch(&free_blocks_map, 0, DATA_BLOCKS) == -1) {
+        return -1;
+    }
 
-        if (free_blocks[i] == FREE) {
-            free_blocks[i] = TAKEN;
-            return i;
+    for (int b = 0; b < DATA_BLOCKS; b++) {
+        if (free_blocks[b] == FREE &&
+            block_device_discard(device, DEVICE_BLOCK(b)) == -1) {
+            return -1;
         }
     }
-    return -1;
+
+    return 0;
 }
 
-/* Frees a data block
- * Input
- * 	- the block index
- * Returns: 0 if success, -1 otherwise
+/*
+ * Initializes FS state, on a new device or on one stored by an earlier run
+ * (see state_init and state_load)
  */
-int data_block_free(int block_number) {
-    if (!valid_block_number(block_number)) {
+static int state_open(char const *device_spec, bool load) {
+    device = load ? block_device_load(device_spec, IMAGE_BLOCKS)
+                  : block_device_open(device_spec, IMAGE_BLOCKS);
+    if (device == NULL) {
+        return -1;
+    }
+    cache = buffer_cache_create(device, CACHE_BLOCKS, cache_policy);
+    if (cache == NULL) {
+        block_device_close(device);
+        device = NULL;
+        return -1;
+    }
+
+    for (size_t i = 0; i < INODE_TABLE_SIZE; i++) {
+        freeinode_ts[i] = FREE;
+        atomic_init(&inode_table[i].i_seq, 0);
+        /* A new device holds no i-nodes, and no taken entries in the
+         * bitmaps, so there is nothing to read */
+        atomic_init(&inode_cached[i], !load);
+        atomic_init(&inode_dirty[i], false);
+        pthread_rwlock_init(&inode_locks[i], NULL);
+        pthread_mutex_init(&inode_range_locks[i].rl_mutex, NULL);
+        pthread_cond_init(&inode_range_locks[i].rl_released, NULL);
+        inode_range_locks[i].rl_held = NULL;
+        pthread_mutex_init(&inode_fetch_locks[i], NULL);
+    }
+    pthread_mutex_init(&freeinode_ts_lock, NULL);
+    pthread_mutex_init(&free_blocks_lock, NULL);
+    pthread_mutex_init(&freeinode_ts_fetch_lock, NULL);
+    pthread_mutex_init(&free_blocks_fetch_lock, NULL);
+
+    for (size_t i = 0; i < DIR_READER_STRIPES; i++) {
+        atomic_init(&dir_readers[i].dr_readers[0], 0);
+        atomic_init(&dir_readers[i].dr_readers[1], 0);
+    }
+    atomic_init(&dir_epoch, 0);
+    pthread_mutex_init(&dir_grace_period_lock, NULL);
+    dir_retired_count = 0;
+    pthread_mutex_init(&dir_retired_lock, NULL);
+
+    for (size_t i = 0; i < FILE_CREATION_STRIPES; i++) {
+        pthread_mutex_init(&file_creation_locks[i], NULL);
+    }
+
+    for (size_t i = 0; i < DATA_BLOCKS; i++) {
+        free_blocks[i] = FREE;
+    }
+    for (size_t i = 0; i < MAP_BLOCKS(INODE_TABLE_SIZE); i++) {
+        atomic_init(&freeinode_ts_cached[i], !load);
+        atomic_init(&freeinode_ts_dirty[i], false);
+    }
+    for (size_t i = 0; i < MAP_BLOCKS(DATA_BLOCKS); i++) {
+        atomic_init(&free_blocks_cached[i], !load);
+        atomic_init(&free_blocks_dirty[i], false);
+    }
+
+    for (size_t i = 0; i < OPEN_FILES_CHUNKS; i++) {
+        atomic_init(&open_file_table[i], NULL);
+    }
+    atomic_init(&open_file_entries_used, 0);
+    atomic_init(&free_open_file_entries, 0);
+    atomic_init(&open_file_entries_taken, 0);
+
+    atomic_init(&freed_count, 0);
+    freed_collected = 0;
+    freed_committed = 0;
+
+    /* Loading a stored device only reads its superblock and replays its
+     * journal: the i-nodes and the bitmaps are read on their first use */
+    static journal_ops_t const ops = {metadata_collect, metadata_committed,
+                                      metadata_checkpointed, NULL};
+    journal_stats_t stats;
+    if ((load ? image_check() : image_format()) == -1 ||
+        (journal = journal_open(device, IMAGE_JOURNAL_START, JOURNAL_BLOCKS,
+                                &ops)) == NULL) {
+        state_destroy();
+        return -1;
+    }
+    journal_stats(journal, &stats);
+    if (stats.js_replayed > 0 && image_recover() == -1) {
+        state_destroy();
         return -1;
     }
 
-    insert_delay(); // simulate storage access delay to free_blocks
-    free_blocks[block_number] = FREE;
     return 0;
 }
 
-/* Returns a pointer to the contents of a given block
+/*
+ * Initializes FS state, with no files
  * Input:
- * 	- Block's index
- * Returns: pointer to the first byte of the block, NULL otherwise
+ *  - device_spec: block device to store the image of the file system in (see
+ *    block_device_open)
+ * Returns: 0 if successful, -1 otherwise
  */
-void *data_block_get(int block_number) {
-    if (!valid_block_number(block_number)) {
-        return NULL;
-    }
+int state_init(char const *device_spec) {
+    return state_open(device_spec, false);
+}
 
-    insert_delay(); // simulate storage access delay to block
-    return &fs_data[block_number * BLOCK_SIZE];
+/*
+ * Initializes FS state from the image stored in a block device by an earlier
+ * run (see state_sync)
+ * Input:
+ *  - device_spec: block device holding the image (see block_device_load)
+ * Returns: 0 if successful, -1 otherwise
+ */
+int state_load(char const *device_spec) {
+    return state_open(device_spec, true);
 }
 
-/* Add new entry to the open file table
- * Inputs:
- * 	- I-node number of the file to open
- * 	- Initial offset
- * Returns: file handle if successful, -1 otherwise
+/*
+ * Creates a new i-node in the i-node table.
+ * Input:
+ *  - n_type: the type of the node (file or directory)
+ * Returns:
+ *  new i-node's number if successfully created, -1 otherwise
  */
-int add_to_open_file_table(int inumber, size_t offset) {
-    for (int i = 0; i < MAX_OPEN_FILES; i++) {
-        if (free_open_file_entries[i] == FREE) {
-            free_open_file_entries[i] = TAKEN;
-            open_file_table[i].of_inumber = inumber;
-            open_file_table[i].of_offset = offset;
-            return i;
+int inode_create(inode_type n_type) {
+    /* Finds first free entry in i-node table, and takes it */
+    int inumber = alloc_map_take(&freeinode_ts_map);
+    if (inumber == -1) {
+        return -1;
+    }
+
+    /* The new i-node is initialized in the cache, without reading it (a read
+     * under way is over once the lock is taken); it is stored by the next
+     * commit */
+    if (!atomic_load(&inode_cached[inumber])) {
+        mutex_lock(LOCK_INODE, &inode_fetch_locks[inumber]);
+        atomic_store(&inode_cached[inumber], true);
+        mutex_unlock(LOCK_INODE, &inode_fetch_locks[inumber]);
+    }
+    inode_t *inode = &inode_table[inumber];
+    inode->i_append_end = 0;
+
+    /* In case of a new file, simply sets its size to 0 */
+    size_t size = 0;
+    int b = -1;
+
+    if (n_type == T_DIRECTORY) {
+        /* Initializes directory (with an empty block of records) */
+        dir_block_t dir_block = {0, BLOCK_SIZE};
+        b = data_block_alloc();
+        if (b != -1 &&
+            data_block_write(b, 0, &dir_block, sizeof(dir_block)) == -1) {
+            data_block_free(b);
+            b = -1;
+        }
+        if (b == -1) {
+            mutex_lock(LOCK_FREE_INODES, &freeinode_ts_lock);
+            freeinode_ts[inumber] = FREE;
+            mutex_unlock(LOCK_FREE_INODES, &freeinode_ts_lock);
+            return -1;
         }
+
+        size = BLOCK_SIZE;
     }
-    return -1;
+
+    inode_meta_begin(inode);
+    inode->i_node_type = n_type;
+    inode->i_size = size;
+    inode->i_data_block = b;
+    inode_meta_end(inode);
+
+    return inumber;
 }
 
-/* Frees an entry from the open file table
- * Inputs:
- * 	- file handle to free/close
- * Returns 0 is success, -1 otherwise
+/*
+ * Deletes the i-node.
+ * Input:
+ *  - inumber: i-node's number
+ * Returns: 0 if successful, -1 if failed
  */
-int remove_from_open_file_table(int fhandle) {
-    if (!valid_file_handle(fhandle) ||
-        free_open_file_entries[fhandle] != TAKEN) {
+int inode_delete(int inumber) {
+    if (!valid_inumber(inumber)) {
         return -1;
     }
-    free_open_file_entries[fhandle] = FREE;
-    return 0;
-}
 
-/* Returns pointer to a given entry in the open file table
- * Inputs:
- * 	 - file handle
- * Returns: pointer to the entry if sucessful, NULL otherwise
- */
-open_file_entry_t *get_open_file_entry(int fhandle) {
-    if (!valid_file_handle(fhandle)) {
-        return NULL;
+    if (inode_fetch(inumber) == -1) {
+        return -1;
     }
-    return &open_file_table[fhandle];
-}
 
-/* Checks if there are any open files.
-    If there are, returns false. Otherwise, returns true.
-    MT-safety: MT-unsafe
- */
-bool all_files_closed() {
-    for (int i = 0; i < MAX_OPEN_FILES; i++) {
-        if (free_open_file_entries[i] == TAKEN) {
-            return false;
-        }
+    mutex_lock(LOCK_FREE_INODES, &freeinode_ts_lock);
+    if (freeinode_ts[inumber] == FREE) {
+        mutex_unlock(LOCK_FREE_INODES, &freeinode_ts_lock);
+        return -1;
     }
 
-    return true;
-}
\ No newline at end of file
+    freeinode_ts[inumber] = FREE;
+    mutex_unlock(LOCK_FREE_INODES, &freeinode_ts_lock);
+    alloc_map_dirty(&freeinode_ts_map, (size_t)inumber);
+
+    /* Freed i-nodes are not stored: whoever takes it initializes it again */
+    atomic_store(&inode_dirty[inumber], false);
+
+    if (inode_table[inumber].i_data_block != -1) {
+        if (data_block_free(inode_table[inumber].i_data_block) == -1) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Returns a pointer to an existing i-node.
+ * Input:
+ *  - inumber: identifier of the i-node
+ * Returns: pointer if successful, NULL if failed
+ */
+inode_t *inode_get(int inumber) {
+    if (!valid_inumber(inumber)) {
+        return NULL;
+    }
+
+    if (inode_fetch(inumber) == -1) {
+        return NULL;
+    }
+    return &inode_table[inumber];
+}
+
+/*
+ * Starts and ends a change to the metadata of an i-node (its type, size and
+ * data block). Concurrent changes wait for each other, while readers of the
+ * metadata (inode_stat) take no locks: they retry if a change was under way.
+ * Input:
+ *  - inode: the i-node
+ */
+void inode_meta_begin(inode_t *inode) {
+    while (true) {
+        unsigned seq = atomic_load(&inode->i_seq);
+        if (!(seq & 1) &&
+            atomic_compare_exchange_weak(&inode->i_seq, &seq, seq + 1)) {
+            return;
+        }
+    }
+}
+
+void inode_meta_end(inode_t *inode) {
+    atomic_store(&inode_dirty[inode - inode_table], true);
+    atomic_fetch_add(&inode->i_seq, 1);
+}
+
+/*
+ * Waits until the metadata changed by every update that ended is in the
+ * journal, where it survives a crash (other threads committing at the same
+ * time share the same transaction, and flush)
+ * Returns: 0 if successful, -1 if failed
+ */
+int metadata_commit() { return journal_commit(journal); }
+
+/*
+ * Commits the metadata and writes everything logged in place, emptying the
+ * journal
+ * Returns: 0 if successful, -1 if failed
+ */
+int metadata_checkpoint() {
+    if (journal_commit(journal) == -1) {
+        return -1;
+    }
+
+    return journal_checkpoint(journal);
+}
+
+/*
+ * Starts and ends an update of the metadata: the changes made in between
+ * (e.g., creating an i-node, adding it to a directory and giving it a data
+ * block) are stored together by the journal, or not at all. Updates must not
+ * nest, and start with no locks held.
+ */
+void metadata_update_begin() {
+    /* Freed blocks are only taken again after a checkpoint: one is forced
+     * before too many wait for it */
+    if (atomic_load(&freed_count) >= DATA_BLOCKS / 4) {
+        metadata_checkpoint();
+    }
+
+    journal_update_begin(journal);
+}
+
+void metadata_update_end() { journal_update_end(journal); }
+
+/*
+ * Collects the counters of the metadata journal
+ * Input:
+ *  - stats: where to store them
+ */
+void metadata_journal_stats(journal_stats_t *stats) {
+    journal_stats(journal, stats);
+}
+
+/*
+ * Reads a consistent snapshot of the metadata of an i-node, without locks.
+ * Input:
+ *  - inumber: identifier of the i-node
+ *  - stat: where the metadata is stored
+ * Returns: 0 if successful, -1 if failed
+ */
+int inode_stat(int inumber, tfs_stat_t *stat) {
+    if (!valid_inumber(inumber) || stat == NULL) {
+        return -1;
+    }
+
+    if (inode_fetch(inumber) == -1) {
+        return -1;
+    }
+    inode_t *inode = &inode_table[inumber];
+    unsigned seq;
+
+    do {
+        seq = atomic_load(&inode->i_seq);
+        stat->st_type = inode->i_node_type;
+        stat->st_size = inode->i_size;
+    } while ((seq & 1) || atomic_load(&inode->i_seq) != seq);
+
+    stat->st_inumber = inumber;
+    stat->st_version = seq / 2;
+
+    return 0;
+}
+
+/*
+ * Locks an i-node for reading (shared) or for writing (exclusive).
+ * Directory entries are changed without them, and looked up without any
+ * locks (see add_dir_entry).
+ * Input:
+ *  - inumber: identifier of the i-node
+ * Returns: 0 if successful, -1 if failed
+ */
+int inode_read_lock(int inumber) {
+    if (!valid_inumber(inumber) ||
+        read_lock(LOCK_INODE, &inode_locks[inumber]) != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+int inode_write_lock(int inumber) {
+    if (!valid_inumber(inumber) ||
+        write_lock(LOCK_INODE, &inode_locks[inumber]) != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+int inode_unlock(int inumber) {
+    if (!valid_inumber(inumber) ||
+        rwlock_unlock(LOCK_INODE, &inode_locks[inumber]) != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Checks if a range conflicts with one of the held ranges of a list (they
+ * overlap and at least one of them is exclusive)
+ */
+static bool range_conflicts(inode_range_t const *held, size_t start,
+                            size_t end, bool exclusive) {
+    for (; held != NULL && held->r_start < end; held = held->r_next) {
+        if (start < held->r_end && (exclusive || held->r_exclusive)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * Locks a byte range of an i-node's data, waiting while it overlaps a range
+ * held by another thread, unless both are shared. Disjoint ranges of the same
+ * i-node can be held at the same time.
+ * Input:
+ *  - inumber: identifier of the i-node
+ *  - range: record of the range, kept by the caller until it is unlocked
+ *  - start, end: the range, [start, end)
+ *  - exclusive: true for writing, false for reading
+ * Returns: 0 if successful, -1 if failed
+ */
+int inode_range_lock(int inumber, inode_range_t *range, size_t start,
+                     size_t end, bool exclusive) {
+    if (!valid_inumber(inumber) || start > end) {
+        return -1;
+    }
+
+    range_locks_t *locks = &inode_range_locks[inumber];
+    if (mutex_lock(LOCK_RANGE, &locks->rl_mutex) != 0) {
+        return -1;
+    }
+
+    while (range_conflicts(locks->rl_held, start, end, exclusive)) {
+        cond_wait(LOCK_RANGE, &locks->rl_released, &locks->rl_mutex);
+    }
+
+    range->r_start = start;
+    range->r_end = end;
+    range->r_exclusive = exclusive;
+
+    inode_range_t **prev = &locks->rl_held;
+    while (*prev != NULL && (*prev)->r_start < start) {
+        prev = &(*prev)->r_next;
+    }
+    range->r_next = *prev;
+    *prev = range;
+
+    mutex_unlock(LOCK_RANGE, &locks->rl_mutex);
+    return 0;
+}
+
+/*
+ * Unlocks a byte range locked with inode_range_lock.
+ * Input:
+ *  - inumber: identifier of the i-node
+ *  - range: record of the range
+ * Returns: 0 if successful, -1 if failed
+ */
+int inode_range_unlock(int inumber, inode_range_t *range) {
+    if (!valid_inumber(inumber)) {
+        return -1;
+    }
+
+    range_locks_t *locks = &inode_range_locks[inumber];
+    if (mutex_lock(LOCK_RANGE, &locks->rl_mutex) != 0) {
+        return -1;
+    }
+
+    inode_range_t **prev = &locks->rl_held;
+    while (*prev != NULL && *prev != range) {
+        prev = &(*prev)->r_next;
+    }
+    if (*prev == NULL) {
+        mutex_unlock(LOCK_RANGE, &locks->rl_mutex);
+        return -1;
+    }
+    *prev = range->r_next;
+
+    pthread_cond_broadcast(&locks->rl_released);
+    mutex_unlock(LOCK_RANGE, &locks->rl_mutex);
+    return 0;
+}
+
+/*
+ * Hashes a name (32-bit FNV-1a)
+ */
+static uint32_t dir_name_hash(char const *name, size_t len) {
+    uint32_t hash = 2166136261u;
+
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (uint8_t)name[i];
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+static inline dir_record_t *dir_record(dir_block_t *dir_block, size_t slot) {
+    return (dir_record_t *)((char *)dir_block + dir_block->db_slots[slot]);
+}
+
+/*
+ * Compares the name of a record with a given name (by the same order as
+ * strcmp)
+ */
+static int dir_name_cmp(dir_record_t const *record, char const *name,
+                        size_t len) {
+    size_t common = record->dr_name_len < len ? record->dr_name_len : len;
+    int cmp = memcmp(record->dr_name, name, common);
+
+    if (cmp != 0 || record->dr_name_len == len) {
+        return cmp;
+    }
+
+    return record->dr_name_len < len ? -1 : 1;
+}
+
+/*
+ * Returns the position of the first slot of a directory block whose name is
+ * not lower than the given one (where the name is stored, or where it would
+ * have to be inserted).
+ */
+static size_t dir_lower_bound(dir_block_t *dir_block, char const *name,
+                              size_t len) {
+    size_t low = 0, high = dir_block->db_count;
+
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        if (dir_name_cmp(dir_record(dir_block, mid), name, len) < 0) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+
+    return low;
+}
+
+/*
+ * Returns the slot of a directory block holding the given name, or the
+ * number of records if there is none.
+ */
+static size_t dir_find(dir_block_t *dir_block, char const *name, size_t len) {
+    size_t pos = dir_lower_bound(dir_block, name, len);
+
+    if (pos < dir_block->db_count) {
+        dir_record_t *record = dir_record(dir_block, pos);
+        if (record->dr_hash == dir_name_hash(name, len) &&
+            dir_name_cmp(record, name, len) == 0) {
+            return pos;
+        }
+    }
+
+    return dir_block->db_count;
+}
+
+/*
+ * Reads a directory block into a buffer (of BLOCK_SIZE bytes)
+ * Returns: the block, read, NULL if failed
+ */
+static dir_block_t *dir_block_read(int block_number, void *buffer) {
+    if (data_block_read(block_number, 0, buffer, BLOCK_SIZE) == -1) {
+        return NULL;
+    }
+
+    return buffer;
+}
+
+/*
+ * Starts a lookup in a directory
+ * Returns: the counter the lookup was counted in, for dir_read_end
+ */
+static int dir_read_begin() {
+    if (dir_reader_stripe == -1) {
+        dir_reader_stripe =
+            (int)(atomic_fetch_add(&dir_reader_threads, 1) % DIR_READER_STRIPES);
+    }
+
+    int idx = (int)(atomic_load(&dir_epoch) & 1);
+    atomic_fetch_add(&dir_readers[dir_reader_stripe].dr_readers[idx], 1);
+
+    return idx;
+}
+
+static void dir_read_end(int idx) {
+    atomic_fetch_sub(&dir_readers[dir_reader_stripe].dr_readers[idx], 1);
+}
+
+/*
+ * Waits for a grace period: until every lookup started before the call is
+ * over. Each flip of the epoch sends new lookups to the other counter, so
+ * after waiting for both counters to drain (once each, after a flip) no
+ * lookup can still hold a block unpublished before the call.
+ * Must be called with dir_grace_period_lock held.
+ */
+static void dir_synchronize() {
+    for (int flip = 0; flip < 2; flip++) {
+        unsigned idx = atomic_fetch_add(&dir_epoch, 1) & 1;
+        for (size_t i = 0; i < DIR_READER_STRIPES; i++) {
+            while (atomic_load(&dir_readers[i].dr_readers[idx]) > 0) {
+                sched_yield();
+            }
+        }
+    }
+}
+
+/*
+ * Frees the retired blocks, a grace period after they were retired, until
+ * there are none left.
+ * Must be called with dir_grace_period_lock held.
+ */
+static void dir_free_retired() {
+    int blocks[DATA_BLOCKS];
+    size_t count;
+
+    for (;;) {
+        mutex_lock(LOCK_DIR, &dir_retired_lock);
+        count = dir_retired_count;
+        memcpy(blocks, dir_retired_blocks, count * sizeof(int));
+        dir_retired_count = 0;
+        mutex_unlock(LOCK_DIR, &dir_retired_lock);
+
+        if (count == 0) {
+            return;
+        }
+
+        dir_synchronize();
+        for (size_t i = 0; i < count; i++) {
+            data_block_free(blocks[i]);
+        }
+    }
+}
+
+static bool dir_retired_pending() {
+    mutex_lock(LOCK_DIR, &dir_retired_lock);
+    bool pending = dir_retired_count > 0;
+    mutex_unlock(LOCK_DIR, &dir_retired_lock);
+    return pending;
+}
+
+/*
+ * Frees a block that is no longer published as a directory's block, after a
+ * grace period. Grace periods are not waited for by every caller: one thread
+ * at a time runs them, until no blocks are left, and the others leave their
+ * blocks to it. Blocks retired after its last look at the list, but before it
+ * let the lock go, are found by the check that follows.
+ */
+static void dir_retire_block(int block_number) {
+    mutex_lock(LOCK_DIR, &dir_retired_lock);
+    dir_retired_blocks[dir_retired_count++] = block_number;
+    mutex_unlock(LOCK_DIR, &dir_retired_lock);
+
+    do {
+        if (mutex_trylock(LOCK_DIR, &dir_grace_period_lock) != 0) {
+            return;
+        }
+        dir_free_retired();
+        mutex_unlock(LOCK_DIR, &dir_grace_period_lock);
+    } while (dir_retired_pending());
+}
+
+/*
+ * Frees every block retired so far, waiting for the thread running a grace
+ * period, if there is one, so that none is left taken without an owner.
+ */
+static void dir_retire_drain() {
+    mutex_lock(LOCK_DIR, &dir_grace_period_lock);
+    dir_free_retired();
+    mutex_unlock(LOCK_DIR, &dir_grace_period_lock);
+}
+
+/*
+ * Stores the whole state in the device: the data blocks the cache holds
+ * changes to, and then the metadata, in the journal (see metadata_commit).
+ * Directory blocks still waiting for a grace period are freed first.
+ * Returns: 0 if successful, -1 otherwise
+ */
+int state_sync() {
+    dir_retire_drain();
+
+    int ret = buffer_cache_flush(cache);
+    if (metadata_commit() == -1) {
+        ret = -1;
+    }
+
+    return ret;
+}
+
+/*
+ * Serializes the creation of files with a given name in a directory (the
+ * lookup for the name and the creation of the file, if it is not found),
+ * without serializing creations of other names.
+ * Input:
+ *  - inumber: identifier of the directory's i-node
+ *  - name: name of the file
+ */
+static pthread_mutex_t *file_creation_lock(int inumber, char const *name) {
+    uint32_t hash = dir_name_hash(name, strlen(name)) ^
+                    ((uint32_t)inumber * 2654435761u);
+    return &file_creation_locks[hash % FILE_CREATION_STRIPES];
+}
+
+void lock_file_creation(int inumber, char const *name) {
+    mutex_lock(LOCK_CREATE, file_creation_lock(inumber, name));
+}
+
+void unlock_file_creation(int inumber, char const *name) {
+    mutex_unlock(LOCK_CREATE, file_creation_lock(inumber, name));
+}
+
+/*
+ * Entry added by dir_block_add
+ */
+typedef struct {
+    int de_inumber;
+    char const *de_name;
+    size_t de_len;
+} dir_new_entry_t;
+
+/*
+ * Copies a directory block, adding an entry to the copy
+ * Returns: the number of the copy, -1 if failed (no space, or the name
+ * already exists)
+ */
+static int dir_block_add(int block_number, void const *arg) {
+    dir_new_entry_t const *entry = arg;
+    int sub_inumber = entry->de_inumber;
+    char const *sub_name = entry->de_name;
+    size_t len = entry->de_len;
+
+    /* Reads the block containing the directory's entries */
+    _Alignas(dir_block_t) char buffer[BLOCK_SIZE];
+    dir_block_t *dir_block = dir_block_read(block_number, buffer);
+    if (dir_block == NULL) {
+        return -1;
+    }
+
+    /* Checks whether the new slot and record fit between the slots and the
+     * records already in the block */
+    size_t record_size = DIR_RECORD_SIZE(len);
+    size_t slots_end =
+        sizeof(dir_block_t) + (dir_block->db_count + 1) * sizeof(uint16_t);
+    if (slots_end + record_size > dir_block->db_records) {
+        return -1;
+    }
+
+    size_t pos = dir_lower_bound(dir_block, sub_name, len);
+    if (pos < dir_block->db_count &&
+        dir_name_cmp(dir_record(dir_block, pos), sub_name, len) == 0) {
+        return -1;
+    }
+
+    dir_block->db_records = (uint16_t)(dir_block->db_records - record_size);
+    dir_record_t *record =
+        (dir_record_t *)((char *)dir_block + dir_block->db_records);
+    record->dr_inumber = sub_inumber;
+    record->dr_hash = dir_name_hash(sub_name, len);
+    record->dr_name_len = (uint8_t)len;
+    memcpy(record->dr_name, sub_name, len);
+
+    /* Shifts the slots of greater names one position up and fills the gap */
+    memmove(&dir_block->db_slots[pos + 1], &dir_block->db_slots[pos],
+            (dir_block->db_count - pos) * sizeof(uint16_t));
+    dir_block->db_slots[pos] = dir_block->db_records;
+    dir_block->db_count++;
+
+    /* The entry is added to a copy of the block, as lookups may be reading
+     * the current one */
+    int new_block = data_block_alloc();
+    if (new_block == -1) {
+        return -1;
+    }
+    if (data_block_write(new_block, 0, dir_block, BLOCK_SIZE) == -1) {
+        data_block_free(new_block);
+        return -1;
+    }
+
+    return new_block;
+}
+
+/*
+ * Copies a directory block, without the entries of a given i-node
+ * Returns: the number of the copy, -1 if failed (or if there are none)
+ */
+static int dir_block_remove(int block_number, void const *arg) {
+    int sub_inumber = *(int const *)arg;
+    _Alignas(dir_block_t) char buffer[BLOCK_SIZE];
+    dir_block_t *dir_block = dir_block_read(block_number, buffer);
+    if (dir_block == NULL) {
+        return -1;
+    }
+
+    /* The other records are packed again in the copy, in the same order */
+    _Alignas(dir_block_t) char copy[BLOCK_SIZE];
+    dir_block_t *new_dir_block = (dir_block_t *)copy;
+    new_dir_block->db_count = 0;
+    new_dir_block->db_records = BLOCK_SIZE;
+    for (size_t i = 0; i < dir_block->db_count; i++) {
+        dir_record_t *record = dir_record(dir_block, i);
+        if (record->dr_inumber == sub_inumber) {
+            continue;
+        }
+
+        size_t record_size = DIR_RECORD_SIZE(record->dr_name_len);
+        new_dir_block->db_records =
+            (uint16_t)(new_dir_block->db_records - record_size);
+        memcpy(copy + new_dir_block->db_records, record, record_size);
+        new_dir_block->db_slots[new_dir_block->db_count++] =
+            new_dir_block->db_records;
+    }
+    if (new_dir_block->db_count == dir_block->db_count) {
+        return -1;
+    }
+
+    int new_block = data_block_alloc();
+    if (new_block == -1) {
+        return -1;
+    }
+    if (data_block_write(new_block, 0, new_dir_block, BLOCK_SIZE) == -1) {
+        data_block_free(new_block);
+        return -1;
+    }
+
+    return new_block;
+}
+
+/*
+ * Replaces the block of a directory with a changed copy. Changes made at the
+ * same time retry until they are all in: each one is made to a copy of the
+ * current block, which only replaces it if no other was published in the
+ * meantime. Lookups do not wait for them.
+ * Input:
+ *  - inumber: identifier of the directory's i-node
+ *  - copy: makes the changed copy of a block (given its number and arg),
+ *    and returns the number of the copy (-1 if it fails)
+ *  - arg: argument of copy
+ * Returns: 0 if successful, -1 otherwise
+ */
+static int dir_update(int inumber, int (*copy)(int, void const *),
+                      void const *arg) {
+    if (inode_fetch(inumber) == -1 ||
+        inode_table[inumber].i_node_type != T_DIRECTORY) {
+        return -1;
+    }
+
+    inode_t *inode = &inode_table[inumber];
+    int old_block, new_block;
+    bool published;
+
+    do {
+        /* The current block is read like in a lookup, so that it is not
+         * freed (and reused) meanwhile */
+        int idx = dir_read_begin();
+        old_block = inode->i_data_block;
+        new_block = copy(old_block, arg);
+        if (new_block == -1) {
+            dir_read_end(idx);
+            return -1;
+        }
+
+        /* Publishes the copy, unless another one replaced the block that
+         * was copied */
+        inode_meta_begin(inode);
+        published = inode->i_data_block == old_block;
+        if (published) {
+            inode->i_data_block = new_block;
+        }
+        inode_meta_end(inode);
+
+        dir_read_end(idx);
+
+        if (!published) {
+            data_block_free(new_block);
+        }
+    } while (!published);
+
+    dir_retire_block(old_block);
+
+    return 0;
+}
+
+/*
+ * Adds an entry to the i-node directory data, keeping the entries sorted by
+ * name (see dir_update)
+ * Input:
+ *  - inumber: identifier of the i-node
+ *  - sub_inumber: identifier of the sub i-node entry
+ *  - sub_name: name of the sub i-node entry (up to MAX_FILE_NAME - 1 chars)
+ * Returns: SUCCESS or FAIL (also fails if the name already exists)
+ */
+int add_dir_entry(int inumber, int sub_inumber, char const *sub_name) {
+    if (!valid_inumber(inumber) || !valid_inumber(sub_inumber)) {
+        return -1;
+    }
+
+    size_t len = strlen(sub_name);
+    if (len == 0 || len > MAX_FILE_NAME - 1) {
+        return -1;
+    }
+
+    dir_new_entry_t entry = {sub_inumber, sub_name, len};
+    return dir_update(inumber, dir_block_add, &entry);
+}
+
+/*
+ * Removes the entries of a given i-node from the i-node directory data (see
+ * dir_update)
+ * Input:
+ *  - inumber: identifier of the i-node
+ *  - sub_inumber: identifier of the sub i-node (which need not be valid)
+ * Returns: SUCCESS or FAIL (also fails if there are no such entries)
+ */
+int clear_dir_entry(int inumber, int sub_inumber) {
+    if (!valid_inumber(inumber)) {
+        return -1;
+    }
+
+    return dir_update(inumber, dir_block_remove, &sub_inumber);
+}
+
+/* Looks for a given name inside a directory, without locks
+ * Input:
+ * 	- parent directory's i-node number
+ * 	- name to search
+ * 	Returns i-number linked to the target name, -1 if not found
+ */
+int find_in_dir(int inumber, char const *sub_name) {
+    if (!valid_inumber(inumber)) {
+        return -1;
+    }
+
+    if (inode_fetch(inumber) == -1 ||
+        inode_table[inumber].i_node_type != T_DIRECTORY) {
+        return -1;
+    }
+
+    int idx = dir_read_begin();
+
+    /* Searches the block containing the directory's entries in the cache
+     * (blocks are not changed while published, see add_dir_entry) */
+    dir_block_t *dir_block = data_block_pin(inode_table[inumber].i_data_block);
+    if (dir_block == NULL) {
+        dir_read_end(idx);
+        return -1;
+    }
+
+    /* Binary searches the sorted records for the target name */
+    size_t len = strlen(sub_name);
+    size_t pos = dir_find(dir_block, sub_name, len);
+    int sub_inumber = -1;
+    if (pos < dir_block->db_count) {
+        sub_inumber = dir_record(dir_block, pos)->dr_inumber;
+    }
+
+    data_block_unpin(dir_block);
+    dir_read_end(idx);
+
+    return sub_inumber;
+}
+
+/* Lists, in name order, the entries of a directory starting with a prefix,
+ * without locks
+ * Input:
+ * 	- directory's i-node number
+ * 	- prefix the names must start with ("" matches every name)
+ * 	- name after which the listing starts ("" to start at the beginning)
+ * 	- destination array of entries
+ * 	- maximum number of entries to copy
+ * 	Returns the number of entries copied, -1 if failed
+ */
+int list_dir_entries(int inumber, char const *prefix, char const *after,
+                     dir_entry_t *entries, size_t max_entries) {
+    if (!valid_inumber(inumber)) {
+        return -1;
+    }
+
+    if (inode_fetch(inumber) == -1 ||
+        inode_table[inumber].i_node_type != T_DIRECTORY) {
+        return -1;
+    }
+
+    int idx = dir_read_begin();
+
+    dir_block_t *dir_block = data_block_pin(inode_table[inumber].i_data_block);
+    if (dir_block == NULL) {
+        dir_read_end(idx);
+        return -1;
+    }
+
+    /* Every match is at or after the prefix's position, and the entries up to
+     * the cursor were already returned */
+    size_t prefix_len = strlen(prefix);
+    size_t pos = dir_lower_bound(dir_block, prefix, prefix_len);
+    if (strcmp(after, prefix) >= 0) {
+        size_t after_len = strlen(after);
+        pos = dir_lower_bound(dir_block, after, after_len);
+        if (pos < dir_block->db_count &&
+            dir_name_cmp(dir_record(dir_block, pos), after, after_len) == 0) {
+            pos++;
+        }
+    }
+
+    size_t copied = 0;
+    for (; copied < max_entries && pos < dir_block->db_count; pos++) {
+        dir_record_t *record = dir_record(dir_block, pos);
+        if (record->dr_name_len < prefix_len ||
+            memcmp(record->dr_name, prefix, prefix_len) != 0) {
+            break;
+        }
+
+        entries[copied].d_inumber = record->dr_inumber;
+        memcpy(entries[copied].d_name, record->dr_name, record->dr_name_len);
+        entries[copied].d_name[record->dr_name_len] = 0;
+        copied++;
+    }
+
+    data_block_unpin(dir_block);
+    dir_read_end(idx);
+
+    return (int)copied;
+}
+
+/*
+ * Allocated a new data block
+ * Returns: block index if successful, -1 otherwise
+ */
+int data_block_alloc() {
+    int i = alloc_map_take(&free_blocks_map);
+    if (i == -1) {
+        return -1;
+    }
+
+    /* Free blocks read as zeros (see metadata_checkpointed), which the cache
+     * holds at once rather than reading them on the first write (failing
+     * only costs that read) */
+    buffer_cache_zero(cache, DEVICE_BLOCK(i));
+
+    return i;
+}
+
+/* Frees a data block. It is only taken again once the journal checkpoints
+ * the transaction that frees it, and discarded (see metadata_checkpointed):
+ * until then, a crash may bring back the i-node or directory that used it,
+ * and the log may still write it in place.
+ * Input
+ * 	- the block index
+ * Returns: 0 if success, -1 otherwise
+ */
+int data_block_free(int block_number) {
+    if (!valid_block_number(block_number)) {
+        return -1;
+    }
+
+    if (alloc_map_fetch(&free_blocks_map, (size_t)block_number,
+                        (size_t)block_number + 1) == -1) {
+        return -1;
+    }
+    mutex_lock(LOCK_FREE_BLOCKS, &free_blocks_lock);
+    if (free_blocks[block_number] != TAKEN) {
+        mutex_unlock(LOCK_FREE_BLOCKS, &free_blocks_lock);
+        return -1;
+    }
+    free_blocks[block_number] = FREEING;
+    size_t count = atomic_load(&freed_count);
+    freed_blocks[count] = block_number;
+    atomic_store(&freed_count, count + 1);
+    mutex_unlock(LOCK_FREE_BLOCKS, &free_blocks_lock);
+    alloc_map_dirty(&free_blocks_map, (size_t)block_number);
+    return 0;
+}
+
+/* Reads a byte range of a given block, from the buffer cache
+ * Input:
+ * 	- Block's index
+ * 	- Offset of the range inside the block
+ * 	- Buffer to store the bytes read
+ * 	- Length of the range (it must not cross the end of the block)
+ * Returns: 0 if successful, -1 otherwise
+ */
+int data_block_read(int block_number, size_t offset, void *buffer,
+                    size_t len) {
+    if (!valid_block_number(block_number)) {
+        return -1;
+    }
+
+    return buffer_cache_read(cache, DEVICE_BLOCK(block_number), offset, buffer,
+                             len);
+}
+
+/* Writes a byte range of a given block to the buffer cache, which writes it
+ * to the block device at once or later, depending on its policy (see
+ * data_block_read and data_block_cache_policy_set)
+ * Returns: 0 if successful, -1 otherwise
+ */
+int data_block_write(int block_number, size_t offset, void const *buffer,
+                     size_t len) {
+    if (!valid_block_number(block_number)) {
+        return -1;
+    }
+
+    return buffer_cache_write(cache, DEVICE_BLOCK(block_number), offset, buffer,
+                              len);
+}
+
+/* Writes a given block back to the block device, if the buffer cache holds
+ * changes to it, and waits until the device stores them
+ * Input:
+ * 	- Block's index
+ * Returns: 0 if successful, -1 otherwise
+ */
+int data_block_sync(int block_number) {
+    if (!valid_block_number(block_number)) {
+        return -1;
+    }
+
+    return buffer_cache_sync(cache, DEVICE_BLOCK(block_number));
+}
+
+/* Writes every changed block back to the block device, and waits until the
+ * device stores them
+ * Returns: 0 if successful, -1 otherwise
+ */
+int data_block_sync_all() { return buffer_cache_flush(cache); }
+
+/* Chooses how the buffer cache of the next state_init stores writes
+ * Input:
+ * 	- "write-back" (the default: writes stay in the cache, and are written
+ * 	  to the device later), or "write-through"
+ * Returns: 0 if successful, -1 if the name is unknown
+ */
+int data_block_cache_policy_set(char const *name) {
+    if (strcmp(name, "write-back") == 0) {
+        cache_policy = CACHE_WRITE_BACK;
+    } else if (strcmp(name, "write-through") == 0) {
+        cache_policy = CACHE_WRITE_THROUGH;
+    } else {
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Pins a given block in the buffer cache, to access it in place
+ * Input:
+ * 	- Block's index
+ * Returns: pointer to the contents of the block (BLOCK_SIZE bytes), valid
+ * until data_block_unpin, NULL if failed
+ */
+void *data_block_pin(int block_number) {
+    if (!valid_block_number(block_number)) {
+        return NULL;
+    }
+
+    return buffer_cache_pin(cache, DEVICE_BLOCK(block_number));
+}
+
+/* Unpins a block pinned by data_block_pin
+ * Input:
+ * 	- Pointer returned by data_block_pin
+ */
+void data_block_unpin(void *data) { buffer_cache_unpin(cache, data); }
+
+/* Collects the hit, miss and eviction counters of the buffer cache
+ * Input:
+ * 	- Where to store them
+ */
+void data_block_cache_stats(buffer_cache_stats_t *stats) {
+    buffer_cache_stats(cache, stats);
+}
+
+/* Collects the numbers of reads and writes of the device, for the data and
+ * the metadata, from the cache and the journal
+ * Input:
+ * 	- Where to store them
+ */
+void state_device_stats(block_device_stats_t *stats) {
+    block_device_stats(device, stats);
+}
+
+/*
+ * Consistency check of the metadata (see metadata_check). Worker threads
+ * check shares of the i-node table, and then of the data blocks, recording
+ * what they find per i-node and per block; the owners of the blocks are
+ * gathered in a bitmap they all set atomically.
+ */
+#define FSCK_WORDS ((DATA_BLOCKS + 63) / 64)
+
+enum {
+    FSCK_BAD = 1,      /* i-node whose record is not valid */
+    FSCK_ORPHAN = 2,   /* i-node no directory entry names */
+    FSCK_SHARED = 4,   /* i-node whose block is not its own */
+    FSCK_LEAKED = 8,   /* block taken, but with no owner */
+    FSCK_UNMARKED = 16 /* block with an owner, but free */
+};
+
+/* Directory entries that name the same i-node, which is not in use */
+typedef struct {
+    int dd_inumber;
+    size_t dd_entries;
+} fsck_dangling_t;
+
+typedef struct {
+    size_t fk_threads;
+    bool fk_repair;
+    fsck_report_t *fk_report;
+    _Atomic uint64_t fk_owned[FSCK_WORDS]; /* blocks with an owner */
+    int fk_entries[INODE_TABLE_SIZE];      /* directory entries naming it */
+    char fk_inodes[INODE_TABLE_SIZE];      /* problems of each i-node */
+    char fk_blocks[DATA_BLOCKS];           /* problems of each block */
+    fsck_dangling_t fk_dangling[MAX_DIR_ENTRIES];
+    size_t fk_dangling_count;
+} fsck_t;
+
+typedef struct {
+    fsck_t *sh_fsck;
+    void (*sh_check)(fsck_t *fsck, size_t first, size_t end);
+    size_t sh_first;
+    size_t sh_end;
+} fsck_shard_t;
+
+/*
+ * Claims a block for an owner
+ * Returns: true if it had none yet, false otherwise
+ */
+static bool fsck_claim(fsck_t *fsck, int block_number) {
+    uint64_t bit = UINT64_C(1) << (block_number % 64);
+    return !(atomic_fetch_or(&fsck->fk_owned[block_number / 64], bit) & bit);
+}
+
+static bool fsck_owned(fsck_t *fsck, int block_number) {
+    uint64_t bit = UINT64_C(1) << (block_number % 64);
+    return atomic_load(&fsck->fk_owned[block_number / 64]) & bit;
+}
+
+/*
+ * Counts the entries of the root directory that name each i-node, and finds
+ * those that name no i-node in use
+ * Returns: 0 if successful, -1 if the root directory cannot be read
+ */
+static int fsck_read_dir(fsck_t *fsck) {
+    if (freeinode_ts[ROOT_DIR_INUM] != TAKEN ||
+        inode_fetch(ROOT_DIR_INUM) == -1 ||
+        inode_table[ROOT_DIR_INUM].i_node_type != T_DIRECTORY) {
+        return -1;
+    }
+    dir_block_t *dir_block =
+        data_block_pin(inode_table[ROOT_DIR_INUM].i_data_block);
+    if (dir_block == NULL) {
+        return -1;
+    }
+
+    for (size_t i = 0; i < dir_block->db_count; i++) {
+        int inumber = dir_record(dir_block, i)->dr_inumber;
+        if (valid_inumber(inumber) && inumber != ROOT_DIR_INUM &&
+            freeinode_ts[inumber] == TAKEN) {
+            fsck->fk_entries[inumber]++;
+            continue;
+        }
+
+        size_t d = 0;
+        while (d < fsck->fk_dangling_count &&
+               fsck->fk_dangling[d].dd_inumber != inumber) {
+            d++;
+        }
+        if (d == fsck->fk_dangling_count) {
+            fsck->fk_dangling[d] = (fsck_dangling_t){inumber, 0};
+            fsck->fk_dangling_count++;
+        }
+        fsck->fk_dangling[d].dd_entries++;
+    }
+    data_block_unpin(dir_block);
+
+    return 0;
+}
+
+/*
+ * Checks a share of the i-node table: each taken i-node must be valid and
+ * named by the directory, and be the only owner of its block
+ */
+static void fsck_check_inodes(fsck_t *fsck, size_t first, size_t end) {
+    for (size_t i = first; i < end; i++) {
+        int inumber = (int)i;
+        if (inode_fetch(inumber) == -1) {
+            fsck->fk_inodes[i] |= FSCK_BAD;
+        }
+        if (freeinode_ts[i] != TAKEN) {
+            continue;
+        }
+        if (inumber != ROOT_DIR_INUM && fsck->fk_entries[i] == 0) {
+            fsck->fk_inodes[i] |= FSCK_ORPHAN;
+        }
+        if (fsck->fk_inodes[i] & FSCK_BAD) {
+            continue;
+        }
+
+        inode_t *inode = &inode_table[i];
+        int block = inode->i_data_block;
+        if (block == -1) {
+            if (inode->i_size > 0) {
+                fsck->fk_inodes[i] |= FSCK_BAD;
+            }
+        } else if (!fsck_claim(fsck, block) || free_blocks[block] == FREEING) {
+            fsck->fk_inodes[i] |= FSCK_SHARED;
+        }
+    }
+}
+
+/*
+ * Checks a share of the data blocks: the taken ones must have an owner, and
+ * those with an owner must be taken
+ */
+static void fsck_check_blocks(fsck_t *fsck, size_t first, size_t end) {
+    for (size_t b = first; b < end; b++) {
+        bool owned = fsck_owned(fsck, (int)b);
+        if (owned && free_blocks[b] == FREE) {
+            fsck->fk_blocks[b] |= FSCK_UNMARKED;
+        } else if (!owned && free_blocks[b] == TAKEN) {
+            fsck->fk_blocks[b] |= FSCK_LEAKED;
+        }
+    }
+}
+
+static void *fsck_worker(void *arg) {
+    fsck_shard_t *shard = arg;
+    shard->sh_check(shard->sh_fsck, shard->sh_first, shard->sh_end);
+    return NULL;
+}
+
+/*
+ * Splits a range of entries among the worker threads (the calling thread
+ * checks the first share, and those of threads that could not be created),
+ * and waits for all of them
+ */
+static void fsck_run(fsck_t *fsck, size_t entries,
+                     void (*check)(fsck_t *, size_t, size_t)) {
+    size_t threads = fsck->fk_threads < entries ? fsck->fk_threads : entries;
+    fsck_shard_t shards[threads];
+    pthread_t tids[threads];
+    size_t started = 1;
+
+    for (size_t t = 0; t < threads; t++) {
+        shards[t] = (fsck_shard_t){fsck, check, entries * t / threads,
+                                   entries * (t + 1) / threads};
+    }
+    for (; started < threads; started++) {
+        if (pthread_create(&tids[started], NULL, fsck_worker,
+                           &shards[started]) != 0) {
+            break;
+        }
+    }
+    check(fsck, shards[0].sh_first, shards[0].sh_end);
+    for (size_t t = 1; t < started; t++) {
+        pthread_join(tids[t], NULL);
+    }
+    for (size_t t = started; t < threads; t++) {
+        check(fsck, shards[t].sh_first, shards[t].sh_end);
+    }
+}
+
+/*
+ * Gives an i-node a copy of its block, with the i-node locked like for a
+ * truncation
+ * Returns: 0 if successful, -1 otherwise
+ */
+static int fsck_copy_block(int inumber) {
+    inode_t *inode = &inode_table[inumber];
+    int ret = -1;
+
+    if (inode_write_lock(inumber) != 0) {
+        return -1;
+    }
+    int new_block = data_block_alloc();
+    void *data = NULL;
+    if (new_block != -1 &&
+        (data = data_block_pin(inode->i_data_block)) != NULL) {
+        ret = data_block_write(new_block, 0, data, BLOCK_SIZE);
+        data_block_unpin(data);
+    }
+    if (ret == 0) {
+        inode_meta_begin(inode);
+        inode->i_data_block = new_block;
+        inode_meta_end(inode);
+    } else if (new_block != -1) {
+        data_block_free(new_block);
+    }
+    inode_unlock(inumber);
+
+    return ret;
+}
+
+/*
+ * Repairs what the check found: bad i-nodes become empty files, blocks with
+ * owners are marked taken, owners that share a block get a copy of it,
+ * entries that name no i-node are removed, as are the i-nodes no entry
+ * names, and blocks with no owner are freed
+ * Returns: the number of problems repaired
+ */
+static size_t fsck_repair(fsck_t *fsck) {
+    size_t repaired = 0;
+
+    for (int i = 0; i < INODE_TABLE_SIZE; i++) {
+        inode_t *inode = &inode_table[i];
+        if (!(fsck->fk_inodes[i] & FSCK_BAD)) {
+            continue;
+        }
+
+        /* It is locked like for a truncation (if it could be read at all) */
+        if (inode_write_lock(i) != 0) {
+            continue;
+        }
+        mutex_lock(LOCK_INODE, &inode_fetch_locks[i]);
+        inode_meta_begin(inode);
+        inode->i_node_type = T_FILE;
+        inode->i_size = 0;
+        inode->i_data_block = -1;
+        inode_meta_end(inode);
+        inode->i_append_end = 0;
+        atomic_store_explicit(&inode_cached[i], true, memory_order_release);
+        mutex_unlock(LOCK_INODE, &inode_fetch_locks[i]);
+        inode_unlock(i);
+        repaired++;
+    }
+
+    for (int b = 0; b < DATA_BLOCKS; b++) {
+        if (fsck->fk_blocks[b] & FSCK_UNMARKED) {
+            mutex_lock(LOCK_FREE_BLOCKS, &free_blocks_lock);
+            free_blocks[b] = TAKEN;
+            mutex_unlock(LOCK_FREE_BLOCKS, &free_blocks_lock);
+            alloc_map_dirty(&free_blocks_map, (size_t)b);
+            repaired++;
+        }
+    }
+
+    for (int i = 0; i < INODE_TABLE_SIZE; i++) {
+        /* Orphans give their shared blocks up instead, as they are deleted */
+        if ((fsck->fk_inodes[i] & (FSCK_SHARED | FSCK_ORPHAN)) ==
+                FSCK_SHARED &&
+            fsck_copy_block(i) == 0) {
+            repaired++;
+        }
+    }
+
+    for (size_t d = 0; d < fsck->fk_dangling_count; d++) {
+        if (clear_dir_entry(ROOT_DIR_INUM, fsck->fk_dangling[d].dd_inumber) ==
+            0) {
+            repaired += fsck->fk_dangling[d].dd_entries;
+        }
+    }
+
+    for (int i = 0; i < INODE_TABLE_SIZE; i++) {
+        if (!(fsck->fk_inodes[i] & FSCK_ORPHAN)) {
+            continue;
+        }
+        if (fsck->fk_inodes[i] & FSCK_SHARED) {
+            inode_meta_begin(&inode_table[i]);
+            inode_table[i].i_data_block = -1;
+            inode_meta_end(&inode_table[i]);
+        }
+        if (inode_delete(i) == 0) {
+            repaired += (fsck->fk_inodes[i] & FSCK_SHARED) ? 2 : 1;
+        }
+    }
+
+    for (int b = 0; b < DATA_BLOCKS; b++) {
+        if ((fsck->fk_blocks[b] & FSCK_LEAKED) && data_block_free(b) == 0) {
+            repaired++;
+        }
+    }
+
+    return repaired;
+}
+
+/*
+ * Runs the check (the exclusive operation of the journal, see
+ * metadata_check)
+ * Returns: 0 if successful, -1 otherwise
+ */
+static int fsck_exclusive(void *arg) {
+    fsck_t *fsck = arg;
+    fsck_report_t *report = fsck->fk_report;
+
+    if (alloc_map_fetch(&freeinode_ts_map, 0, INODE_TABLE_SIZE) == -1 ||
+        alloc_map_fetch(&free_blocks_map, 0, DATA_BLOCKS) == -1 ||
+        fsck_read_dir(fsck) == -1) {
+        return -1;
+    }
+
+    /* Blocks retired by directories are owned until a grace period ends */
+    mutex_lock(LOCK_DIR, &dir_retired_lock);
+    for (size_t i = 0; i < dir_retired_count; i++) {
+        fsck_claim(fsck, dir_retired_blocks[i]);
+    }
+    mutex_unlock(LOCK_DIR, &dir_retired_lock);
+
+    /* The blocks are checked once every owner claimed its own */
+    fsck_run(fsck, INODE_TABLE_SIZE, fsck_check_inodes);
+    fsck_run(fsck, DATA_BLOCKS, fsck_check_blocks);
+
+    memset(report, 0, sizeof(*report));
+    for (size_t i = 0; i < INODE_TABLE_SIZE; i++) {
+        report->fr_inodes += freeinode_ts[i] == TAKEN;
+        report->fr_bad_inodes += (fsck->fk_inodes[i] & FSCK_BAD) != 0;
+        report->fr_orphan_inodes += (fsck->fk_inodes[i] & FSCK_ORPHAN) != 0;
+        report->fr_shared_blocks += (fsck->fk_inodes[i] & FSCK_SHARED) != 0;
+    }
+    for (size_t d = 0; d < fsck->fk_dangling_count; d++) {
+        report->fr_dangling_entries += fsck->fk_dangling[d].dd_entries;
+    }
+    for (size_t b = 0; b < DATA_BLOCKS; b++) {
+        report->fr_leaked_blocks += (fsck->fk_blocks[b] & FSCK_LEAKED) != 0;
+        report->fr_unmarked_blocks +=
+            (fsck->fk_blocks[b] & FSCK_UNMARKED) != 0;
+    }
+
+    if (fsck->fk_repair) {
+        report->fr_repaired = fsck_repair(fsck);
+    }
+
+    return 0;
+}
+
+/*
+ * Checks that the metadata is consistent: that the allocation tables, the
+ * i-nodes and the entries of the root directory agree (see fsck_report_t),
+ * and repairs what does not, if asked. It runs while no update is under way,
+ * and its repairs are committed together, in the same transaction.
+ * Input:
+ *  - threads: number of threads that check the tables
+ *  - repair: whether to repair the problems found
+ *  - report: where what was found (and repaired) is stored
+ * Returns: 0 if successful, -1 otherwise
+ */
+int metadata_check(size_t threads, bool repair, fsck_report_t *report) {
+    if (threads == 0 || report == NULL) {
+        return -1;
+    }
+
+    fsck_t *fsck = calloc(1, sizeof(fsck_t));
+    if (fsck == NULL) {
+        return -1;
+    }
+    fsck->fk_threads = threads;
+    fsck->fk_repair = repair;
+    fsck->fk_report = report;
+    for (size_t i = 0; i < FSCK_WORDS; i++) {
+        atomic_init(&fsck->fk_owned[i], 0);
+    }
+
+    int ret = journal_commit_exclusive(journal, fsck_exclusive, fsck);
+    free(fsck);
+
+    return ret;
+}
+
+/*
+ * Takes an entry from the free list of the open file table
+ * Returns: index of the entry, -1 if the free list is empty
+ */
+static int pop_free_open_file_entry() {
+    uint_fast64_t head = atomic_load(&free_open_file_entries);
+    uint_fast64_t next;
+
+    do {
+        uint32_t top = (uint32_t)head;
+        if (top == 0) {
+            return -1;
+        }
+
+        /* Even if another thread takes the top entry in the meantime (making
+         * of_next_free stale), the tag makes the exchange below fail */
+        open_file_entry_t *entry = open_file_entry((int)top - 1);
+        if (entry == NULL) {
+            return -1;
+        }
+        next = (((head >> 32) + 1) << 32) |
+               atomic_load_explicit(&entry->of_next_free, memory_order_relaxed);
+    } while (!atomic_compare_exchange_weak(&free_open_file_entries, &head,
+                                           next));
+
+    return (int)(uint32_t)head - 1;
+}
+
+/*
+ * Gives an entry of the open file table back to the free list
+ * Inputs:
+ * 	- index of the entry
+ */
+static void push_free_open_file_entry(int index) {
+    open_file_entry_t *entry = open_file_entry(index);
+    if (entry == NULL) {
+        return;
+    }
+
+    uint_fast64_t head = atomic_load(&free_open_file_entries);
+    uint_fast64_t next;
+
+    do {
+        atomic_store_explicit(&entry->of_next_free, (uint32_t)head,
+                              memory_order_relaxed);
+        next = (((head >> 32) + 1) << 32) | (uint32_t)(index + 1);
+    } while (!atomic_compare_exchange_weak(&free_open_file_entries, &head,
+                                           next));
+}
+
+/*
+ * Grows the open file table with the chunk that holds an entry, if it does
+ * not exist yet
+ * Returns: 0 if successful, -1 if the chunk could not be allocated
+ */
+static int open_file_chunk_grow(int index) {
+    _Atomic(open_file_entry_t *) *slot =
+        &open_file_table[index / OPEN_FILES_CHUNK];
+    if (atomic_load_explicit(slot, memory_order_acquire) != NULL) {
+        return 0;
+    }
+
+    open_file_entry_t *chunk =
+        malloc(sizeof(open_file_entry_t) * OPEN_FILES_CHUNK);
+    if (chunk == NULL) {
+        return -1;
+    }
+
+    for (size_t i = 0; i < OPEN_FILES_CHUNK; i++) {
+        atomic_init(&chunk[i].of_handle, -1);
+        chunk[i].of_generation = 0;
+        atomic_init(&chunk[i].of_next_free, 0);
+        pthread_mutex_init(&chunk[i].of_lock, NULL);
+    }
+
+    /* Another thread may have grown the table first */
+    open_file_entry_t *expected = NULL;
+    if (!atomic_compare_exchange_strong(slot, &expected, chunk)) {
+        for (size_t i = 0; i < OPEN_FILES_CHUNK; i++) {
+            pthread_mutex_destroy(&chunk[i].of_lock);
+        }
+        free(chunk);
+    }
+
+    return 0;
+}
+
+/*
+ * Takes a never used entry. Its chunk is allocated before the entry is
+ * taken, so that a failed allocation does not lose the entry.
+ * Returns: index of the entry, -1 if the table is full (or the chunk could
+ * not be allocated)
+ */
+static int new_open_file_entry() {
+    int index = atomic_load(&open_file_entries_used);
+
+    do {
+        if (index == MAX_OPEN_FILES || open_file_chunk_grow(index) == -1) {
+            return -1;
+        }
+    } while (!atomic_compare_exchange_weak(&open_file_entries_used, &index,
+                                           index + 1));
+
+    return index;
+}
+
+/* Add new entry to the open file table
+ * Inputs:
+ * 	- I-node number of the file to open
+ * 	- Initial offset
+ * 	- Flags the file was opened with
+ * Returns: file handle if successful, -1 otherwise
+ */
+int add_to_open_file_table(int inumber, size_t offset, int flags) {
+    int index = pop_free_open_file_entry();
+    if (index == -1) {
+        index = new_open_file_entry();
+        if (index == -1) {
+            return -1;
+        }
+    }
+
+    open_file_entry_t *entry = open_file_entry(index);
+    if (entry == NULL) {
+        return -1;
+    }
+
+    entry->of_inumber = inumber;
+    entry->of_offset = offset;
+    entry->of_flags = flags;
+
+    int fhandle = (int)(entry->of_generation << FHANDLE_INDEX_BITS) | index;
+    atomic_fetch_add(&open_file_entries_taken, 1);
+    /* Publishes the entry only after it is filled */
+    atomic_store_explicit(&entry->of_handle, fhandle, memory_order_release);
+
+    return fhandle;
+}
+
+/* Frees an entry from the open file table
+ * Inputs:
+ * 	- file handle to free/close
+ * Returns 0 is success, -1 otherwise (also for handles that were already
+ * closed, even if their entry was reused in the meantime)
+ */
+int remove_from_open_file_table(int fhandle) {
+    open_file_entry_t *entry = get_open_file_entry(fhandle);
+    if (entry == NULL) {
+        return -1;
+    }
+
+    /* Only one of several concurrent closes of the same handle succeeds */
+    int expected = fhandle;
+    if (!atomic_compare_exchange_strong(&entry->of_handle, &expected, -1)) {
+        return -1;
+    }
+
+    /* Handles issued from now on for this entry are distinct from the old
+     * ones, until the generation wraps around */
+    entry->of_generation = (entry->of_generation + 1) & FHANDLE_GENERATION_MASK;
+    atomic_fetch_sub(&open_file_entries_taken, 1);
+    push_free_open_file_entry(fhandle & FHANDLE_INDEX_MASK);
+
+    return 0;
+}
+
+/* Returns pointer to a given entry in the open file table
+ * Inputs:
+ * 	 - file handle
+ * Returns: pointer to the entry if sucessful, NULL otherwise (also for stale
+ * handles)
+ */
+open_file_entry_t *get_open_file_entry(int fhandle) {
+    if (fhandle < 0) {
+        return NULL;
+    }
+
+    int index = fhandle & FHANDLE_INDEX_MASK;
+    if (index >= atomic_load(&open_file_entries_used)) {
+        return NULL;
+    }
+
+    open_file_entry_t *entry = open_file_entry(index);
+    if (entry == NULL || atomic_load_explicit(&entry->of_handle,
+                                              memory_order_acquire) != fhandle) {
+        return NULL;
+    }
+
+    return entry;
+}
+
+/* Checks if there are any open files.
+    If there are, returns false. Otherwise, returns true.
+ */
+bool all_files_closed() { return atomic_load(&open_file_entries_taken) == 0; }
+
+static char const *lock_class_names[LOCK_CLASSES] = {
+    [LOCK_INODE] = "inode",           [LOCK_RANGE] = "range",
+    [LOCK_FREE_BLOCKS] = "free-blocks", [LOCK_FREE_INODES] = "free-inodes",
+    [LOCK_OPEN_FILE] = "open-file",   [LOCK_CREATE] = "create",
+    [LOCK_DIR] = "dir",               [LOCK_CACHE] = "cache",
+    [LOCK_JOURNAL] = "journal",       [LOCK_GLOBAL] = "global",
+};
+
+char const *lock_class_name(lock_class_t lock_class) {
+    if (lock_class < 0 || lock_class >= LOCK_CLASSES) {
+        return NULL;
+    }
+    return lock_class_names[lock_class];
+}
+
+#ifdef TFS_LOCK_STATS
+
+/*
+ * Statistics of a thread. Each thread only updates its own (so the counters
+ * stay in its cache), and lock_stats_collect merges them when asked to.
+ */
+typedef struct thread_lock_stats {
+    struct {
+        _Atomic uint64_t acquires;
+        _Atomic uint64_t contended;
+        _Atomic uint64_t wait_ns;
+        _Atomic uint64_t hold_ns;
+    } tl_classes[LOCK_CLASSES];
+    /* when the thread took the first of the locks of a class it holds */
+    uint64_t tl_held_since[LOCK_CLASSES];
+    unsigned tl_held[LOCK_CLASSES];
+    struct thread_lock_stats *tl_next;
+} thread_lock_stats_t;
+
+/* The statistics of the threads still running, and of those that ended */
+static pthread_mutex_t lock_stats_threads_lock = PTHREAD_MUTEX_INITIALIZER;
+static thread_lock_stats_t *lock_stats_threads;
+static lock_stats_t lock_stats_ended[LOCK_CLASSES];
+static pthread_key_t lock_stats_key;
+static pthread_once_t lock_stats_key_once = PTHREAD_ONCE_INIT;
+static _Thread_local thread_lock_stats_t *thread_lock_stats;
+
+static uint64_t lock_stats_now() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+}
+
+static inline void lock_stats_add(_Atomic uint64_t *counter, uint64_t value) {
+    atomic_fetch_add_explicit(counter, value, memory_order_relaxed);
+}
+
+/*
+ * Folds the statistics of an ending thread into the totals of the threads
+ * that ended
+ */
+static void lock_stats_thread_end(void *arg) {
+    thread_lock_stats_t *stats = arg;
+
+    pthread_mutex_lock(&lock_stats_threads_lock);
+    for (thread_lock_stats_t **p = &lock_stats_threads; *p != NULL;
+         p = &(*p)->tl_next) {
+        if (*p == stats) {
+            *p = stats->tl_next;
+            break;
+        }
+    }
+    for (size_t i = 0; i < LOCK_CLASSES; i++) {
+        lock_stats_ended[i].ls_acquires += stats->tl_classes[i].acquires;
+        lock_stats_ended[i].ls_contended += stats->tl_classes[i].contended;
+        lock_stats_ended[i].ls_wait_ns += stats->tl_classes[i].wait_ns;
+        lock_stats_ended[i].ls_hold_ns += stats->tl_classes[i].hold_ns;
+    }
+    pthread_mutex_unlock(&lock_stats_threads_lock);
+
+    free(stats);
+}
+
+static void lock_stats_key_create() {
+    pthread_key_create(&lock_stats_key, lock_stats_thread_end);
+}
+
+/*
+ * Returns the statistics of the calling thread, registering them on its
+ * first use of a lock
+ */
+static thread_lock_stats_t *lock_stats_thread() {
+    if (thread_lock_stats != NULL) {
+        return thread_lock_stats;
+    }
+
+    thread_lock_stats_t *stats = calloc(1, sizeof(thread_lock_stats_t));
+    if (stats == NULL) {
+        perror("calloc");
+        abort();
+    }
+
+    pthread_once(&lock_stats_key_once, lock_stats_key_create);
+    pthread_setspecific(lock_stats_key, stats);
+
+    pthread_mutex_lock(&lock_stats_threads_lock);
+    stats->tl_next = lock_stats_threads;
+    lock_stats_threads = stats;
+    pthread_mutex_unlock(&lock_stats_threads_lock);
+
+    thread_lock_stats = stats;
+    return stats;
+}
+
+static void lock_stats_acquired(lock_class_t lock_class, uint64_t wait_start) {
+    thread_lock_stats_t *stats = lock_stats_thread();
+    uint64_t now = lock_stats_now();
+
+    lock_stats_add(&stats->tl_classes[lock_class].acquires, 1);
+    if (wait_start != 0) {
+        lock_stats_add(&stats->tl_classes[lock_class].contended, 1);
+        lock_stats_add(&stats->tl_classes[lock_class].wait_ns,
+                       now - wait_start);
+    }
+    if (stats->tl_held[lock_class]++ == 0) {
+        stats->tl_held_since[lock_class] = now;
+    }
+}
+
+static void lock_stats_released(lock_class_t lock_class) {
+    thread_lock_stats_t *stats = lock_stats_thread();
+
+    if (stats->tl_held[lock_class] > 0 && --stats->tl_held[lock_class] == 0) {
+        lock_stats_add(&stats->tl_classes[lock_class].hold_ns,
+                       lock_stats_now() - stats->tl_held_since[lock_class]);
+    }
+}
+
+/*
+ * The lock is tried first, so that only acquisitions that wait read the
+ * clock to time the wait
+ */
+int stats_mutex_lock(lock_class_t lock_class, pthread_mutex_t *mutex) {
+    uint64_t wait_start = 0;
+
+    if (pthread_mutex_trylock(mutex) != 0) {
+        wait_start = lock_stats_now();
+        int ret = pthread_mutex_lock(mutex);
+        if (ret != 0) {
+            return ret;
+        }
+    }
+
+    lock_stats_acquired(lock_class, wait_start);
+    return 0;
+}
+
+int stats_mutex_trylock(lock_class_t lock_class, pthread_mutex_t *mutex) {
+    int ret = pthread_mutex_trylock(mutex);
+
+    if (ret == 0) {
+        lock_stats_acquired(lock_class, 0);
+    } else {
+        lock_stats_add(&lock_stats_thread()->tl_classes[lock_class].contended,
+                       1);
+    }
+    return ret;
+}
+
+int stats_mutex_unlock(lock_class_t lock_class, pthread_mutex_t *mutex) {
+    lock_stats_released(lock_class);
+    return pthread_mutex_unlock(mutex);
+}
+
+int stats_read_lock(lock_class_t lock_class, pthread_rwlock_t *rwlock) {
+    uint64_t wait_start = 0;
+
+    if (pthread_rwlock_tryrdlock(rwlock) != 0) {
+        wait_start = lock_stats_now();
+        int ret = pthread_rwlock_rdlock(rwlock);
+        if (ret != 0) {
+            return ret;
+        }
+    }
+
+    lock_stats_acquired(lock_class, wait_start);
+    return 0;
+}
+
+int stats_write_lock(lock_class_t lock_class, pthread_rwlock_t *rwlock) {
+    uint64_t wait_start = 0;
+
+    if (pthread_rwlock_trywrlock(rwlock) != 0) {
+        wait_start = lock_stats_now();
+        int ret = pthread_rwlock_wrlock(rwlock);
+        if (ret != 0) {
+            return ret;
+        }
+    }
+
+    lock_stats_acquired(lock_class, wait_start);
+    return 0;
+}
+
+int stats_rwlock_unlock(lock_class_t lock_class, pthread_rwlock_t *rwlock) {
+    lock_stats_released(lock_class);
+    return pthread_rwlock_unlock(rwlock);
+}
+
+/*
+ * Waiting on a condition counts as releasing the mutex and acquiring it
+ * again, after waiting
+ */
+int stats_cond_wait(lock_class_t lock_class, pthread_cond_t *cond,
+                    pthread_mutex_t *mutex) {
+    lock_stats_released(lock_class);
+    uint64_t wait_start = lock_stats_now();
+    int ret = pthread_cond_wait(cond, mutex);
+    lock_stats_acquired(lock_class, wait_start);
+    return ret;
+}
+
+int stats_cond_timedwait(lock_class_t lock_class, pthread_cond_t *cond,
+                         pthread_mutex_t *mutex, struct timespec const *until) {
+    lock_stats_released(lock_class);
+    uint64_t wait_start = lock_stats_now();
+    int ret = pthread_cond_timedwait(cond, mutex, until);
+    lock_stats_acquired(lock_class, wait_start);
+    return ret;
+}
+
+/*
+ * Merges the statistics of all the threads (while they keep running)
+ * Input:
+ *  - stats: where to store the statistics of each lock class
+ */
+void lock_stats_collect(lock_stats_t stats[LOCK_CLASSES]) {
+    pthread_mutex_lock(&lock_stats_threads_lock);
+
+    memcpy(stats, lock_stats_ended, sizeof(lock_stats_ended));
+    for (thread_lock_stats_t *t = lock_stats_threads; t != NULL;
+         t = t->tl_next) {
+        for (size_t i = 0; i < LOCK_CLASSES; i++) {
+            stats[i].ls_acquires += t->tl_classes[i].acquires;
+            stats[i].ls_contended += t->tl_classes[i].contended;
+            stats[i].ls_wait_ns += t->tl_classes[i].wait_ns;
+            stats[i].ls_hold_ns += t->tl_classes[i].hold_ns;
+        }
+    }
+
+    pthread_mutex_unlock(&lock_stats_threads_lock);
+}
+
+/*
+ * Zeroes the statistics (counts from locks taken while it runs may be lost)
+ */
+void lock_stats_reset() {
+    pthread_mutex_lock(&lock_stats_threads_lock);
+
+    memset(lock_stats_ended, 0, sizeof(lock_stats_ended));
+    for (thread_lock_stats_t *t = lock_stats_threads; t != NULL;
+         t = t->tl_next) {
+        for (size_t i = 0; i < LOCK_CLASSES; i++) {
+            atomic_store(&t->tl_classes[i].acquires, 0);
+            atomic_store(&t->tl_classes[i].contended, 0);
+            atomic_store(&t->tl_classes[i].wait_ns, 0);
+            atomic_store(&t->tl_classes[i].hold_ns, 0);
+        }
+    }
+
+    pthread_mutex_unlock(&lock_stats_threads_lock);
+}
+
+#else
+
+void lock_stats_collect(lock_stats_t stats[LOCK_CLASSES]) {
+    memset(stats, 0, sizeof(lock_stats_t) * LOCK_CLASSES);
+}
+
+void lock_stats_reset() {}
+
+#endif // TFS_LOCK_STATS
+
+/*
+ * Prints the statistics of every lock class, the most contended first
+ * Input:
+ *  - stream: where to print them
+ */
+void lock_stats_print(FILE *stream) {
+    lock_stats_t stats[LOCK_CLASSES];
+    lock_class_t order[LOCK_CLASSES];
+
+    lock_stats_collect(stats);
+
+    /* Sorts the classes by the time spent waiting for them */
+    for (size_t i = 0; i < LOCK_CLASSES; i++) {
+        size_t j = i;
+        for (; j > 0 && stats[order[j - 1]].ls_wait_ns < stats[i].ls_wait_ns;
+             j--) {
+            order[j] = order[j - 1];
+        }
+        order[j] = (lock_class_t)i;
+    }
+
+    fprintf(stream, "%-12s %12s %12s %9s %12s %12s\n", "class", "acquires",
+            "contended", "ratio", "wait (us)", "hold (us)");
+    for (size_t i = 0; i < LOCK_CLASSES; i++) {
+        lock_stats_t *s = &stats[order[i]];
+        double ratio =
+            s->ls_acquires == 0
+                ? 0.0
+                : (double)s->ls_contended / (double)s->ls_acquires;
+        fprintf(stream, "%-12s %12llu %12llu %9.4f %12llu %12llu\n",
+                lock_class_names[order[i]], (unsigned long long)s->ls_acquires,
+                (unsigned long long)s->ls_contended, ratio,
+                (unsigned long long)(s->ls_wait_ns / 1000),
+                (unsigned long long)(s->ls_hold_ns / 1000));
+    }
+}
@@ -1,34 +1,109 @@
 #ifndef STATE_H
 #define STATE_H
 
+#include "buffer_cache.h"
 #include "config.h"
+#include "journal.h"
 
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/types.h>
 #include <stdbool.h>
 
 /*
- * Directory entry
+ * Directory entry (as returned when listing a directory)
  */
 typedef struct {
     char d_name[MAX_FILE_NAME];
     int d_inumber;
 } dir_entry_t;
 
+/*
+ * Directory block: a header followed by the offsets of the directory's
+ * records, sorted by name. The variable-length records are packed from the
+ * end of the block towards the offsets.
+ */
+typedef struct {
+    uint16_t db_count;   /* number of records */
+    uint16_t db_records; /* offset of the lowest record in the block */
+    uint16_t db_slots[]; /* offsets of the records, sorted by name */
+} dir_block_t;
+
+/*
+ * Directory record (stored inside a directory block, not NUL-terminated)
+ */
+typedef struct {
+    int dr_inumber;
+    uint32_t dr_hash;
+    uint8_t dr_name_len;
+    char dr_name[];
+} dir_record_t;
+
+/* Records are padded so that every record in the block stays aligned */
+#define DIR_RECORD_SIZE(name_len)                                              \
+    ((offsetof(dir_record_t, dr_name) + (name_len) + sizeof(int) - 1) /        \
+     sizeof(int) * sizeof(int))
+
 typedef enum { T_FILE, T_DIRECTORY } inode_type;
 
 /*
  * I-node
  */
 typedef struct {
-    inode_type i_node_type;
-    size_t i_size;
-    int i_data_block;
+    /* type, size and data block are changed between inode_meta_begin and
+     * inode_meta_end, which make the sequence number odd meanwhile */
+    atomic_uint i_seq;
+    _Atomic inode_type i_node_type;
+    _Atomic size_t i_size;
+    _Atomic int i_data_block; /* -1 while the file is empty */
+    /* appends reserve their bytes past i_size and publish them in order */
+    _Atomic size_t i_append_end; /* end of the bytes reserved so far */
     /* in a real FS, more fields would exist here */
 } inode_t;
 
-typedef enum { FREE = 0, TAKEN = 1 } allocation_state_t;
+/*
+ * Metadata of an i-node, as read by inode_stat
+ */
+typedef struct {
+    int st_inumber;
+    inode_type st_type;
+    size_t st_size;
+    unsigned st_version; /* changes whenever the rest of the metadata does */
+} tfs_stat_t;
+
+/*
+ * Byte range [r_start, r_end) of an i-node's data held by a thread (see
+ * inode_range_lock)
+ */
+typedef struct inode_range {
+    size_t r_start;
+    size_t r_end;
+    bool r_exclusive;
+    struct inode_range *r_next;
+} inode_range_t;
+
+/*
+ * What a consistency check of the metadata found (see metadata_check)
+ */
+typedef struct {
+    size_t fr_inodes;           /* i-nodes in use */
+    size_t fr_bad_inodes;       /* in use, but their records are not valid */
+    size_t fr_orphan_inodes;    /* in use, but no directory entry names them */
+    size_t fr_dangling_entries; /* directory entries naming no i-node in use */
+    size_t fr_shared_blocks;    /* i-nodes whose block another i-node owns
+                                   too, or that was freed */
+    size_t fr_leaked_blocks;    /* blocks taken, but that no i-node owns */
+    size_t fr_unmarked_blocks;  /* blocks an i-node owns, but that are free */
+    size_t fr_repaired;         /* problems repaired */
+} fsck_report_t;
+
+/* Freed data blocks are FREEING (free in the stored bitmap, but not taken
+ * again) until the journal checkpoints the transaction that frees them */
+typedef enum { FREE = 0, TAKEN = 1, FREEING = 2 } allocation_state_t;
 
 /*
  * Open file entry (in open file table)
@@ -36,32 +111,144 @@ typedef enum { FREE = 0, TAKEN = 1 } allocation_state_t;
 typedef struct {
     int of_inumber;
     size_t of_offset;
+    int of_flags;
+    pthread_mutex_t of_lock; /* serializes the uses of the offset */
+    _Atomic int of_handle;  /* handle currently issued, -1 if the entry is free */
+    unsigned of_generation; /* generation of the next handle issued */
+    _Atomic uint32_t of_next_free; /* next free entry (index + 1), 0 if none */
 } open_file_entry_t;
 
-#define MAX_DIR_ENTRIES (BLOCK_SIZE / sizeof(dir_entry_t))
+/*
+ * Classes of the locks of the file system, as told apart by the contention
+ * statistics
+ */
+typedef enum {
+    LOCK_INODE,       /* i-node locks */
+    LOCK_RANGE,       /* byte-range lock managers of the i-nodes */
+    LOCK_FREE_BLOCKS, /* data block allocation table */
+    LOCK_FREE_INODES, /* i-node allocation table */
+    LOCK_OPEN_FILE,   /* offsets of the open file entries */
+    LOCK_CREATE,      /* file creation stripes */
+    LOCK_DIR,         /* retired directory blocks and grace periods */
+    LOCK_CACHE,       /* buffer cache misses and replacements */
+    LOCK_JOURNAL,     /* metadata journal (updates, commits) */
+    LOCK_GLOBAL,      /* status of the file system (init and destroy) */
+    LOCK_CLASSES
+} lock_class_t;
+
+/*
+ * Contention statistics of a lock class (see lock_stats_collect)
+ */
+typedef struct {
+    uint64_t ls_acquires;  /* acquisitions */
+    uint64_t ls_contended; /* acquisitions that waited, failed trylocks */
+    uint64_t ls_wait_ns;   /* time spent waiting for the locks */
+    uint64_t ls_hold_ns;   /* time threads held some lock of the class */
+} lock_stats_t;
+
+/*
+ * The locks of the file system are taken through these macros, which only
+ * keep statistics when built with TFS_LOCK_STATS (make LOCK_STATS=yes)
+ */
+#ifdef TFS_LOCK_STATS
+int stats_mutex_lock(lock_class_t lock_class, pthread_mutex_t *mutex);
+int stats_mutex_trylock(lock_class_t lock_class, pthread_mutex_t *mutex);
+int stats_mutex_unlock(lock_class_t lock_class, pthread_mutex_t *mutex);
+int stats_read_lock(lock_class_t lock_class, pthread_rwlock_t *rwlock);
+int stats_write_lock(lock_class_t lock_class, pthread_rwlock_t *rwlock);
+int stats_rwlock_unlock(lock_class_t lock_class, pthread_rwlock_t *rwlock);
+int stats_cond_wait(lock_class_t lock_class, pthread_cond_t *cond,
+                    pthread_mutex_t *mutex);
+int stats_cond_timedwait(lock_class_t lock_class, pthread_cond_t *cond,
+                         pthread_mutex_t *mutex, struct timespec const *until);
+
+#define mutex_lock(lock_class, mutex) stats_mutex_lock(lock_class, mutex)
+#define mutex_trylock(lock_class, mutex) stats_mutex_trylock(lock_class, mutex)
+#define mutex_unlock(lock_class, mutex) stats_mutex_unlock(lock_class, mutex)
+#define read_lock(lock_class, rwlock) stats_read_lock(lock_class, rwlock)
+#define write_lock(lock_class, rwlock) stats_write_lock(lock_class, rwlock)
+#define rwlock_unlock(lock_class, rwlock)                                      \
+    stats_rwlock_unlock(lock_class, rwlock)
+#define cond_wait(lock_class, cond, mutex)                                     \
+    stats_cond_wait(lock_class, cond, mutex)
+#define cond_timedwait(lock_class, cond, mutex, until)                         \
+    stats_cond_timedwait(lock_class, cond, mutex, until)
+#else
+#define mutex_lock(lock_class, mutex) pthread_mutex_lock(mutex)
+#define mutex_trylock(lock_class, mutex) pthread_mutex_trylock(mutex)
+#define mutex_unlock(lock_class, mutex) pthread_mutex_unlock(mutex)
+#define read_lock(lock_class, rwlock) pthread_rwlock_rdlock(rwlock)
+#define write_lock(lock_class, rwlock) pthread_rwlock_wrlock(rwlock)
+#define rwlock_unlock(lock_class, rwlock) pthread_rwlock_unlock(rwlock)
+#define cond_wait(lock_class, cond, mutex) pthread_cond_wait(cond, mutex)
+#define cond_timedwait(lock_class, cond, mutex, until)                         \
+    pthread_cond_timedwait(cond, mutex, until)
+#endif
+
+#define MAX_DIR_ENTRIES                                                        \
+    ((BLOCK_SIZE - sizeof(dir_block_t)) /                                      \
+     (sizeof(uint16_t) + DIR_RECORD_SIZE(1)))
 #define TFS_DISABLE 0
 #define TFS_ENABLE 1
 #define TFS_OPEN_BLOCKED 2
 
-void state_init();
+int state_init(char const *device_spec);
+int state_load(char const *device_spec);
+int state_sync();
+void state_device_stats(block_device_stats_t *stats);
+void metadata_update_begin();
+void metadata_update_end();
+int metadata_commit();
+int metadata_checkpoint();
+void metadata_journal_stats(journal_stats_t *stats);
+int metadata_check(size_t threads, bool repair, fsck_report_t *report);
 void state_destroy();
 
 int inode_create(inode_type n_type);
 int inode_delete(int inumber);
 inode_t *inode_get(int inumber);
 
+void inode_meta_begin(inode_t *inode);
+void inode_meta_end(inode_t *inode);
+int inode_stat(int inumber, tfs_stat_t *stat);
+
+int inode_read_lock(int inumber);
+int inode_write_lock(int inumber);
+int inode_unlock(int inumber);
+int inode_range_lock(int inumber, inode_range_t *range, size_t start,
+                     size_t end, bool exclusive);
+int inode_range_unlock(int inumber, inode_range_t *range);
+
 int clear_dir_entry(int inumber, int sub_inumber);
 int add_dir_entry(int inumber, int sub_inumber, char const *sub_name);
+void lock_file_creation(int inumber, char const *name);
+void unlock_file_creation(int inumber, char const *name);
 int find_in_dir(int inumber, char const *sub_name);
+int list_dir_entries(int inumber, char const *prefix, char const *after,
+                     dir_entry_t *entries, size_t max_entries);
 
 int data_block_alloc();
 int data_block_free(int block_number);
-void *data_block_get(int block_number);
+int data_block_read(int block_number, size_t offset, void *buffer,
+                    size_t len);
+int data_block_write(int block_number, size_t offset, void const *buffer,
+                     size_t len);
+int data_block_sync(int block_number);
+int data_block_sync_all();
+int data_block_cache_policy_set(char const *name);
+void *data_block_pin(int block_number);
+void data_block_unpin(void *data);
+void data_block_cache_stats(buffer_cache_stats_t *stats);
 
-int add_to_open_file_table(int inumber, size_t offset);
+int add_to_open_file_table(int inumber, size_t offset, int flags);
 int remove_from_open_file_table(int fhandle);
 open_file_entry_t *get_open_file_entry(int fhandle);
 
 bool all_files_closed();
 
+char const *lock_class_name(lock_class_t lock_class);
+void lock_stats_collect(lock_stats_t stats[LOCK_CLASSES]);
+void lock_stats_reset();
+void lock_stats_print(FILE *stream);
+
 #endif // STATE_H
@@ -0,0 +1,78 @@
+#include "operations.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+/*
+ * Checks (and repairs, unless -n is given) the image of a file system stored
+ * by an earlier run, once its journal is replayed. The exit status follows
+ * fsck(8): 0 if it is consistent, 1 if every problem was repaired, 4 if some
+ * were left, and 8 if it could not be checked.
+ */
+
+#define EXIT_CLEAN 0
+#define EXIT_REPAIRED 1
+#define EXIT_UNREPAIRED 4
+#define EXIT_FAILED 8
+
+static void usage(char const *name) {
+    fprintf(stderr, "Usage: %s [-n] [-j THREADS] IMAGE\n", name);
+}
+
+int main(int argc, char **argv) {
+    bool repair = true;
+    long threads = sysconf(_SC_NPROCESSORS_ONLN);
+    int opt;
+
+    while ((opt = getopt(argc, argv, "nj:")) != -1) {
+        switch (opt) {
+        case 'n':
+            repair = false;
+            break;
+        case 'j':
+            threads = strtol(optarg, NULL, 10);
+            break;
+        default:
+            usage(argv[0]);
+            return EXIT_FAILED;
+        }
+    }
+    if (optind != argc - 1 || threads < 1) {
+        usage(argv[0]);
+        return EXIT_FAILED;
+    }
+
+    if (tfs_init_from_image(argv[optind]) != 0) {
+        fprintf(stderr, "[fsck]: cannot load image %s\n", argv[optind]);
+        return EXIT_FAILED;
+    }
+
+    fsck_report_t report;
+    if (tfs_fsck((size_t)threads, repair, &report) != 0) {
+        fprintf(stderr, "[fsck]: cannot check image %s\n", argv[optind]);
+        tfs_destroy();
+        return EXIT_FAILED;
+    }
+    if (tfs_destroy() != 0) {
+        fprintf(stderr, "[fsck]: cannot store image %s\n", argv[optind]);
+        return EXIT_FAILED;
+    }
+
+    size_t problems = report.fr_bad_inodes + report.fr_orphan_inodes +
+                      report.fr_dangling_entries + report.fr_shared_blocks +
+                      report.fr_leaked_blocks + report.fr_unmarked_blocks;
+    printf("%s: %zu i-nodes in use\n", argv[optind], report.fr_inodes);
+    printf("  bad i-nodes:           %zu\n", report.fr_bad_inodes);
+    printf("  orphan i-nodes:        %zu\n", report.fr_orphan_inodes);
+    printf("  dangling entries:      %zu\n", report.fr_dangling_entries);
+    printf("  shared blocks:         %zu\n", report.fr_shared_blocks);
+    printf("  leaked blocks:         %zu\n", report.fr_leaked_blocks);
+    printf("  unmarked blocks:       %zu\n", report.fr_unmarked_blocks);
+    printf("  repaired:              %zu of %zu\n", report.fr_repaired,
+           problems);
+
+    if (problems == 0) {
+        return EXIT_CLEAN;
+    }
+    return report.fr_repaired == problems ? EXIT_REPAIRED : EXIT_UNREPAIRED;
+}
@@ -7,12 +7,15 @@
 #include <errno.h>
 #include <unistd.h>
 #include <string.h>
+#include <limits.h>
 #include "operations.h"
 #include "common/common.h"
 #include "tfs_server.h"
     
-#define BUFFER_SIZE 1000
+// Large enough for the biggest message a client sends atomically
+#define BUFFER_SIZE PIPE_BUF
 #define PIPE_PATH_SIZE 40
+#define SESSION_FHANDLES_INITIAL_SIZE 16
 
 int session_free_table[MAX_SESSIONS];
 session_t sessions[MAX_SESSIONS];
@@ -112,6 +115,15 @@ int main(int argc, char **argv) {
             continue;
         }
 
+        // Malformed messages are dropped, not handed to a session
+        if (ret == -1) {
+            fprintf(stderr, "[Server]: Malformed message dropped\n");
+            if (pthread_mutex_lock(&mutex_running) != 0) {
+                return -1;
+            }
+            continue;
+        }
+
         if (buffer[0] == TFS_OP_CODE_MOUNT) {
             fprintf(stderr, "[Server]: New mount message received\n");
             buffer[PIPE_PATH_SIZE + 1] = 0;
@@ -240,6 +252,90 @@ ssize_t read_pipe(int pipe, char* buffer) {
             }
             break;
         }
+        case TFS_OP_CODE_PWRITE: {
+            ret = read(pipe, buffer, TFS_PWRITE_SIZE_BEFORE_MESSAGE - sizeof(char));
+
+            if (ret < TFS_PWRITE_SIZE_BEFORE_MESSAGE - sizeof(char)) {
+                return -1;
+            }
+
+            size_t len = *((size_t*) (buffer + sizeof(int) * 2));
+            if (len > BUFFER_SIZE - TFS_PWRITE_SIZE_BEFORE_MESSAGE) {
+                return -1;
+            }
+
+            ret = read(pipe, buffer + TFS_PWRITE_SIZE_BEFORE_MESSAGE - sizeof(char), len);
+
+            if (ret < len) {
+                return -1;
+            }
+
+            break;
+        }
+        case TFS_OP_CODE_PREAD: {
+            ret = read(pipe, buffer, TFS_PREAD_SIZE - sizeof(char));
+            if (ret <  TFS_PREAD_SIZE - sizeof(char)) {
+                return -1;
+            }
+
+            // Files hold at most a block, so longer reads are malformed
+            size_t len = *((size_t*) (buffer + sizeof(int) * 2));
+            if (len > BLOCK_SIZE) {
+                return -1;
+            }
+            break;
+        }
+        case TFS_OP_CODE_WRITEV:
+        case TFS_OP_CODE_READV: {
+            // Both requests share the layout up to the lengths
+            ret = read(pipe, buffer, TFS_WRITEV_SIZE_BEFORE_LENGTHS - sizeof(char));
+
+            if (ret < TFS_WRITEV_SIZE_BEFORE_LENGTHS - sizeof(char)) {
+                return -1;
+            }
+
+            int iovcnt = *((int*) (buffer + sizeof(int) * 2));
+            if (iovcnt < 0 || iovcnt > TFS_IOV_MAX) {
+                return -1;
+            }
+
+            buffer += TFS_WRITEV_SIZE_BEFORE_LENGTHS - sizeof(char);
+            size_t lengths_size = sizeof(size_t) * (size_t) iovcnt;
+            ret = read(pipe, buffer, lengths_size);
+
+            if (ret < lengths_size) {
+                return -1;
+            }
+
+            // Each length is checked against what is left, so that the
+            // total cannot wrap around: the contents of a writev must fit
+            // in the buffer, and a readv cannot ask for a huge reply
+            size_t budget = op_code == TFS_OP_CODE_READV
+                                ? (size_t) BLOCK_SIZE * TFS_IOV_MAX
+                                : BUFFER_SIZE - TFS_WRITEV_SIZE_BEFORE_LENGTHS -
+                                      lengths_size;
+            size_t len = 0;
+            for (int i = 0; i < iovcnt; i++) {
+                size_t l = ((size_t*) buffer)[i];
+                if (l > budget) {
+                    return -1;
+                }
+                budget -= l;
+                len += l;
+            }
+
+            if (op_code == TFS_OP_CODE_READV) {
+                break;
+            }
+
+            ret = read(pipe, buffer + lengths_size, len);
+
+            if (ret < len) {
+                return -1;
+            }
+
+            break;
+        }
         case TFS_OP_CODE_SHUTDOWN_AFTER_ALL_CLOSED: {
             ret = read(pipe, buffer, TFS_SHUTDOWN_AFTER_ALL_CLOSED_SIZE - sizeof(char));
             if (ret <  TFS_SHUTDOWN_AFTER_ALL_CLOSED_SIZE - sizeof(char)) {
@@ -327,6 +423,10 @@ session_t session_setup(int pipe, int id) {
     session->cons_ptr = 0;
     session->has_message = false;
     session->running = true;
+    session->fhandles = NULL;
+    session->free_fhandles = NULL;
+    session->fhandles_size = 0;
+    session->free_fhandles_count = 0;
 
     if (pthread_cond_init(&session->message_placed, NULL) != 0 ||
         pthread_cond_init(&session->message_removed, NULL) != 0) {
@@ -358,12 +458,108 @@ int session_destroy(session_t session) {
         return -1;
     }
 
+    free(session->fhandles);
+    free(session->free_fhandles);
     free(session->buffer);
     free(session);
 
     return 0;
 }
 
+/**
+ * Adds a file system handle to the session's handle table, growing it if
+ * needed. The table is only used by the session's thread, so it needs no
+ * locking.
+ * Returns the handle the client uses for the file, or -1 if failed.
+ */
+int session_fhandle_add(session_t session, int fhandle) {
+    if (session->free_fhandles_count == 0) {
+        int new_size = session->fhandles_size == 0
+                           ? SESSION_FHANDLES_INITIAL_SIZE
+                           : session->fhandles_size * 2;
+
+        int* fhandles = (int*) realloc(session->fhandles,
+                                       sizeof(int) * (size_t) new_size);
+        if (fhandles == NULL) {
+            return -1;
+        }
+        session->fhandles = fhandles;
+
+        int* free_fhandles = (int*) realloc(session->free_fhandles,
+                                            sizeof(int) * (size_t) new_size);
+        if (free_fhandles == NULL) {
+            return -1;
+        }
+        session->free_fhandles = free_fhandles;
+
+        // Pushed in reverse, so that lower positions are handed out first
+        for (int i = new_size - 1; i >= session->fhandles_size; i--) {
+            session->fhandles[i] = -1;
+            session->free_fhandles[session->free_fhandles_count++] = i;
+        }
+        session->fhandles_size = new_size;
+    }
+
+    int session_fhandle =
+        session->free_fhandles[--session->free_fhandles_count];
+    session->fhandles[session_fhandle] = fhandle;
+
+    return session_fhandle;
+}
+
+/**
+ * Returns the file system handle behind a handle of the session, or -1 if the
+ * session has no such file open.
+ */
+int session_fhandle_get(session_t session, int session_fhandle) {
+    if (session_fhandle < 0 || session_fhandle >= session->fhandles_size) {
+        return -1;
+    }
+
+    return session->fhandles[session_fhandle];
+}
+
+/**
+ * Removes a handle from the session's handle table.
+ */
+void session_fhandle_remove(session_t session, int session_fhandle) {
+    if (session_fhandle_get(session, session_fhandle) == -1) {
+        return;
+    }
+
+    session->fhandles[session_fhandle] = -1;
+    session->free_fhandles[session->free_fhandles_count++] = session_fhandle;
+}
+
+/**
+ * Closes, in a single batch, every file the session still has open.
+ * Returns the number of files closed, or -1 if failed.
+ */
+int session_release_fhandles(session_t session) {
+    int count = 0;
+
+    // Compacts the open handles at the start of the table
+    for (int i = 0; i < session->fhandles_size; i++) {
+        if (session->fhandles[i] != -1) {
+            session->fhandles[count++] = session->fhandles[i];
+        }
+    }
+
+    if (count == 0) {
+        return 0;
+    }
+
+    int ret = tfs_close_all(session->fhandles, (size_t) count);
+
+    session->free_fhandles_count = 0;
+    for (int i = session->fhandles_size - 1; i >= 0; i--) {
+        session->fhandles[i] = -1;
+        session->free_fhandles[session->free_fhandles_count++] = i;
+    }
+
+    return ret;
+}
+
 int session_unmount(session_t session, int current_id, bool warn_client) {
     fprintf(stderr, "[Server @%d]: Unmount requested\n", current_id);
     if (pthread_mutex_lock(&free_table_mutex) != 0) {
@@ -376,6 +572,12 @@ int session_unmount(session_t session, int current_id, bool warn_client) {
 
     int pipe = session->pipe;
 
+    int released = session_release_fhandles(session);
+    if (released > 0) {
+        fprintf(stderr, "[Server @%d]: Closed %d files left open\n",
+                current_id, released);
+    }
+
     session_free_table[current_id] = FREE;
 
     int ret = 0;
@@ -409,6 +611,13 @@ int session_open(session_t session, int current_id, char* buffer) {
             filename, flags);
 
     int ret = tfs_open(filename, flags);
+    if (ret != -1) {
+        int fhandle = ret;
+        ret = session_fhandle_add(session, fhandle);
+        if (ret == -1) {
+            tfs_close(fhandle);
+        }
+    }
 
     fprintf(stderr, "[Server @%d]: Open return: %d\n", current_id, ret);
     if (write(session->pipe, (void *)&ret, sizeof(int)) != sizeof(int)) {
@@ -420,9 +629,12 @@ int session_open(session_t session, int current_id, char* buffer) {
 
 int session_close(session_t session, int current_id, char* buffer) {
     fprintf(stderr, "[Server @%d]: Close requested\n", current_id);
-    int fhandle = *((int *)(buffer + sizeof(char) + sizeof(int)));
+    int session_fhandle = *((int *)(buffer + sizeof(char) + sizeof(int)));
 
-    int ret = tfs_close(fhandle);
+    int ret = tfs_close(session_fhandle_get(session, session_fhandle));
+    if (ret == 0) {
+        session_fhandle_remove(session, session_fhandle);
+    }
 
     fprintf(stderr, "[Server @%d]: Close return: %d\n", current_id, ret);
     if (write(session->pipe, (void *)&ret, sizeof(int)) != sizeof(int)) {
@@ -434,7 +646,8 @@ int session_close(session_t session, int current_id, char* buffer) {
 
 int session_write(session_t session, int current_id, char* buffer) {
     fprintf(stderr, "[Server @%d]: Write requested\n", current_id);
-    int fhandle = *((int *)(buffer + sizeof(char) + sizeof(int)));
+    int fhandle = session_fhandle_get(
+        session, *((int *)(buffer + sizeof(char) + sizeof(int))));
     size_t len = *((size_t *)(buffer + sizeof(char) + sizeof(int) * 2));
     void *in_buffer = malloc(sizeof(char) * len);
     memcpy(in_buffer, buffer + sizeof(char) + sizeof(int) * 2 + sizeof(size_t),
@@ -454,7 +667,8 @@ int session_write(session_t session, int current_id, char* buffer) {
 
 int session_read(session_t session, int current_id, char* buffer) {
     fprintf(stderr, "[Server @%d]: Read requested\n", current_id);
-    int fhandle = *((int *)(buffer + sizeof(char) + sizeof(int)));
+    int fhandle = session_fhandle_get(
+        session, *((int *)(buffer + sizeof(char) + sizeof(int))));
     size_t len = *((size_t *)(buffer + sizeof(char) + sizeof(int) * 2));
     void *ret_buffer = malloc(sizeof(char) * len);
 
@@ -476,11 +690,132 @@ int session_read(session_t session, int current_id, char* buffer) {
     return 0;
 }
 
+int session_pwrite(session_t session, int current_id, char* buffer) {
+    fprintf(stderr, "[Server @%d]: Pwrite requested\n", current_id);
+    int fhandle = session_fhandle_get(
+        session, *((int *)(buffer + sizeof(char) + sizeof(int))));
+    size_t len = *((size_t *)(buffer + sizeof(char) + sizeof(int) * 2));
+    size_t offset = *((size_t *)(buffer + sizeof(char) + sizeof(int) * 2 +
+                                 sizeof(size_t)));
+
+    ssize_t ret = tfs_pwrite(fhandle, buffer + TFS_PWRITE_SIZE_BEFORE_MESSAGE,
+                             len, offset);
+    fprintf(stderr, "[Server @%d]: Pwrite return: %ld\n", current_id, ret);
+    if (write(session->pipe, (void *)&ret, sizeof(ssize_t)) !=
+        sizeof(ssize_t)) {
+        return -1;
+    }
+
+    return 0;
+}
+
+int session_pread(session_t session, int current_id, char* buffer) {
+    fprintf(stderr, "[Server @%d]: Pread requested\n", current_id);
+    int fhandle = session_fhandle_get(
+        session, *((int *)(buffer + sizeof(char) + sizeof(int))));
+    size_t len = *((size_t *)(buffer + sizeof(char) + sizeof(int) * 2));
+    size_t offset = *((size_t *)(buffer + sizeof(char) + sizeof(int) * 2 +
+                                 sizeof(size_t)));
+    if (len > BLOCK_SIZE) {
+        len = BLOCK_SIZE;
+    }
+
+    // The reply (count followed by the contents) is sent in a single write
+    char *reply = malloc(sizeof(ssize_t) + sizeof(char) * len);
+    if (reply == NULL) {
+        return -1;
+    }
+
+    ssize_t ret = tfs_pread(fhandle, reply + sizeof(ssize_t), len, offset);
+    fprintf(stderr, "[Server @%d]: Pread return: %ld\n", current_id, ret);
+    memcpy(reply, &ret, sizeof(ssize_t));
+
+    size_t reply_size = sizeof(ssize_t) + (ret > 0 ? (size_t)ret : 0);
+    if (write(session->pipe, reply, reply_size) != reply_size) {
+        free(reply);
+        return -1;
+    }
+
+    free(reply);
+    return 0;
+}
+
+int session_writev(session_t session, int current_id, char* buffer) {
+    fprintf(stderr, "[Server @%d]: Writev requested\n", current_id);
+    int fhandle = session_fhandle_get(
+        session, *((int *)(buffer + sizeof(char) + sizeof(int))));
+    int iovcnt = *((int *)(buffer + sizeof(char) + sizeof(int) * 2));
+    size_t *lengths = (size_t *)(buffer + TFS_WRITEV_SIZE_BEFORE_LENGTHS);
+
+    // The buffers point straight into the message
+    struct iovec iov[TFS_IOV_MAX];
+    char *data = buffer + TFS_WRITEV_SIZE_BEFORE_LENGTHS +
+                 sizeof(size_t) * (size_t)iovcnt;
+    for (int i = 0; i < iovcnt; i++) {
+        iov[i].iov_base = data;
+        iov[i].iov_len = lengths[i];
+        data += lengths[i];
+    }
+
+    ssize_t ret = tfs_writev(fhandle, iov, iovcnt);
+    fprintf(stderr, "[Server @%d]: Writev return: %ld\n", current_id, ret);
+    if (write(session->pipe, (void *)&ret, sizeof(ssize_t)) !=
+        sizeof(ssize_t)) {
+        return -1;
+    }
+
+    return 0;
+}
+
+int session_readv(session_t session, int current_id, char* buffer) {
+    fprintf(stderr, "[Server @%d]: Readv requested\n", current_id);
+    int fhandle = session_fhandle_get(
+        session, *((int *)(buffer + sizeof(char) + sizeof(int))));
+    int iovcnt = *((int *)(buffer + sizeof(char) + sizeof(int) * 2));
+    size_t *lengths = (size_t *)(buffer + TFS_READV_SIZE_BEFORE_LENGTHS);
+
+    size_t len = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        len += lengths[i];
+    }
+
+    // The reply (count followed by the contents) is sent in a single write
+    char *reply = malloc(sizeof(ssize_t) + sizeof(char) * len);
+    if (reply == NULL) {
+        return -1;
+    }
+
+    struct iovec iov[TFS_IOV_MAX];
+    char *data = reply + sizeof(ssize_t);
+    for (int i = 0; i < iovcnt; i++) {
+        iov[i].iov_base = data;
+        iov[i].iov_len = lengths[i];
+        data += lengths[i];
+    }
+
+    ssize_t ret = tfs_readv(fhandle, iov, iovcnt);
+    fprintf(stderr, "[Server @%d]: Readv return: %ld\n", current_id, ret);
+    memcpy(reply, &ret, sizeof(ssize_t));
+
+    size_t reply_size = sizeof(ssize_t) + (ret > 0 ? (size_t)ret : 0);
+    if (write(session->pipe, reply, reply_size) != reply_size) {
+        free(reply);
+        return -1;
+    }
+
+    free(reply);
+    return 0;
+}
+
 int session_shutdown_all_after_closed(session_t session, int current_id) {
     fprintf(stderr, "[Server @%d]: Shutdown requested\n", current_id);
 
     int ret = tfs_destroy_after_all_closed();
 
+#ifdef TFS_LOCK_STATS
+    lock_stats_print(stderr);
+#endif
+
     fprintf(stderr, "[Server @%d]: Destruction completed. Ending remaing threads\n", current_id);
 
     if (pthread_mutex_lock(&free_table_mutex) != 0) {
@@ -603,6 +938,34 @@ void *session_run(void *arg) {
                     return NULL;
                 }                
                break;
+
+            case TFS_OP_CODE_PWRITE:
+                if (session_pwrite(session, current_id, buffer) != 0) {
+                    session_unmount(session, current_id, false);
+                    return NULL;
+                }
+                break;
+
+            case TFS_OP_CODE_PREAD:
+                if (session_pread(session, current_id, buffer) != 0) {
+                    session_unmount(session, current_id, false);
+                    return NULL;
+                }
+                break;
+
+            case TFS_OP_CODE_WRITEV:
+                if (session_writev(session, current_id, buffer) != 0) {
+                    session_unmount(session, current_id, false);
+                    return NULL;
+                }
+                break;
+
+            case TFS_OP_CODE_READV:
+                if (session_readv(session, current_id, buffer) != 0) {
+                    session_unmount(session, current_id, false);
+                    return NULL;
+                }
+                break;
                 
             case TFS_OP_CODE_SHUTDOWN_AFTER_ALL_CLOSED: 
                 session_shutdown_all_after_closed(session, current_id);
@@ -17,6 +17,10 @@ typedef struct session {
     pthread_cond_t message_placed;
     pthread_cond_t message_removed;
     bool running;
+    int* fhandles; // File system handles opened by the session (-1 if free)
+    int* free_fhandles; // Stack of free positions of fhandles
+    int fhandles_size;
+    int free_fhandles_count;
 }* session_t;
 
 int init_mutexes();
@@ -25,6 +29,10 @@ int mount(char* pipe_name);
 int unmount(int session_id);
 session_t session_setup(int pipe, int id);
 int session_destroy(session_t session);
+int session_fhandle_add(session_t session, int fhandle);
+int session_fhandle_get(session_t session, int session_fhandle);
+void session_fhandle_remove(session_t session, int session_fhandle);
+int session_release_fhandles(session_t session);
 void* session_run(void* arg);
 int read_buffer(session_t session, char* dest);
 int write_buffer(session_t session, char* src);
@@ -0,0 +1,79 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+#define FILES (40)
+
+/*  Checks that the allocation tables are kept in memory: a storm of file
+    creations, block allocations and frees reads nothing from the storage
+    (the changes are logged by the journal in the background), and the
+    changes are written back in a batch when a file is synced.
+    Note: This test uses TecnicoFS as a library, not
+    as a standalone server.
+*/
+
+block_device_stats_t last;
+
+/*
+ * Counts the reads and writes of the device since the last call
+ */
+void device_accesses(uint64_t *reads, uint64_t *writes) {
+    block_device_stats_t stats;
+
+    state_device_stats(&stats);
+    *reads = stats.ds_reads - last.ds_reads;
+    *writes = stats.ds_writes - last.ds_writes;
+    last = stats;
+}
+
+int main() {
+    char name[16];
+    int f[FILES];
+    tfs_stat_t stat;
+    uint64_t reads, writes;
+
+    assert(tfs_init_device("memory") != -1);
+
+    /* Creations, each with a block of data */
+    device_accesses(&reads, &writes);
+    for (int i = 0; i < FILES; i++) {
+        sprintf(name, "/f%d", i);
+        f[i] = tfs_open(name, TFS_O_CREAT);
+        assert(f[i] != -1);
+        assert(tfs_write(f[i], "data", 4) == 4);
+    }
+    device_accesses(&reads, &writes);
+    assert(reads == 0);
+    assert(tfs_close_all(f, FILES) == FILES);
+
+    /* Truncations, which free every block */
+    for (int i = 0; i < FILES; i++) {
+        sprintf(name, "/f%d", i);
+        f[i] = tfs_open(name, TFS_O_TRUNC);
+        assert(f[i] != -1);
+    }
+    device_accesses(&reads, &writes);
+    assert(reads == 0);
+
+    for (int i = 0; i < FILES; i++) {
+        sprintf(name, "/f%d", i);
+        assert(tfs_stat(name, &stat) == 0);
+        assert(stat.st_size == 0);
+    }
+
+    /* Syncing writes back the few blocks of the tables that changed, in
+     * one transaction */
+    device_accesses(&reads, &writes);
+    assert(tfs_fsync(f[0]) == 0);
+    device_accesses(&reads, &writes);
+    assert(reads == 0);
+    assert(writes < FILES / 2);
+
+    assert(tfs_close_all(f, FILES) == FILES);
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
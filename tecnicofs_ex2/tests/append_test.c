@@ -0,0 +1,184 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+#define THREADS (16)
+#define RECORD_SIZE (8)
+#define RECORDS_PER_THREAD (BLOCK_SIZE / RECORD_SIZE / THREADS)
+
+/*  Checks that threads appending through the same TFS_O_APPEND handle never
+    interleave their records, that the records of each thread keep their
+    order, that appends go after data written with other handles, and that
+    writes past the end of the file do not expose appends still under way.
+    Note: This test uses TecnicoFS as a library, not
+    as a standalone server.
+*/
+
+#define ROUNDS (1000)
+#define APPENDERS (4)
+#define RECORDS_PER_APPENDER (4)
+#define SNAPSHOTS (32)
+#define FAR_OFFSET (BLOCK_SIZE - 16 * RECORD_SIZE)
+
+int file;
+int reader;
+_Atomic int appenders_running;
+char snapshots[SNAPSHOTS][BLOCK_SIZE];
+ssize_t snapshot_sizes[SNAPSHOTS];
+
+void *fn_thread(void *arg) {
+    int id = *(int *)arg;
+    char record[RECORD_SIZE + 1];
+
+    for (int i = 0; i < RECORDS_PER_THREAD; i++) {
+        sprintf(record, "%02d:%04d\n", id, i);
+        assert(tfs_write(file, record, RECORD_SIZE) == RECORD_SIZE);
+    }
+
+    return NULL;
+}
+
+void *fn_appender(void *arg) {
+    int id = *(int *)arg;
+    char record[RECORD_SIZE + 1];
+    struct iovec bytes[RECORD_SIZE];
+
+    /* One buffer per byte, to make the copies of the records slow */
+    for (int i = 0; i < RECORD_SIZE; i++) {
+        bytes[i].iov_base = record + i;
+        bytes[i].iov_len = 1;
+    }
+    for (int i = 0; i < RECORDS_PER_APPENDER; i++) {
+        sprintf(record, "%02d:%04d\n", id, i);
+        /* The file may fill up after the write past its end */
+        assert(tfs_writev(file, bytes, RECORD_SIZE) != -1);
+    }
+    appenders_running--;
+
+    return NULL;
+}
+
+void *fn_pwriter(void *arg) {
+    (void)arg;
+    assert(tfs_pwrite(reader, "far:far\n", RECORD_SIZE, FAR_OFFSET) ==
+           RECORD_SIZE);
+    return NULL;
+}
+
+void *fn_reader(void *arg) {
+    (void)arg;
+    int n = 0;
+
+    while (appenders_running > 0 || n == 0) {
+        int i = n < SNAPSHOTS ? n : SNAPSHOTS - 1;
+        snapshot_sizes[i] = tfs_pread(reader, snapshots[i], BLOCK_SIZE, 0);
+        assert(snapshot_sizes[i] != -1);
+        n++;
+    }
+
+    return (void *)(size_t)(n < SNAPSHOTS ? n : SNAPSHOTS);
+}
+
+/*
+ * Appends records while another handle writes past the end of the file, and
+ * checks that every byte a reader saw is already in its final state
+ */
+void check_interleaved_round(void) {
+    char final[BLOCK_SIZE];
+    int ids[APPENDERS];
+    pthread_t appenders[APPENDERS], pwriter, reader_tid;
+    void *snapshots_taken;
+
+    reader = tfs_open("/log", TFS_O_TRUNC);
+    assert(reader != -1);
+
+    appenders_running = APPENDERS;
+    for (int i = 0; i < APPENDERS; i++) {
+        ids[i] = i;
+        assert(pthread_create(&appenders[i], NULL, fn_appender, &ids[i]) ==
+               0);
+    }
+    assert(pthread_create(&pwriter, NULL, fn_pwriter, NULL) == 0);
+    assert(pthread_create(&reader_tid, NULL, fn_reader, NULL) == 0);
+
+    for (int i = 0; i < APPENDERS; i++) {
+        assert(pthread_join(appenders[i], NULL) == 0);
+    }
+    assert(pthread_join(pwriter, NULL) == 0);
+    assert(pthread_join(reader_tid, &snapshots_taken) == 0);
+
+    ssize_t size = tfs_pread(reader, final, sizeof(final), 0);
+    assert(size >= FAR_OFFSET + RECORD_SIZE);
+    for (size_t i = 0; i < (size_t)snapshots_taken; i++) {
+        assert(snapshot_sizes[i] <= size);
+        assert(memcmp(snapshots[i], final, (size_t)snapshot_sizes[i]) == 0);
+    }
+
+    assert(tfs_close(reader) != -1);
+}
+
+int main() {
+    char buffer[BLOCK_SIZE];
+    int ids[THREADS];
+    int next[THREADS] = {0};
+
+    assert(tfs_init() != -1);
+
+    file = tfs_open("/log", TFS_O_CREAT | TFS_O_APPEND);
+    assert(file != -1);
+
+    pthread_t tid[THREADS];
+    for (int i = 0; i < THREADS; i++) {
+        ids[i] = i;
+        assert(pthread_create(&tid[i], NULL, fn_thread, &ids[i]) == 0);
+    }
+    for (int i = 0; i < THREADS; i++) {
+        assert(pthread_join(tid[i], NULL) == 0);
+    }
+
+    /* The file is full */
+    assert(tfs_write(file, "x", 1) == 0);
+
+    int f = tfs_open("/log", 0);
+    assert(f != -1);
+    assert(tfs_read(f, buffer, sizeof(buffer)) == BLOCK_SIZE);
+    assert(tfs_close(f) != -1);
+
+    for (int i = 0; i < BLOCK_SIZE; i += RECORD_SIZE) {
+        int id, n;
+        assert(sscanf(buffer + i, "%02d:%04d", &id, &n) == 2);
+        assert(buffer[i + RECORD_SIZE - 1] == '\n');
+        assert(id >= 0 && id < THREADS);
+        assert(n == next[id]);
+        next[id]++;
+    }
+
+    /* After a truncation, appends start over and follow other writes */
+    f = tfs_open("/log", TFS_O_TRUNC);
+    assert(f != -1);
+    assert(tfs_write(f, "head", 4) == 4);
+
+    struct iovec record[2] = {{"ta", 2}, {"il", 2}};
+    assert(tfs_writev(file, record, 2) == 4);
+    assert(tfs_pwrite(f, "!", 1, 9) == 1);
+    assert(tfs_write(file, "end", 3) == 3);
+
+    assert(tfs_pread(f, buffer, sizeof(buffer), 0) == 13);
+    assert(memcmp(buffer, "headtail\0!end", 13) == 0);
+
+    assert(tfs_close(f) != -1);
+
+    for (int i = 0; i < ROUNDS; i++) {
+        check_interleaved_round();
+    }
+
+    assert(tfs_close(file) != -1);
+
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,101 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#define IMAGE "/tmp/tfs_block_device_test.img"
+#define THREADS (4)
+#define SLICE (BLOCK_SIZE / THREADS)
+
+/*  Checks that the file system works the same on every block device backend:
+    files read back what was written, gaps and reused blocks read as zeros,
+    and threads can write disjoint ranges of the same block at once.
+    Note: This test uses TecnicoFS as a library, not
+    as a standalone server.
+*/
+
+char const *specs[] = {"memory", "file:" IMAGE, "mmap:" IMAGE,
+                       "uring:" IMAGE};
+
+int file;
+
+void *fn_thread(void *arg) {
+    int id = *(int *)arg;
+    char slice[SLICE];
+
+    memset(slice, 'a' + id, SLICE);
+    for (int i = 0; i < 50; i++) {
+        assert(tfs_pwrite(file, slice, SLICE, (size_t)(id * SLICE)) == SLICE);
+    }
+
+    return NULL;
+}
+
+void check_device(char const *spec) {
+    char buffer[BLOCK_SIZE];
+    pthread_t tid[THREADS];
+    int ids[THREADS];
+
+    assert(tfs_init_device(spec) != -1);
+
+    file = tfs_open("/f", TFS_O_CREAT);
+    assert(file != -1);
+    assert(tfs_pwrite(file, "tail", 4, 100) == 4);
+    assert(tfs_pread(file, buffer, sizeof(buffer), 0) == 104);
+    for (int i = 0; i < 100; i++) {
+        assert(buffer[i] == 0);
+    }
+    assert(memcmp(buffer + 100, "tail", 4) == 0);
+
+    /* The block freed by the truncation is reused, and reads as zeros */
+    int g = tfs_open("/f", TFS_O_TRUNC);
+    assert(g != -1);
+    assert(tfs_pwrite(g, "x", 1, 200) == 1);
+    assert(tfs_pread(g, buffer, sizeof(buffer), 0) == 201);
+    for (int i = 0; i < 200; i++) {
+        assert(buffer[i] == 0);
+    }
+    assert(tfs_close(g) != -1);
+
+    for (int i = 0; i < THREADS; i++) {
+        ids[i] = i;
+        assert(pthread_create(&tid[i], NULL, fn_thread, &ids[i]) == 0);
+    }
+    for (int i = 0; i < THREADS; i++) {
+        assert(pthread_join(tid[i], NULL) == 0);
+    }
+
+    assert(tfs_pread(file, buffer, sizeof(buffer), 0) == BLOCK_SIZE);
+    for (int i = 0; i < BLOCK_SIZE; i++) {
+        assert(buffer[i] == 'a' + i / SLICE);
+    }
+    assert(tfs_close(file) != -1);
+
+    /* Directory blocks go through the device too */
+    for (int i = 0; i < 10; i++) {
+        char path[16];
+        sprintf(path, "/d%d", i);
+        int f = tfs_open(path, TFS_O_CREAT);
+        assert(f != -1);
+        assert(tfs_close(f) != -1);
+    }
+    assert(tfs_lookup("/d7") != -1);
+    assert(tfs_lookup("/d10") == -1);
+
+    assert(tfs_destroy() != -1);
+}
+
+int main() {
+    for (size_t i = 0; i < sizeof(specs) / sizeof(specs[0]); i++) {
+        check_device(specs[i]);
+    }
+    unlink(IMAGE);
+
+    assert(tfs_init_device("tape:/dev/st0") == -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,182 @@
+#include "fs/buffer_cache.h"
+#include "fs/operations.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#define BLOCKS (16)
+#define FRAMES (4)
+#define STREAM_BLOCKS (64)
+#define THREADS (4)
+#define READS (100)
+#define MS (1000000u)
+
+/*  Checks the buffer cache: hot blocks are read without touching the
+    emulated storage, blocks beyond its budget are evicted (unless pinned),
+    writes and discards are seen by later reads, threads sharing the cache
+    read what was written, and sequential reads are served by readahead.
+    Note: This test uses TecnicoFS as a library, not
+    as a standalone server.
+*/
+
+buffer_cache_t *cache;
+
+uint64_t now() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+}
+
+void *fn_thread(void *arg) {
+    int id = *(int *)arg;
+    char block[BLOCK_SIZE];
+
+    /* Each thread reads its own block and the other ones, so that frames are
+     * replaced while in use by others */
+    for (int i = 0; i < READS; i++) {
+        int b = (id + i) % BLOCKS;
+        assert(buffer_cache_read(cache, b, 0, block, BLOCK_SIZE) == 0);
+        for (size_t j = 0; j < BLOCK_SIZE; j++) {
+            assert(block[j] == 'a' + b);
+        }
+    }
+
+    return NULL;
+}
+
+int main() {
+    char block[BLOCK_SIZE];
+    char zeros[BLOCK_SIZE];
+    buffer_cache_stats_t stats;
+
+    memset(zeros, 0, BLOCK_SIZE);
+
+    /* 1 ms per access to the storage */
+    assert(latency_model_set("1000000:1000000:0:0") == 0);
+    block_device_t *device = block_device_open("memory", BLOCKS);
+    assert(device != NULL);
+    cache = buffer_cache_create(device, FRAMES, CACHE_WRITE_THROUGH);
+    assert(cache != NULL);
+
+    /* A block written whole is not read first, and is then served from the
+     * cache */
+    memset(block, 'h', BLOCK_SIZE);
+    assert(buffer_cache_write(cache, 0, 0, block, BLOCK_SIZE) == 0);
+    uint64_t start = now();
+    for (int i = 0; i < READS; i++) {
+        assert(buffer_cache_read(cache, 0, 1, block, 3) == 0);
+        assert(memcmp(block, "hhh", 3) == 0);
+    }
+    assert(now() - start < READS * MS / 2);
+
+    buffer_cache_stats(cache, &stats);
+    assert(stats.bs_misses == 1);
+    assert(stats.bs_hits == READS);
+    assert(stats.bs_evictions == 0);
+
+    /* Partial writes reach the device too */
+    assert(buffer_cache_write(cache, 0, 1, "ot", 2) == 0);
+    assert(block_device_read(device, 0, 0, block, 4) == 0);
+    assert(memcmp(block, "hoth", 4) == 0);
+
+    /* A pinned block stays while more blocks than frames are read */
+    char *hot = buffer_cache_pin(cache, 0);
+    assert(hot != NULL);
+    for (int b = 1; b < BLOCKS; b++) {
+        assert(buffer_cache_read(cache, b, 0, block, BLOCK_SIZE) == 0);
+        assert(memcmp(block, zeros, BLOCK_SIZE) == 0);
+    }
+    buffer_cache_stats(cache, &stats);
+    assert(stats.bs_evictions >= BLOCKS - FRAMES);
+    assert(memcmp(hot, "hoth", 4) == 0);
+    assert(buffer_cache_pin(cache, 0) == hot);
+    buffer_cache_unpin(cache, hot);
+    buffer_cache_unpin(cache, hot);
+
+    /* Discarded blocks read as zeros, cached or not */
+    assert(buffer_cache_discard(cache, 0) == 0);
+    assert(buffer_cache_read(cache, 0, 0, block, BLOCK_SIZE) == 0);
+    assert(memcmp(block, zeros, BLOCK_SIZE) == 0);
+
+    assert(buffer_cache_read(cache, BLOCKS, 0, block, 1) == -1);
+    assert(buffer_cache_read(cache, 0, BLOCK_SIZE, block, 1) == -1);
+
+    /* Threads share the frames */
+    assert(latency_model_set("none") == 0);
+    for (int b = 0; b < BLOCKS; b++) {
+        memset(block, 'a' + b, BLOCK_SIZE);
+        assert(buffer_cache_write(cache, b, 0, block, BLOCK_SIZE) == 0);
+    }
+
+    pthread_t tid[THREADS];
+    int ids[THREADS];
+    for (int i = 0; i < THREADS; i++) {
+        ids[i] = i;
+        assert(pthread_create(&tid[i], NULL, fn_thread, &ids[i]) == 0);
+    }
+    for (int i = 0; i < THREADS; i++) {
+        assert(pthread_join(tid[i], NULL) == 0);
+    }
+
+    assert(buffer_cache_destroy(cache) == 0);
+    block_device_close(device);
+
+    /* Scattered reads prefetch nothing, while a sequential stream is read
+     * ahead, by several blocks at once */
+    assert(latency_model_set("1000000:1000000:0:0") == 0);
+    device = block_device_open("memory", STREAM_BLOCKS);
+    assert(device != NULL);
+    cache = buffer_cache_create(device, STREAM_BLOCKS, CACHE_WRITE_THROUGH);
+    assert(cache != NULL);
+
+    for (int i = 0; i < STREAM_BLOCKS / 4; i++) {
+        assert(buffer_cache_read(cache, (i * 7) % STREAM_BLOCKS, 0, block,
+                                 BLOCK_SIZE) == 0);
+    }
+    buffer_cache_stats(cache, &stats);
+    assert(stats.bs_prefetches == 0);
+
+    assert(buffer_cache_destroy(cache) == 0);
+    cache = buffer_cache_create(device, STREAM_BLOCKS, CACHE_WRITE_THROUGH);
+    assert(cache != NULL);
+
+    start = now();
+    for (int b = 0; b < STREAM_BLOCKS; b++) {
+        assert(buffer_cache_read(cache, b, 0, block, BLOCK_SIZE) == 0);
+    }
+    assert(now() - start < STREAM_BLOCKS * MS / 2);
+
+    buffer_cache_stats(cache, &stats);
+    assert(stats.bs_prefetches > 0);
+    assert(stats.bs_prefetch_hits > STREAM_BLOCKS / 2);
+    assert(stats.bs_prefetch_wasted == 0);
+
+    assert(buffer_cache_destroy(cache) == 0);
+    block_device_close(device);
+    assert(latency_model_set("none") == 0);
+
+    /* The file system reads hot files from its cache */
+    assert(tfs_init() != -1);
+    int f = tfs_open("/f", TFS_O_CREAT);
+    assert(f != -1);
+    memset(block, 'f', BLOCK_SIZE);
+    assert(tfs_write(f, block, BLOCK_SIZE) == BLOCK_SIZE);
+
+    buffer_cache_stats_t before;
+    data_block_cache_stats(&before);
+    for (int i = 0; i < READS; i++) {
+        assert(tfs_pread(f, block, BLOCK_SIZE, 0) == BLOCK_SIZE);
+    }
+    data_block_cache_stats(&stats);
+    assert(stats.bs_hits >= before.bs_hits + READS);
+    assert(stats.bs_misses == before.bs_misses);
+
+    assert(tfs_close(f) != -1);
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,88 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+#define THREADS (16)
+#define ROUNDS (200)
+
+/*  Checks that threads can create, write and read their own files, and read
+    a shared file, all at the same time, and that creating the same file from
+    several threads yields a single file.
+    Note: This test uses TecnicoFS as a library, not
+    as a standalone server.
+*/
+
+char shared_contents[BLOCK_SIZE];
+
+void *fn_thread(void *arg) {
+    int id = *(int *)arg;
+    char path[32];
+    char buffer[BLOCK_SIZE];
+
+    /* Every thread races to create this one */
+    int f = tfs_open("/common", TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_close(f) != -1);
+
+    sprintf(path, "/file-%02d", id);
+    f = tfs_open(path, TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_write(f, path, strlen(path)) == strlen(path));
+    assert(tfs_close(f) != -1);
+
+    int shared = tfs_open("/shared", 0);
+    assert(shared != -1);
+
+    for (int i = 0; i < ROUNDS; i++) {
+        assert(tfs_pread(shared, buffer, sizeof(buffer), 0) == BLOCK_SIZE);
+        assert(memcmp(buffer, shared_contents, BLOCK_SIZE) == 0);
+
+        f = tfs_open(path, 0);
+        assert(f != -1);
+        assert(tfs_read(f, buffer, sizeof(buffer)) == strlen(path));
+        assert(memcmp(buffer, path, strlen(path)) == 0);
+        assert(tfs_close(f) != -1);
+    }
+
+    assert(tfs_close(shared) != -1);
+
+    return NULL;
+}
+
+int main() {
+    int ids[THREADS];
+    pthread_t tid[THREADS];
+
+    for (int i = 0; i < BLOCK_SIZE; i++) {
+        shared_contents[i] = (char)('a' + i % 26);
+    }
+
+    assert(tfs_init() != -1);
+
+    int f = tfs_open("/shared", TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_write(f, shared_contents, BLOCK_SIZE) == BLOCK_SIZE);
+    assert(tfs_close(f) != -1);
+
+    for (int i = 0; i < THREADS; i++) {
+        ids[i] = i;
+        assert(pthread_create(&tid[i], NULL, fn_thread, &ids[i]) == 0);
+    }
+    for (int i = 0; i < THREADS; i++) {
+        assert(pthread_join(tid[i], NULL) == 0);
+    }
+
+    /* "/shared", "/common" and one file per thread */
+    dir_entry_t entries[MAX_DIR_ENTRIES];
+    char cursor[MAX_FILE_NAME] = "";
+    assert(tfs_list_prefix("/", "", cursor, entries, MAX_DIR_ENTRIES) ==
+           THREADS + 2);
+
+    assert(tfs_destroy_after_all_closed() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,106 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define EXTERNAL "/tmp/tfs_copy_external_test.txt"
+
+/*  Checks the copies between TecnicoFS and the main file system, both ways:
+    whole files (empty or full) are copied and overwrite the destination,
+    and copies whose source does not exist or does not fit fail without
+    changing the destination.
+    Note: This test uses TecnicoFS as a library, not
+    as a standalone server.
+*/
+
+void write_external(char const *path, char const *contents, size_t len) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0640);
+    assert(fd != -1);
+    assert(write(fd, contents, len) == (ssize_t)len);
+    close(fd);
+}
+
+void assert_external(char const *path, char const *contents, size_t len) {
+    char buffer[BLOCK_SIZE + 1];
+    int fd = open(path, O_RDONLY);
+    assert(fd != -1);
+    assert(read(fd, buffer, sizeof(buffer)) == (ssize_t)len);
+    assert(memcmp(buffer, contents, len) == 0);
+    close(fd);
+}
+
+void assert_contents(char const *name, char const *contents, size_t len) {
+    char buffer[BLOCK_SIZE + 1];
+    int f = tfs_open(name, 0);
+    assert(f != -1);
+    assert(tfs_read(f, buffer, sizeof(buffer)) == (ssize_t)len);
+    assert(memcmp(buffer, contents, len) == 0);
+    assert(tfs_close(f) != -1);
+}
+
+int main() {
+    static char full[BLOCK_SIZE + 1];
+    char const *text = "some contents";
+    struct stat st;
+
+    for (size_t i = 0; i < sizeof(full); i++) {
+        full[i] = (char)('a' + i % 26);
+    }
+
+    assert(tfs_init() != -1);
+
+    /* Out of TecnicoFS: a full file, over a longer one, and an empty one */
+    int f = tfs_open("/full", TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_write(f, full, BLOCK_SIZE) == BLOCK_SIZE);
+    assert(tfs_close(f) != -1);
+    write_external(EXTERNAL, full, sizeof(full));
+    assert(tfs_copy_to_external_fs("/full", EXTERNAL) == 0);
+    assert_external(EXTERNAL, full, BLOCK_SIZE);
+
+    f = tfs_open("/empty", TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_close(f) != -1);
+    assert(tfs_copy_to_external_fs("/empty", EXTERNAL) == 0);
+    assert_external(EXTERNAL, "", 0);
+
+    /* A missing source does not create the destination */
+    unlink(EXTERNAL);
+    assert(tfs_copy_to_external_fs("/missing", EXTERNAL) == -1);
+    assert(stat(EXTERNAL, &st) == -1);
+
+    /* Into TecnicoFS: a new file, over a longer one, and a full one */
+    write_external(EXTERNAL, text, strlen(text));
+    assert(tfs_copy_from_external_fs(EXTERNAL, "/new") == 0);
+    assert_contents("/new", text, strlen(text));
+    assert(tfs_copy_from_external_fs(EXTERNAL, "/full") == 0);
+    assert_contents("/full", text, strlen(text));
+
+    write_external(EXTERNAL, full, BLOCK_SIZE);
+    assert(tfs_copy_from_external_fs(EXTERNAL, "/new") == 0);
+    assert_contents("/new", full, BLOCK_SIZE);
+
+    /* A source that does not fit (or does not exist) changes nothing */
+    write_external(EXTERNAL, full, sizeof(full));
+    assert(tfs_copy_from_external_fs(EXTERNAL, "/new") == -1);
+    assert_contents("/new", full, BLOCK_SIZE);
+    assert(tfs_copy_from_external_fs(EXTERNAL, "/other") == -1);
+    assert(tfs_lookup("/other") == -1);
+    unlink(EXTERNAL);
+    assert(tfs_copy_from_external_fs(EXTERNAL, "/new") == -1);
+
+    /* A round trip keeps the contents */
+    assert(tfs_copy_to_external_fs("/new", EXTERNAL) == 0);
+    assert(tfs_copy_from_external_fs(EXTERNAL, "/copy") == 0);
+    assert_contents("/copy", full, BLOCK_SIZE);
+
+    assert(tfs_destroy() != -1);
+    unlink(EXTERNAL);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
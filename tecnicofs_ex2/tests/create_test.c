@@ -0,0 +1,78 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+#define THREADS (8)
+#define FILES_PER_THREAD (5)
+#define SHARED_FILES (4)
+
+/*  Checks that threads creating different files at the same time all get
+    their entries in the directory, and that threads racing to create the
+    same files end up with a single file each.
+    Note: This test uses TecnicoFS as a library, not
+    as a standalone server.
+*/
+
+int shared_inumbers[THREADS][SHARED_FILES];
+
+void *fn_thread(void *arg) {
+    int id = *(int *)arg;
+    char path[32];
+
+    for (int i = 0; i < FILES_PER_THREAD; i++) {
+        sprintf(path, "/t%d-%d", id, i);
+        int f = tfs_open(path, TFS_O_CREAT);
+        assert(f != -1);
+        assert(tfs_close(f) != -1);
+
+        if (i < SHARED_FILES) {
+            sprintf(path, "/shared-%d", i);
+            f = tfs_open(path, TFS_O_CREAT);
+            assert(f != -1);
+            assert(tfs_close(f) != -1);
+            shared_inumbers[id][i] = tfs_lookup(path);
+        }
+    }
+
+    return NULL;
+}
+
+int main() {
+    int ids[THREADS];
+    pthread_t tid[THREADS];
+    char path[32];
+
+    assert(tfs_init() != -1);
+
+    for (int i = 0; i < THREADS; i++) {
+        ids[i] = i;
+        assert(pthread_create(&tid[i], NULL, fn_thread, &ids[i]) == 0);
+    }
+    for (int i = 0; i < THREADS; i++) {
+        assert(pthread_join(tid[i], NULL) == 0);
+    }
+
+    for (int i = 0; i < THREADS; i++) {
+        for (int j = 0; j < FILES_PER_THREAD; j++) {
+            sprintf(path, "/t%d-%d", i, j);
+            assert(tfs_lookup(path) != -1);
+        }
+        for (int j = 0; j < SHARED_FILES; j++) {
+            assert(shared_inumbers[i][j] != -1);
+            assert(shared_inumbers[i][j] == shared_inumbers[0][j]);
+        }
+    }
+
+    dir_entry_t entries[MAX_DIR_ENTRIES];
+    char cursor[MAX_FILE_NAME] = "";
+    assert(tfs_list_prefix("/", "", cursor, entries, MAX_DIR_ENTRIES) ==
+           THREADS * FILES_PER_THREAD + SHARED_FILES);
+
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,74 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#define THREADS (4)
+
+/*  Checks that tfs_destroy waits for the operations under way, with and
+    without file handles, and that the ones that start afterwards fail.
+    Note: This test uses TecnicoFS as a library, not
+    as a standalone server.
+*/
+
+int file;
+
+void *fn_handle_thread(void *arg) {
+    (void)arg;
+    char buffer[8];
+
+    while (tfs_pwrite(file, "data", 4, 0) == 4 &&
+           tfs_pread(file, buffer, sizeof(buffer), 0) == 4) {
+    }
+
+    return NULL;
+}
+
+void *fn_name_thread(void *arg) {
+    (void)arg;
+    tfs_stat_t stat;
+
+    for (;;) {
+        int f = tfs_open("/other", TFS_O_CREAT);
+        if (f == -1 || tfs_close(f) == -1 || tfs_stat("/other", &stat) == -1) {
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+int main() {
+    pthread_t tid[THREADS];
+
+    assert(tfs_init() != -1);
+
+    file = tfs_open("/f", TFS_O_CREAT);
+    assert(file != -1);
+
+    for (int i = 0; i < THREADS; i++) {
+        assert(pthread_create(&tid[i], NULL,
+                              i % 2 == 0 ? fn_handle_thread : fn_name_thread,
+                              NULL) == 0);
+    }
+
+    struct timespec delay = {0, 20000000};
+    nanosleep(&delay, NULL);
+    assert(tfs_destroy() != -1);
+
+    for (int i = 0; i < THREADS; i++) {
+        assert(pthread_join(tid[i], NULL) == 0);
+    }
+
+    /* Nothing runs once the file system is destroyed */
+    tfs_stat_t stat;
+    assert(tfs_stat("/f", &stat) == -1);
+    assert(tfs_fstat(file, &stat) == -1);
+    assert(tfs_close(file) == -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,70 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+
+#define READERS (8)
+#define FILES (40)
+
+/*  Checks that lookups, which take no locks, keep finding every file while
+    other files are being created in the same directory (so the directory's
+    block is replaced under them), and only find new files once created.
+    Note: This test uses TecnicoFS as a library, not
+    as a standalone server.
+*/
+
+atomic_int created;
+
+void *fn_reader(void *arg) {
+    (void)arg;
+    char path[16];
+
+    while (created < FILES) {
+        int n = created;
+        for (int i = 0; i < n; i++) {
+            sprintf(path, "/f%02d", i);
+            assert(tfs_lookup(path) != -1);
+        }
+        assert(tfs_lookup("/missing") == -1);
+    }
+
+    return NULL;
+}
+
+int main() {
+    char path[16];
+    pthread_t tid[READERS];
+
+    assert(tfs_init() != -1);
+
+    for (int i = 0; i < READERS; i++) {
+        assert(pthread_create(&tid[i], NULL, fn_reader, NULL) == 0);
+    }
+
+    for (int i = 0; i < FILES; i++) {
+        sprintf(path, "/f%02d", i);
+        int f = tfs_open(path, TFS_O_CREAT);
+        assert(f != -1);
+        assert(tfs_close(f) != -1);
+        created++;
+    }
+
+    for (int i = 0; i < READERS; i++) {
+        assert(pthread_join(tid[i], NULL) == 0);
+    }
+
+    /* Every file was added once */
+    dir_entry_t entries[FILES];
+    char cursor[MAX_FILE_NAME] = "";
+    assert(tfs_list_prefix("/", "f", cursor, entries, FILES) == FILES);
+    for (int i = 0; i < FILES; i++) {
+        sprintf(path, "/f%02d", i);
+        assert(entries[i].d_inumber == tfs_lookup(path));
+    }
+
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,199 @@
+#include "fs/image.h"
+#include "fs/operations.h"
+#include <assert.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#define IMAGE "/tmp/tfs_fsck_test.img"
+#define CHECK_THREADS (4)
+#define WRITERS (4)
+#define FILES_PER_WRITER (10)
+
+/*  Checks the consistency checker: a consistent file system has no
+    problems, even while it is in use; the problems planted in an image
+    (i-nodes that are not valid, orphan i-nodes, dangling entries, blocks
+    owned twice, leaked or marked free) are all found, and repaired for
+    good.
+    Note: This test uses TecnicoFS as a library, not
+    as a standalone server.
+*/
+
+static int image_fd;
+
+void read_record(int inumber, disk_inode_t *record) {
+    off_t position = (off_t)IMAGE_INODE_BLOCK(inumber) * BLOCK_SIZE +
+                     (off_t)IMAGE_INODE_OFFSET(inumber);
+    assert(pread(image_fd, record, sizeof(*record), position) ==
+           sizeof(*record));
+}
+
+void write_record(int inumber, disk_inode_t const *record) {
+    off_t position = (off_t)IMAGE_INODE_BLOCK(inumber) * BLOCK_SIZE +
+                     (off_t)IMAGE_INODE_OFFSET(inumber);
+    assert(pwrite(image_fd, record, sizeof(*record), position) ==
+           sizeof(*record));
+}
+
+/* Sets or clears an entry of a bitmap of the image */
+void set_bit(size_t bitmap_start, int entry, bool taken) {
+    off_t position = (off_t)(bitmap_start * BLOCK_SIZE) + entry / 8;
+    unsigned char byte;
+    assert(pread(image_fd, &byte, 1, position) == 1);
+    byte = (unsigned char)(taken ? byte | (1u << (entry % 8))
+                                 : byte & ~(1u << (entry % 8)));
+    assert(pwrite(image_fd, &byte, 1, position) == 1);
+}
+
+void assert_contents(char const *name, char const *contents) {
+    char buffer[BLOCK_SIZE];
+    size_t len = strlen(contents);
+
+    int f = tfs_open(name, 0);
+    assert(f != -1);
+    assert(tfs_read(f, buffer, sizeof(buffer)) == (ssize_t)len);
+    assert(memcmp(buffer, contents, len) == 0);
+    assert(tfs_close(f) != -1);
+}
+
+void assert_consistent() {
+    fsck_report_t report;
+    assert(tfs_fsck(CHECK_THREADS, true, &report) == 0);
+    assert(report.fr_bad_inodes == 0 && report.fr_orphan_inodes == 0 &&
+           report.fr_dangling_entries == 0 && report.fr_shared_blocks == 0 &&
+           report.fr_leaked_blocks == 0 && report.fr_unmarked_blocks == 0 &&
+           report.fr_repaired == 0);
+}
+
+void *fn_writer(void *arg) {
+    char name[16];
+
+    for (int i = 0; i < FILES_PER_WRITER; i++) {
+        sprintf(name, "/w%d-%d", (int)(intptr_t)arg, i);
+        int f = tfs_open(name, TFS_O_CREAT | TFS_O_APPEND);
+        assert(f != -1);
+        assert(tfs_write(f, name, strlen(name)) == (ssize_t)strlen(name));
+        assert(tfs_close(f) != -1);
+        f = tfs_open(name, TFS_O_TRUNC);
+        assert(f != -1);
+        assert(tfs_close(f) != -1);
+    }
+
+    return NULL;
+}
+
+int main() {
+    char const *names[] = {"/a", "/b", "/c", "/d", "/e"};
+    int inumbers[5];
+    fsck_report_t report;
+
+    /* A file system in use stays consistent while it is checked */
+    assert(tfs_init() != -1);
+    pthread_t tid[WRITERS];
+    for (int i = 0; i < WRITERS; i++) {
+        assert(pthread_create(&tid[i], NULL, fn_writer, (void *)(intptr_t)i) ==
+               0);
+    }
+    for (int i = 0; i < 20; i++) {
+        assert_consistent();
+    }
+    for (int i = 0; i < WRITERS; i++) {
+        assert(pthread_join(tid[i], NULL) == 0);
+    }
+    assert_consistent();
+    assert(tfs_fsck(0, false, &report) == -1);
+    assert(tfs_destroy() != -1);
+
+    /* An image with a problem of each kind */
+    assert(tfs_init_device("file:" IMAGE) != -1);
+    for (int i = 0; i < 5; i++) {
+        int f = tfs_open(names[i], TFS_O_CREAT);
+        assert(f != -1);
+        assert(tfs_write(f, names[i], 2) == 2);
+        assert(tfs_close(f) != -1);
+        inumbers[i] = tfs_lookup(names[i]);
+    }
+    assert(tfs_destroy() != -1);
+
+    image_fd = open(IMAGE, O_RDWR);
+    assert(image_fd != -1);
+    disk_inode_t a, b, c;
+    read_record(inumbers[0], &a);
+    read_record(inumbers[1], &b);
+    read_record(inumbers[2], &c);
+
+    /* /b owns the block of /a (and its own leaks) */
+    b.di_data_block = a.di_data_block;
+    write_record(inumbers[1], &b);
+    /* a block no one owns is taken */
+    set_bit(IMAGE_BLOCK_BITMAP_START, DATA_BLOCKS - 1, true);
+    /* the block of /c is free */
+    set_bit(IMAGE_BLOCK_BITMAP_START, c.di_data_block, false);
+    /* an i-node no entry names is taken */
+    disk_inode_t orphan = {T_FILE, -1, 0};
+    write_record(INODE_TABLE_SIZE - 1, &orphan);
+    set_bit(IMAGE_INODE_BITMAP_START, INODE_TABLE_SIZE - 1, true);
+    /* the i-node of /d is free (and its block leaks) */
+    set_bit(IMAGE_INODE_BITMAP_START, inumbers[3], false);
+    /* the i-node of /e is not valid (and its block leaks) */
+    disk_inode_t bad = {7, -1, 0};
+    write_record(inumbers[4], &bad);
+    close(image_fd);
+
+    /* A check that does not repair finds them all, and changes nothing */
+    assert(tfs_init_from_image(IMAGE) != -1);
+    for (int i = 0; i < 2; i++) {
+        assert(tfs_fsck(CHECK_THREADS, false, &report) == 0);
+        assert(report.fr_inodes == 6);
+        assert(report.fr_bad_inodes == 1);
+        assert(report.fr_orphan_inodes == 1);
+        assert(report.fr_dangling_entries == 1);
+        assert(report.fr_shared_blocks == 1);
+        assert(report.fr_leaked_blocks == 4);
+        assert(report.fr_unmarked_blocks == 1);
+        assert(report.fr_repaired == 0);
+    }
+
+    /* Repairs fix every one of them */
+    assert(tfs_fsck(CHECK_THREADS, true, &report) == 0);
+    assert(report.fr_repaired == 9);
+    assert_consistent();
+
+    /* /a and /b have blocks of their own, with the same contents */
+    assert_contents("/a", "/a");
+    assert_contents("/b", "/a");
+    int f = tfs_open("/b", 0);
+    assert(f != -1);
+    assert(tfs_write(f, "/b", 2) == 2);
+    assert(tfs_close(f) != -1);
+    assert_contents("/a", "/a");
+    assert_contents("/b", "/b");
+    assert_contents("/c", "/c");
+    assert(tfs_lookup("/d") == -1);
+    assert_contents("/e", "");
+
+    /* New files do not take blocks that are in use */
+    f = tfs_open("/f", TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_write(f, "/f", 2) == 2);
+    assert(tfs_close(f) != -1);
+    assert_contents("/c", "/c");
+    assert(tfs_destroy() != -1);
+
+    /* The repairs were stored */
+    assert(tfs_init_from_image(IMAGE) != -1);
+    assert_consistent();
+    assert_contents("/a", "/a");
+    assert_contents("/b", "/b");
+    assert_contents("/c", "/c");
+    assert_contents("/f", "/f");
+    assert(tfs_destroy() != -1);
+
+    unlink(IMAGE);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
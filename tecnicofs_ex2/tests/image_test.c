@@ -0,0 +1,125 @@
+#include "fs/image.h"
+#include "fs/operations.h"
+#include <assert.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define IMAGE "/tmp/tfs_image_test.img"
+#define SNAPSHOT "/tmp/tfs_image_test_snapshot.img"
+
+/*  Checks that the file system survives restarts: its image has a
+    superblock and is block-aligned, tfs_sync stores every change in it,
+    and tfs_init_from_image brings the files back (and refuses images that
+    are not valid).
+    Note: This test uses TecnicoFS as a library, not
+    as a standalone server.
+*/
+
+void copy_image(char const *from, char const *to) {
+    static char image[IMAGE_BLOCKS * BLOCK_SIZE];
+
+    int fd = open(from, O_RDONLY);
+    assert(fd != -1);
+    assert(read(fd, image, sizeof(image)) == sizeof(image));
+    close(fd);
+
+    fd = open(to, O_WRONLY | O_CREAT | O_TRUNC, 0640);
+    assert(fd != -1);
+    assert(write(fd, image, sizeof(image)) == sizeof(image));
+    close(fd);
+}
+
+void assert_contents(char const *name, char const *contents) {
+    char buffer[BLOCK_SIZE];
+    size_t len = strlen(contents);
+
+    int f = tfs_open(name, 0);
+    assert(f != -1);
+    assert(tfs_read(f, buffer, sizeof(buffer)) == (ssize_t)len);
+    assert(memcmp(buffer, contents, len) == 0);
+    assert(tfs_close(f) != -1);
+}
+
+void write_file(char const *name, char const *contents) {
+    int f = tfs_open(name, TFS_O_CREAT | TFS_O_APPEND);
+    assert(f != -1);
+    assert(tfs_write(f, contents, strlen(contents)) ==
+           (ssize_t)strlen(contents));
+    assert(tfs_close(f) != -1);
+}
+
+int main() {
+    struct stat st;
+    superblock_t superblock;
+
+    /* A new image is formatted with its superblock, and holds every region */
+    assert(tfs_init_device("file:" IMAGE) != -1);
+    assert(stat(IMAGE, &st) == 0);
+    assert((size_t)st.st_size == IMAGE_BLOCKS * BLOCK_SIZE);
+    int fd = open(IMAGE, O_RDONLY);
+    assert(fd != -1);
+    assert(read(fd, &superblock, sizeof(superblock)) == sizeof(superblock));
+    close(fd);
+    assert(superblock.sb_magic == IMAGE_MAGIC);
+    assert(superblock.sb_block_size == BLOCK_SIZE);
+    assert(superblock.sb_data_start == IMAGE_DATA_START);
+
+    /* tfs_sync stores the files as they are then */
+    write_file("/a", "first file");
+    write_file("/b", "second ");
+    int f = tfs_open("/b", TFS_O_APPEND);
+    assert(f != -1);
+    assert(tfs_sync() == 0);
+    copy_image(IMAGE, SNAPSHOT);
+
+    assert(tfs_write(f, "file", 4) == 4);
+    assert(tfs_close(f) != -1);
+    write_file("/c", "third file");
+    assert(tfs_destroy() != -1);
+
+    assert(tfs_init_from_image(SNAPSHOT) != -1);
+    assert_contents("/a", "first file");
+    assert_contents("/b", "second ");
+    assert(tfs_lookup("/c") == -1);
+    assert(tfs_destroy() != -1);
+
+    /* tfs_destroy stores the rest */
+    assert(tfs_init_from_image(IMAGE) != -1);
+    assert_contents("/a", "first file");
+    assert_contents("/b", "second file");
+    assert_contents("/c", "third file");
+
+    /* A loaded image keeps storing changes, and new files take free
+     * i-nodes and blocks */
+    write_file("/a", ", changed");
+    write_file("/d", "fourth file");
+    assert(tfs_destroy() != -1);
+
+    assert(tfs_init_from_image(IMAGE) != -1);
+    assert_contents("/a", "first file, changed");
+    assert_contents("/b", "second file");
+    assert_contents("/c", "third file");
+    assert_contents("/d", "fourth file");
+    assert(tfs_destroy() != -1);
+
+    /* Images that do not exist or are not valid are refused */
+    assert(tfs_init_from_image("/tmp/tfs_image_test_missing.img") == -1);
+    fd = open(SNAPSHOT, O_WRONLY);
+    assert(fd != -1);
+    assert(pwrite(fd, "XXXX", 4, 0) == 4);
+    close(fd);
+    assert(tfs_init_from_image(SNAPSHOT) == -1);
+    assert(truncate(SNAPSHOT, BLOCK_SIZE) == 0);
+    assert(tfs_init_from_image(SNAPSHOT) == -1);
+    assert(tfs_sync() == -1);
+
+    unlink(IMAGE);
+    unlink(SNAPSHOT);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
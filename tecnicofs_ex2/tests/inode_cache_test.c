@@ -0,0 +1,102 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+#define ROUNDS (20)
+
+/*  Checks that i-nodes are kept in memory: once a file was used, looking it
+    up costs no storage accesses, and small writes read nothing either and
+    log its i-node once per transaction of the journal, however many writes
+    the transaction covers.
+    Note: This test uses TecnicoFS as a library, not
+    as a standalone server.
+*/
+
+block_device_stats_t last;
+
+/*
+ * Counts the reads and writes of the device since the last call
+ */
+void device_accesses(uint64_t *reads, uint64_t *writes) {
+    block_device_stats_t stats;
+
+    state_device_stats(&stats);
+    *reads = stats.ds_reads - last.ds_reads;
+    *writes = stats.ds_writes - last.ds_writes;
+    last = stats;
+}
+
+/*
+ * Stores every change in place, so that nothing is left for the journal to
+ * write in the background
+ */
+void quiesce() {
+    assert(tfs_sync() == 0);
+    assert(metadata_checkpoint() == 0);
+}
+
+int main() {
+    char const *path = "/f";
+    tfs_stat_t stat;
+    char buffer[8];
+    uint64_t reads, writes;
+    journal_stats_t before, after;
+
+    assert(tfs_init() != -1);
+
+    int f = tfs_open(path, TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_write(f, "data", 4) == 4);
+    assert(tfs_close(f) != -1);
+    quiesce();
+
+    /* Hot i-nodes (and directory blocks) are not read again */
+    device_accesses(&reads, &writes);
+    for (int i = 0; i < ROUNDS; i++) {
+        assert(tfs_stat(path, &stat) == 0);
+        assert(stat.st_size == 4);
+    }
+    device_accesses(&reads, &writes);
+    assert(reads == 0 && writes == 0);
+
+    /* Open, write a few bytes and close: only the i-node's block is logged,
+     * once for all the writes a transaction covers */
+    metadata_journal_stats(&before);
+    for (int i = 0; i < ROUNDS; i++) {
+        f = tfs_open(path, TFS_O_APPEND);
+        assert(f != -1);
+        assert(tfs_write(f, "more", 4) == 4);
+        assert(tfs_close(f) != -1);
+    }
+    device_accesses(&reads, &writes);
+    assert(reads == 0);
+    quiesce();
+    metadata_journal_stats(&after);
+    assert(after.js_blocks_logged - before.js_blocks_logged <=
+           after.js_commits - before.js_commits);
+    assert(after.js_commits - before.js_commits <= ROUNDS);
+
+    /* Every change was kept */
+    f = tfs_open(path, 0);
+    assert(f != -1);
+    assert(tfs_pread(f, buffer, 8, 0) == 8);
+    assert(memcmp(buffer, "datamore", 8) == 0);
+    assert(tfs_stat(path, &stat) == 0);
+    assert(stat.st_size == 4 + ROUNDS * 4);
+    assert(tfs_close(f) != -1);
+
+    /* A file that was only read is not written back on close */
+    device_accesses(&reads, &writes);
+    f = tfs_open(path, 0);
+    assert(f != -1);
+    assert(tfs_close(f) != -1);
+    device_accesses(&reads, &writes);
+    assert(reads == 0 && writes == 0);
+
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
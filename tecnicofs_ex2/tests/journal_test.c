@@ -0,0 +1,173 @@
+#include "fs/journal.h"
+#include "fs/operations.h"
+#include <assert.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#define IMAGE "/tmp/tfs_journal_test.img"
+#define BLOCKS (16)
+#define JOURNAL_START (1)
+#define JOURNAL_SIZE (8)
+#define HOME (12)
+#define THREADS (8)
+#define ROUNDS (5)
+
+/*  Checks the metadata journal: committed blocks survive a crash (they are
+    replayed when the journal is opened again), transactions that were not
+    written whole are ignored, checkpoints write the blocks in place, and
+    threads committing at the same time share commits.
+    Note: This test uses TecnicoFS as a library, not
+    as a standalone server.
+*/
+
+/* What the next commit logs: a block of this byte at this home */
+static atomic_char next_fill;
+static int next_home;
+static int checkpoints;
+
+int collect(journal_t *journal, void *arg) {
+    (void)arg;
+    char block[BLOCK_SIZE];
+
+    char fill = atomic_exchange(&next_fill, 0);
+    if (fill == 0) {
+        return 0;
+    }
+    memset(block, fill, BLOCK_SIZE);
+    return journal_log(journal, next_home, block);
+}
+
+void committed(void *arg) { (void)arg; }
+
+void checkpointed(void *arg) {
+    (void)arg;
+    checkpoints++;
+}
+
+static journal_ops_t const ops = {collect, committed, checkpointed, NULL};
+
+/* Returns whether a block of the device is filled with a byte */
+bool block_filled(block_device_t *device, int block, char fill) {
+    char buffer[BLOCK_SIZE];
+    assert(block_device_read(device, block, 0, buffer, BLOCK_SIZE) == 0);
+    for (size_t i = 0; i < BLOCK_SIZE; i++) {
+        if (buffer[i] != fill) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Commits a block, and "crashes": closes the journal and the device without
+ * a checkpoint */
+void commit_and_crash(int home, char fill) {
+    block_device_t *device = block_device_load("file:" IMAGE, BLOCKS);
+    assert(device != NULL);
+    journal_t *journal =
+        journal_open(device, JOURNAL_START, JOURNAL_SIZE, &ops);
+    assert(journal != NULL);
+
+    next_home = home;
+    atomic_store(&next_fill, fill);
+    assert(journal_commit(journal) == 0);
+    assert(block_filled(device, home, 0));
+
+    journal_close(journal);
+    block_device_close(device);
+}
+
+void *fn_thread(void *arg) {
+    char name[16];
+    sprintf(name, "/f%d", (int)(intptr_t)arg);
+
+    for (int i = 0; i < ROUNDS; i++) {
+        int f = tfs_open(name, TFS_O_CREAT | TFS_O_APPEND);
+        assert(f != -1);
+        assert(tfs_write(f, "x", 1) == 1);
+        assert(tfs_fsync(f) == 0);
+        assert(tfs_close(f) != -1);
+    }
+
+    return NULL;
+}
+
+int main() {
+    journal_stats_t stats;
+
+    assert(latency_model_set("none") == 0);
+    block_device_t *device = block_device_open("file:" IMAGE, BLOCKS);
+    assert(device != NULL);
+    assert(journal_format(device, JOURNAL_START, JOURNAL_SIZE) == 0);
+    block_device_close(device);
+
+    /* A committed block is only in the log, and reaches its home when the
+     * journal is opened again */
+    commit_and_crash(HOME, 'a');
+    device = block_device_load("file:" IMAGE, BLOCKS);
+    assert(device != NULL);
+    assert(block_filled(device, HOME, 0));
+    journal_t *journal =
+        journal_open(device, JOURNAL_START, JOURNAL_SIZE, &ops);
+    assert(journal != NULL);
+    assert(block_filled(device, HOME, 'a'));
+    journal_stats(journal, &stats);
+    assert(stats.js_replayed == 1);
+    journal_close(journal);
+    block_device_close(device);
+
+    /* A transaction whose checksum does not match is not replayed (its
+     * image follows its descriptor, after the header) */
+    commit_and_crash(HOME + 1, 'b');
+    int fd = open(IMAGE, O_WRONLY);
+    assert(fd != -1);
+    assert(pwrite(fd, "!", 1, (JOURNAL_START + 2) * BLOCK_SIZE + 7) == 1);
+    close(fd);
+    device = block_device_load("file:" IMAGE, BLOCKS);
+    assert(device != NULL);
+    journal = journal_open(device, JOURNAL_START, JOURNAL_SIZE, &ops);
+    assert(journal != NULL);
+    assert(block_filled(device, HOME + 1, 0));
+    journal_stats(journal, &stats);
+    assert(stats.js_replayed == 0);
+
+    /* A checkpoint writes the logged blocks in place */
+    next_home = HOME + 2;
+    atomic_store(&next_fill, 'c');
+    assert(journal_commit(journal) == 0);
+    assert(block_filled(device, HOME + 2, 0));
+    assert(journal_checkpoint(journal) == 0);
+    assert(block_filled(device, HOME + 2, 'c'));
+    assert(checkpoints == 1);
+
+    /* Commits with nothing to log write nothing */
+    assert(journal_commit(journal) == 0);
+    journal_stats(journal, &stats);
+    assert(stats.js_commits == 1 && stats.js_blocks_logged == 1);
+    journal_close(journal);
+    block_device_close(device);
+    unlink(IMAGE);
+
+    /* Threads that fsync at the same time share commits */
+    assert(latency_model_set("1000000:1000000:0:0") == 0);
+    assert(tfs_init_device("memory") != -1);
+    pthread_t tid[THREADS];
+    for (int i = 0; i < THREADS; i++) {
+        assert(pthread_create(&tid[i], NULL, fn_thread, (void *)(intptr_t)i) ==
+               0);
+    }
+    for (int i = 0; i < THREADS; i++) {
+        assert(pthread_join(tid[i], NULL) == 0);
+    }
+    metadata_journal_stats(&stats);
+    assert(stats.js_commit_requests == THREADS * ROUNDS);
+    assert(stats.js_commits < stats.js_commit_requests / 2);
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
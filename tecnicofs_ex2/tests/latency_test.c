@@ -0,0 +1,92 @@
+#include "fs/block_device.h"
+#include "fs/operations.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <time.h>
+
+#define THREADS (4)
+#define ACCESSES (10)
+#define MS (1000000u)
+
+/*  Checks the latency model of the emulated storage: random accesses cost
+    more than sequential ones, a queue depth of one serializes the threads
+    while a deeper queue lets them overlap, and the bandwidth is shared.
+    Note: This test uses TecnicoFS as a library, not
+    as a standalone server.
+*/
+
+uint64_t now() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+}
+
+void *fn_thread(void *arg) {
+    size_t id = *(size_t *)arg;
+
+    for (size_t i = 0; i < ACCESSES; i++) {
+        /* Far apart from each other, so every access is random */
+        storage_access((id * ACCESSES + i) * 2 * BLOCK_SIZE, BLOCK_SIZE);
+    }
+
+    return NULL;
+}
+
+/* Returns how long the threads took to access the storage */
+uint64_t run_threads() {
+    pthread_t tid[THREADS];
+    size_t ids[THREADS];
+
+    uint64_t start = now();
+    for (size_t i = 0; i < THREADS; i++) {
+        ids[i] = i;
+        assert(pthread_create(&tid[i], NULL, fn_thread, &ids[i]) == 0);
+    }
+    for (size_t i = 0; i < THREADS; i++) {
+        assert(pthread_join(tid[i], NULL) == 0);
+    }
+
+    return now() - start;
+}
+
+int main() {
+    assert(latency_model_set("ssd") == 0);
+    assert(latency_model_get()->lm_queue_depth == 32);
+    assert(latency_model_set("floppy") == -1);
+    assert(latency_model_set("1:2:3") == -1);
+
+    /* Sequential accesses are cheap, random ones are not */
+    assert(latency_model_set("0:2000000:0:0") == 0);
+    uint64_t start = now();
+    for (size_t i = 0; i < ACCESSES; i++) {
+        storage_access(i * BLOCK_SIZE, BLOCK_SIZE);
+    }
+    assert(now() - start < 2 * 2 * MS);
+
+    /* 1 ms per access: serialized, or overlapped across the threads */
+    assert(latency_model_set("1000000:1000000:1:0") == 0);
+    assert(run_threads() >= THREADS * ACCESSES * MS);
+
+    assert(latency_model_set("1000000:1000000:4:0") == 0);
+    uint64_t overlapped = run_threads();
+    assert(overlapped >= ACCESSES * MS);
+    assert(overlapped < THREADS * ACCESSES * MS);
+
+    /* 1 KB per ms, shared by all threads */
+    assert(latency_model_set("0:0:0:1024000") == 0);
+    assert(run_threads() >= THREADS * ACCESSES * MS);
+
+    /* The file system runs on a given profile */
+    assert(latency_model_set("ssd") == 0);
+    assert(tfs_init() != -1);
+    int f = tfs_open("/f", TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_write(f, "data", 4) == 4);
+    assert(tfs_close(f) != -1);
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,79 @@
+#include "fs/image.h"
+#include "fs/operations.h"
+#include <assert.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#define IMAGE "/tmp/tfs_lazy_mount_test.img"
+#define FILES (8)
+
+/*  Checks that mounting an image only reads its superblock and journal:
+    i-nodes (and the blocks of the bitmaps) are read when first used, and
+    the blocks of the i-node table are still stored whole.
+    Note: This test uses TecnicoFS as a library, not
+    as a standalone server.
+*/
+
+int main() {
+    char name[16];
+    tfs_stat_t stat;
+
+    assert(latency_model_set("none") == 0);
+    assert(tfs_init_device("file:" IMAGE) != -1);
+    for (int i = 0; i < FILES; i++) {
+        sprintf(name, "/f%d", i);
+        int f = tfs_open(name, TFS_O_CREAT);
+        assert(f != -1);
+        assert(tfs_write(f, name, strlen(name)) == (ssize_t)strlen(name));
+        assert(tfs_close(f) != -1);
+    }
+    int broken = tfs_lookup("/f1");
+    assert(broken != -1);
+    assert(tfs_destroy() != -1);
+
+    /* The i-nodes that were not read are stored whole when others in their
+     * block change */
+    assert(tfs_init_from_image(IMAGE) != -1);
+    int f = tfs_open("/new", TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_close(f) != -1);
+    assert(tfs_destroy() != -1);
+
+    assert(tfs_init_from_image(IMAGE) != -1);
+    for (int i = 0; i < FILES; i++) {
+        char buffer[16];
+        sprintf(name, "/f%d", i);
+        f = tfs_open(name, 0);
+        assert(f != -1);
+        assert(tfs_read(f, buffer, sizeof(buffer)) == (ssize_t)strlen(name));
+        assert(memcmp(buffer, name, strlen(name)) == 0);
+        assert(tfs_close(f) != -1);
+    }
+    assert(tfs_lookup("/new") != -1);
+    assert(tfs_destroy() != -1);
+
+    /* Mounting does not read the i-nodes: a file whose i-node is not valid
+     * in the image only fails once used */
+    int fd = open(IMAGE, O_WRONLY);
+    assert(fd != -1);
+    uint32_t type = 7;
+    off_t position = (off_t)IMAGE_INODE_BLOCK(broken) * BLOCK_SIZE +
+                     (off_t)IMAGE_INODE_OFFSET(broken);
+    assert(pwrite(fd, &type, sizeof(type), position) == sizeof(type));
+    close(fd);
+    assert(tfs_init_from_image(IMAGE) != -1);
+    assert(tfs_stat("/f0", &stat) == 0);
+    assert(tfs_stat("/f1", &stat) == -1);
+    assert(tfs_open("/f1", 0) == -1);
+    assert(tfs_stat("/f2", &stat) == 0);
+    assert(stat.st_type == T_FILE && stat.st_size == 3);
+    assert(tfs_destroy() != -1);
+
+    unlink(IMAGE);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
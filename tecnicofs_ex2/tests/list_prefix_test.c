@@ -0,0 +1,88 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+/*  Checks that tfs_list_prefix returns the files of the root directory in
+    name order, filtered by prefix, and that the cursor allows the listing
+    to be resumed in several calls.
+    Note: This test uses TecnicoFS as a library, not
+    as a standalone server.
+*/
+
+int main() {
+    char *paths[] = {"/shard-0042-b", "/zeta",         "/shard-0042-a",
+                     "/shard-0041-a", "/shard-0042-c", "/alpha"};
+    size_t n_paths = sizeof(paths) / sizeof(paths[0]);
+
+    dir_entry_t entries[MAX_DIR_ENTRIES];
+    char cursor[MAX_FILE_NAME] = "";
+
+    assert(tfs_init() != -1);
+
+    for (size_t i = 0; i < n_paths; i++) {
+        int f = tfs_open(paths[i], TFS_O_CREAT);
+        assert(f != -1);
+        assert(tfs_close(f) != -1);
+    }
+
+    /* Every file, sorted */
+    assert(tfs_list_prefix("/", "", cursor, entries, MAX_DIR_ENTRIES) == 6);
+    assert(strcmp(entries[0].d_name, "alpha") == 0);
+    assert(strcmp(entries[1].d_name, "shard-0041-a") == 0);
+    assert(strcmp(entries[5].d_name, "zeta") == 0);
+    assert(entries[5].d_inumber == tfs_lookup("/zeta"));
+    assert(tfs_list_prefix("/", "", cursor, entries, MAX_DIR_ENTRIES) == 0);
+
+    /* Prefix listing, two entries at a time */
+    memset(cursor, 0, sizeof(cursor));
+    assert(tfs_list_prefix("/", "shard-0042-", cursor, entries, 2) == 2);
+    assert(strcmp(entries[0].d_name, "shard-0042-a") == 0);
+    assert(strcmp(entries[1].d_name, "shard-0042-b") == 0);
+    assert(tfs_list_prefix("/", "shard-0042-", cursor, entries, 2) == 1);
+    assert(strcmp(entries[0].d_name, "shard-0042-c") == 0);
+    assert(tfs_list_prefix("/", "shard-0042-", cursor, entries, 2) == 0);
+
+    /* Lookups still find every file */
+    for (size_t i = 0; i < n_paths; i++) {
+        assert(tfs_lookup(paths[i]) != -1);
+    }
+    assert(tfs_lookup("/shard-0042") == -1);
+
+    assert(tfs_list_prefix("/f1", "", cursor, entries, 1) == -1);
+
+    /* Names are stored with their length, so long names are kept whole
+       instead of being truncated and short names pack densely */
+    char path[MAX_FILE_NAME + 2];
+    path[0] = '/';
+    memset(path + 1, 'x', MAX_FILE_NAME);
+    path[MAX_FILE_NAME + 1] = 0;
+    assert(tfs_open(path, TFS_O_CREAT) == -1);
+
+    path[MAX_FILE_NAME] = 0;
+    int f = tfs_open(path, TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_close(f) != -1);
+    assert(tfs_lookup(path) != -1);
+
+    path[MAX_FILE_NAME - 1] = 0;
+    assert(tfs_lookup(path) == -1);
+
+    for (int i = 0; i < 25; i++) {
+        sprintf(path, "/file-%04d", i);
+        f = tfs_open(path, TFS_O_CREAT);
+        assert(f != -1);
+        assert(tfs_close(f) != -1);
+    }
+
+    memset(cursor, 0, sizeof(cursor));
+    assert(tfs_list_prefix("/", "file-", cursor, entries, MAX_DIR_ENTRIES) ==
+           25);
+    assert(strcmp(entries[24].d_name, "file-0024") == 0);
+
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,79 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+#define THREADS (4)
+#define ROUNDS (100)
+
+/*  Checks that the lock contention statistics count the locks taken by
+    every thread, including the threads that already ended, and that they can
+    be reset (without TFS_LOCK_STATS they must stay at zero).
+    Note: This test uses TecnicoFS as a library, not
+    as a standalone server.
+*/
+
+int file;
+
+void *fn_thread(void *arg) {
+    (void)arg;
+    char buffer[16];
+
+    for (int i = 0; i < ROUNDS; i++) {
+        assert(tfs_pwrite(file, "0123456789abcdef", 16, 0) == 16);
+        assert(tfs_pread(file, buffer, 16, 0) == 16);
+    }
+
+    return NULL;
+}
+
+int main() {
+    lock_stats_t stats[LOCK_CLASSES];
+    pthread_t tid[THREADS];
+
+    assert(tfs_init() != -1);
+    lock_stats_reset();
+
+    file = tfs_open("/f", TFS_O_CREAT);
+    assert(file != -1);
+
+    for (int i = 0; i < THREADS; i++) {
+        assert(pthread_create(&tid[i], NULL, fn_thread, NULL) == 0);
+    }
+    for (int i = 0; i < THREADS; i++) {
+        assert(pthread_join(tid[i], NULL) == 0);
+    }
+
+    lock_stats_collect(stats);
+    for (int i = 0; i < LOCK_CLASSES; i++) {
+        assert(lock_class_name(i) != NULL);
+        assert(stats[i].ls_contended <= stats[i].ls_acquires);
+    }
+
+#ifdef TFS_LOCK_STATS
+    /* Each read and write takes the i-node lock and a range of the file */
+    assert(stats[LOCK_INODE].ls_acquires >= 2 * THREADS * ROUNDS);
+    assert(stats[LOCK_RANGE].ls_acquires >= 4 * THREADS * ROUNDS);
+    assert(stats[LOCK_CREATE].ls_acquires == 1);
+    assert(stats[LOCK_FREE_INODES].ls_acquires == 1);
+    assert(stats[LOCK_INODE].ls_hold_ns > 0);
+#else
+    assert(stats[LOCK_INODE].ls_acquires == 0);
+#endif
+
+    lock_stats_print(stdout);
+
+    lock_stats_reset();
+    lock_stats_collect(stats);
+    for (int i = 0; i < LOCK_CLASSES; i++) {
+        assert(stats[i].ls_acquires == 0);
+    }
+
+    assert(tfs_close(file) != -1);
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,75 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define HANDLES (100000)
+#define THREADS (8)
+#define ROUNDS (10000)
+
+/*  Checks that the open file table grows past its initial chunk, that
+    closed (stale) handles are rejected even after their entry is reused,
+    and that handles can be taken and released from several threads.
+    Note: This test uses TecnicoFS as a library, not
+    as a standalone server.
+*/
+
+void *fn_thread(void *arg) {
+    (void)arg;
+
+    for (int i = 0; i < ROUNDS; i++) {
+        int f = tfs_open("/f1", 0);
+        assert(f != -1);
+        assert(tfs_close(f) != -1);
+        assert(tfs_close(f) == -1);
+    }
+
+    return NULL;
+}
+
+int main() {
+    int *handles = malloc(sizeof(int) * HANDLES);
+    assert(handles != NULL);
+
+    assert(tfs_init() != -1);
+
+    int f = tfs_open("/f1", TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_close(f) != -1);
+
+    for (int i = 0; i < HANDLES; i++) {
+        handles[i] = tfs_open("/f1", 0);
+        assert(handles[i] != -1);
+    }
+
+    for (int i = 0; i < HANDLES; i++) {
+        assert(tfs_close(handles[i]) != -1);
+    }
+
+    /* The entry of a closed handle is reused, but the old handle stays
+       invalid */
+    int stale = handles[0];
+    f = tfs_open("/f1", 0);
+    assert(f != -1);
+    assert(f != stale);
+    assert(tfs_close(stale) == -1);
+    char c;
+    assert(tfs_read(stale, &c, 1) == -1);
+    assert(tfs_close(f) != -1);
+
+    pthread_t tid[THREADS];
+    for (int i = 0; i < THREADS; i++) {
+        assert(pthread_create(&tid[i], NULL, fn_thread, NULL) == 0);
+    }
+    for (int i = 0; i < THREADS; i++) {
+        assert(pthread_join(tid[i], NULL) == 0);
+    }
+
+    assert(tfs_destroy() != -1);
+    free(handles);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,54 @@
+#include "client/tecnicofs_client_api.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+/*  Checks that tfs_pwrite and tfs_pread access the given offsets and leave
+    the offset of the file handle untouched.
+*/
+
+int main(int argc, char **argv) {
+
+    char buffer[40];
+
+    if (argc < 3) {
+        printf("You must provide the following arguments: 'client_pipe_path "
+               "server_pipe_path'\n");
+        return 1;
+    }
+
+    assert(tfs_mount(argv[1], argv[2]) == 0);
+
+    int f = tfs_open("/pfile", TFS_O_CREAT);
+    assert(f != -1);
+
+    /* Past the end of the file: the gap reads as zeros */
+    assert(tfs_pwrite(f, "world", 5, 6) == 5);
+    assert(tfs_pwrite(f, "hello", 5, 0) == 5);
+
+    /* The handle's offset is still at the start of the file */
+    assert(tfs_read(f, buffer, 3) == 3);
+    assert(memcmp(buffer, "hel", 3) == 0);
+
+    assert(tfs_pread(f, buffer, sizeof(buffer), 0) == 11);
+    assert(memcmp(buffer, "hello\0world", 11) == 0);
+
+    assert(tfs_pread(f, buffer, 3, 8) == 3);
+    assert(memcmp(buffer, "rld", 3) == 0);
+    assert(tfs_pread(f, buffer, 3, 11) == 0);
+    assert(tfs_pread(f, buffer, 3, 100) == 0);
+
+    /* tfs_pread did not move the handle's offset either */
+    assert(tfs_read(f, buffer, 2) == 2);
+    assert(memcmp(buffer, "lo", 2) == 0);
+
+    assert(tfs_close(f) != -1);
+    assert(tfs_pread(f, buffer, 3, 0) == -1);
+    assert(tfs_pwrite(f, "x", 1, 0) == -1);
+
+    assert(tfs_unmount() == 0);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,115 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+#define WRITERS (8)
+#define SLICE (BLOCK_SIZE / WRITERS)
+#define ROUNDS (500)
+
+/*  Checks that disjoint byte ranges of a file can be locked at the same time
+    (shared ranges too, even if they overlap), and that writers that each own
+    a slice of a file can update it concurrently while readers never see a
+    slice half written.
+    Note: This test uses TecnicoFS as a library, not
+    as a standalone server.
+*/
+
+int file;
+int inumber;
+
+void *fn_lock_range(void *arg) {
+    bool exclusive = *(bool *)arg;
+    inode_range_t range;
+
+    /* Would wait forever if the main thread's range blocked this one */
+    assert(inode_range_lock(inumber, &range, 100, 200, exclusive) == 0);
+    assert(inode_range_unlock(inumber, &range) == 0);
+
+    return NULL;
+}
+
+void *fn_writer(void *arg) {
+    int id = *(int *)arg;
+    char slice[SLICE];
+
+    for (int i = 0; i < ROUNDS; i++) {
+        memset(slice, 'a' + (id + i) % 26, SLICE);
+        assert(tfs_pwrite(file, slice, SLICE, (size_t)(id * SLICE)) == SLICE);
+    }
+
+    return NULL;
+}
+
+void *fn_reader(void *arg) {
+    int id = *(int *)arg;
+    char slice[SLICE];
+
+    for (int i = 0; i < ROUNDS; i++) {
+        assert(tfs_pread(file, slice, SLICE, (size_t)(id * SLICE)) == SLICE);
+        for (int j = 1; j < SLICE; j++) {
+            assert(slice[j] == slice[0]);
+        }
+    }
+
+    return NULL;
+}
+
+int main() {
+    pthread_t tid[2 * WRITERS];
+    int ids[WRITERS];
+    inode_range_t range;
+    bool exclusive;
+
+    assert(tfs_init() != -1);
+
+    file = tfs_open("/checkpoint", TFS_O_CREAT);
+    assert(file != -1);
+    inumber = tfs_lookup("/checkpoint");
+    assert(inumber != -1);
+
+    /* Disjoint exclusive ranges */
+    assert(inode_range_lock(inumber, &range, 0, 100, true) == 0);
+    exclusive = true;
+    assert(pthread_create(&tid[0], NULL, fn_lock_range, &exclusive) == 0);
+    assert(pthread_join(tid[0], NULL) == 0);
+    assert(inode_range_unlock(inumber, &range) == 0);
+
+    /* Overlapping shared ranges */
+    assert(inode_range_lock(inumber, &range, 150, 250, false) == 0);
+    exclusive = false;
+    assert(pthread_create(&tid[0], NULL, fn_lock_range, &exclusive) == 0);
+    assert(pthread_join(tid[0], NULL) == 0);
+    assert(inode_range_unlock(inumber, &range) == 0);
+    assert(inode_range_unlock(inumber, &range) == -1);
+
+    /* Fill the file, so that every slice can be read from the start */
+    char contents[BLOCK_SIZE];
+    memset(contents, 'z', BLOCK_SIZE);
+    assert(tfs_pwrite(file, contents, BLOCK_SIZE, 0) == BLOCK_SIZE);
+
+    for (int i = 0; i < WRITERS; i++) {
+        ids[i] = i;
+        assert(pthread_create(&tid[i], NULL, fn_writer, &ids[i]) == 0);
+        assert(pthread_create(&tid[WRITERS + i], NULL, fn_reader, &ids[i]) ==
+               0);
+    }
+    for (int i = 0; i < 2 * WRITERS; i++) {
+        assert(pthread_join(tid[i], NULL) == 0);
+    }
+
+    assert(tfs_pread(file, contents, BLOCK_SIZE, 0) == BLOCK_SIZE);
+    for (int i = 0; i < WRITERS; i++) {
+        for (int j = 0; j < SLICE; j++) {
+            assert(contents[i * SLICE + j] == 'a' + (i + ROUNDS - 1) % 26);
+        }
+    }
+
+    assert(tfs_close(file) != -1);
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
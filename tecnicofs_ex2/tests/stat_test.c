@@ -0,0 +1,93 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+#define MONITORS (4)
+#define RECORD_SIZE (16)
+
+/*  Checks that tfs_stat and tfs_fstat report the type and size of files and
+    a version that changes with them, and that monitors see the size of a
+    file only grow while it is being appended to.
+    Note: This test uses TecnicoFS as a library, not
+    as a standalone server.
+*/
+
+atomic_bool done;
+
+void *fn_monitor(void *arg) {
+    (void)arg;
+    tfs_stat_t stat;
+    size_t last_size = 0;
+
+    while (!done) {
+        assert(tfs_stat("/log", &stat) == 0);
+        assert(stat.st_type == T_FILE);
+        assert(stat.st_size >= last_size);
+        assert(stat.st_size % RECORD_SIZE == 0);
+        last_size = stat.st_size;
+    }
+
+    return NULL;
+}
+
+int main() {
+    char record[RECORD_SIZE];
+    tfs_stat_t stat;
+    pthread_t tid[MONITORS];
+
+    memset(record, 'r', RECORD_SIZE);
+
+    assert(tfs_init() != -1);
+
+    assert(tfs_stat("/", &stat) == -1);
+    assert(tfs_stat("/log", &stat) == -1);
+
+    int f = tfs_open("/log", TFS_O_CREAT | TFS_O_APPEND);
+    assert(f != -1);
+
+    assert(tfs_stat("/log", &stat) == 0);
+    assert(stat.st_inumber == tfs_lookup("/log"));
+    assert(stat.st_type == T_FILE);
+    assert(stat.st_size == 0);
+    unsigned version = stat.st_version;
+
+    for (int i = 0; i < MONITORS; i++) {
+        assert(pthread_create(&tid[i], NULL, fn_monitor, NULL) == 0);
+    }
+
+    for (int i = 0; i < BLOCK_SIZE / RECORD_SIZE; i++) {
+        assert(tfs_write(f, record, RECORD_SIZE) == RECORD_SIZE);
+    }
+
+    done = true;
+    for (int i = 0; i < MONITORS; i++) {
+        assert(pthread_join(tid[i], NULL) == 0);
+    }
+
+    assert(tfs_fstat(f, &stat) == 0);
+    assert(stat.st_size == BLOCK_SIZE);
+    assert(stat.st_version != version);
+    version = stat.st_version;
+
+    /* Nothing changes when the file is full */
+    assert(tfs_write(f, record, RECORD_SIZE) == 0);
+    assert(tfs_fstat(f, &stat) == 0);
+    assert(stat.st_version == version);
+
+    int g = tfs_open("/log", TFS_O_TRUNC);
+    assert(g != -1);
+    assert(tfs_fstat(g, &stat) == 0);
+    assert(stat.st_size == 0);
+
+    assert(tfs_close(f) != -1);
+    assert(tfs_close(g) != -1);
+    assert(tfs_fstat(f, &stat) == -1);
+
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,50 @@
+#include "client/tecnicofs_client_api.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+/*  Checks that files left open by a session are closed when it unmounts:
+    the session opens files and unmounts without closing them, and a new
+    session then asks for the server to shutdown after all files are closed,
+    which would otherwise wait forever.
+    Note: this test shuts the server down.
+*/
+
+int main(int argc, char **argv) {
+
+    char *str = "AAA!";
+    char buffer[40];
+
+    if (argc < 3) {
+        printf("You must provide the following arguments: 'client_pipe_path "
+               "server_pipe_path'\n");
+        return 1;
+    }
+
+    assert(tfs_mount(argv[1], argv[2]) == 0);
+
+    int f1 = tfs_open("/f1", TFS_O_CREAT);
+    assert(f1 != -1);
+    int f2 = tfs_open("/f2", TFS_O_CREAT);
+    assert(f2 != -1);
+    assert(f1 != f2);
+
+    assert(tfs_write(f1, str, strlen(str)) == strlen(str));
+    assert(tfs_close(f2) != -1);
+    assert(tfs_close(f2) == -1);
+
+    /* Handles only exist in the session that opened them */
+    assert(tfs_unmount() == 0);
+    assert(tfs_mount(argv[1], argv[2]) == 0);
+
+    int f = tfs_open("/f1", 0);
+    assert(f != -1);
+    assert(tfs_read(f, buffer, sizeof(buffer) - 1) == strlen(str));
+    assert(tfs_close(f) != -1);
+
+    assert(tfs_shutdown_after_all_closed() == 0);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,141 @@
+#include "fs/buffer_cache.h"
+#include "fs/operations.h"
+#include <assert.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define IMAGE "/tmp/tfs_write_back_test.img"
+#define BLOCKS (16)
+#define FRAMES (4)
+#define WRITES (50)
+#define MS (1000000u)
+
+/*  Checks the write-back cache: writes return before reaching the device,
+    dirty blocks are written back when synced, once old enough, or to make
+    room for other blocks, and small writes are much faster than when the
+    cache writes through. tfs_fsync stores a file in the device.
+    Note: This test uses TecnicoFS as a library, not
+    as a standalone server.
+*/
+
+uint64_t now() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+}
+
+/* Returns how long small writes to a file take, with a given cache policy */
+uint64_t time_small_writes(char const *policy) {
+    assert(data_block_cache_policy_set(policy) == 0);
+    assert(tfs_init_device("memory") != -1);
+
+    int f = tfs_open("/f", TFS_O_CREAT);
+    assert(f != -1);
+
+    uint64_t start = now();
+    for (int i = 0; i < WRITES; i++) {
+        assert(tfs_write(f, "small", 5) == 5);
+    }
+    uint64_t elapsed = now() - start;
+
+    assert(tfs_close(f) != -1);
+    assert(tfs_destroy() != -1);
+
+    return elapsed;
+}
+
+/* Returns whether the image contains a string */
+bool image_contains(char const *string) {
+    static char image[DATA_BLOCKS * BLOCK_SIZE];
+    size_t len = strlen(string);
+
+    int fd = open(IMAGE, O_RDONLY);
+    assert(fd != -1);
+    ssize_t size = read(fd, image, sizeof(image));
+    assert(size > 0);
+    close(fd);
+
+    for (size_t i = 0; i + len <= (size_t)size; i++) {
+        if (memcmp(image + i, string, len) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+int main() {
+    char block[BLOCK_SIZE];
+    buffer_cache_stats_t stats;
+
+    /* 1 ms per access to the storage */
+    assert(latency_model_set("1000000:1000000:0:0") == 0);
+    block_device_t *device = block_device_open("memory", BLOCKS);
+    assert(device != NULL);
+    buffer_cache_t *cache =
+        buffer_cache_create(device, FRAMES, CACHE_WRITE_BACK);
+    assert(cache != NULL);
+
+    /* Writes stay in the cache until synced */
+    assert(buffer_cache_write(cache, 0, 0, "dirty", 5) == 0);
+    assert(block_device_read(device, 0, 0, block, 5) == 0);
+    assert(memcmp(block, "dirty", 5) != 0);
+    assert(buffer_cache_read(cache, 0, 0, block, 5) == 0);
+    assert(memcmp(block, "dirty", 5) == 0);
+
+    assert(buffer_cache_sync(cache, 0) == 0);
+    assert(block_device_read(device, 0, 0, block, 5) == 0);
+    assert(memcmp(block, "dirty", 5) == 0);
+    buffer_cache_stats(cache, &stats);
+    assert(stats.bs_writebacks == 1);
+
+    /* The flusher writes old dirty blocks back by itself */
+    assert(buffer_cache_write(cache, 1, 0, "aged", 4) == 0);
+    struct timespec wait = {0, (long)(3 * FLUSH_AGE_MS * MS)};
+    nanosleep(&wait, NULL);
+    buffer_cache_stats(cache, &stats);
+    assert(stats.bs_writebacks == 2);
+
+    /* More dirty blocks than frames: they are written back to make room */
+    for (int b = 0; b < BLOCKS; b++) {
+        memset(block, 'a' + b, BLOCK_SIZE);
+        assert(buffer_cache_write(cache, b, 0, block, BLOCK_SIZE) == 0);
+    }
+    for (int b = 0; b < BLOCKS; b++) {
+        assert(buffer_cache_read(cache, b, 0, block, BLOCK_SIZE) == 0);
+        assert(block[0] == 'a' + b && block[BLOCK_SIZE - 1] == 'a' + b);
+    }
+
+    /* Destroying the cache writes every dirty block back */
+    assert(buffer_cache_write(cache, 2, 0, "last", 4) == 0);
+    assert(buffer_cache_destroy(cache) == 0);
+    assert(block_device_read(device, 2, 0, block, 4) == 0);
+    assert(memcmp(block, "last", 4) == 0);
+    block_device_close(device);
+
+    /* Small writes do not wait for the storage */
+    uint64_t write_through = time_small_writes("write-through");
+    uint64_t write_back = time_small_writes("write-back");
+    assert(write_through >= WRITES * MS);
+    assert(write_back * 10 < write_through);
+    assert(data_block_cache_policy_set("write-around") == -1);
+
+    /* tfs_fsync stores the file in the device */
+    assert(latency_model_set("none") == 0);
+    assert(tfs_init_device("file:" IMAGE) != -1);
+    int f = tfs_open("/f", TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_write(f, "durable", 7) == 7);
+    assert(tfs_fsync(f) == 0);
+    assert(image_contains("durable"));
+    assert(tfs_close(f) != -1);
+    assert(tfs_fsync(f) == -1);
+    assert(tfs_destroy() != -1);
+    unlink(IMAGE);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,63 @@
+#include "client/tecnicofs_client_api.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+/*  Checks that tfs_writev writes a record made of several buffers with a
+    single request, and that tfs_readv scatters the contents back.
+*/
+
+int main(int argc, char **argv) {
+
+    char *header = "HDR:";
+    char *payload = "payload";
+    char *trailer = ";\n";
+
+    char out_header[4];
+    char out_payload[7];
+    char out_rest[20];
+
+    if (argc < 3) {
+        printf("You must provide the following arguments: 'client_pipe_path "
+               "server_pipe_path'\n");
+        return 1;
+    }
+
+    assert(tfs_mount(argv[1], argv[2]) == 0);
+
+    int f = tfs_open("/records", TFS_O_CREAT);
+    assert(f != -1);
+
+    struct iovec record[3] = {{header, strlen(header)},
+                              {payload, strlen(payload)},
+                              {trailer, strlen(trailer)}};
+
+    assert(tfs_writev(f, record, 3) == 13);
+    assert(tfs_writev(f, record, 3) == 13);
+    assert(tfs_writev(f, record, 0) == 0);
+    assert(tfs_close(f) != -1);
+
+    f = tfs_open("/records", 0);
+    assert(f != -1);
+
+    struct iovec in[3] = {{out_header, sizeof(out_header)},
+                          {out_payload, sizeof(out_payload)},
+                          {out_rest, sizeof(out_rest)}};
+
+    /* The last buffer is only partially filled, with the rest of the file */
+    assert(tfs_readv(f, in, 3) == 26);
+    assert(memcmp(out_header, "HDR:", 4) == 0);
+    assert(memcmp(out_payload, "payload", 7) == 0);
+    assert(memcmp(out_rest, ";\nHDR:payload;\n", 15) == 0);
+
+    assert(tfs_readv(f, in, 3) == 0);
+    assert(tfs_readv(f, in, TFS_IOV_MAX + 1) == -1);
+
+    assert(tfs_close(f) != -1);
+
+    assert(tfs_unmount() == 0);
+
+    printf("Successful test.\n");
+
+    return 0;
+}